@@ -0,0 +1,43 @@
+#!/bin/bash -e
+# $File: bench_profiles.sh
+# $Date: Mon Oct 19 11:35:02 2026 +0800
+# $Author: jiakai <jia.kai66@gmail.com>
+#
+# run bench.py against wftp_server started with different socket profiles
+# (see "wftp_server -h"), to compare their effect on transfer throughput
+#
+# usage: ./bench_profiles.sh [bench.py args, e.g. -b all -n 100]
+
+cd "$(dirname "$0")"
+
+PORT=${PORT:-1104}
+PYTHON=${PYTHON:-python}
+SERVER=../server/wftp_server
+mkdir -p root
+
+PROFILES=(
+	"default|"
+	"nagle|-s data:nodelay=0"
+	"bigbuf|-s data:sndbuf=4M,rcvbuf=4M"
+	"lowat|-s data:lowat=128K"
+	"bbr|-s data:cc=bbr"
+	"bulk|-s data:nodelay=0,sndbuf=4M,rcvbuf=4M,lowat=128K"
+)
+
+for i in "${PROFILES[@]}"; do
+	name=${i%%|*}
+	opts=${i#*|}
+	$SERVER -p $PORT -d root $opts 2> wftp_profile.log &
+	pid=$!
+	sleep 0.5
+	if ! kill -0 $pid 2> /dev/null; then
+		echo "== $name: server failed to start: $(tail -n 1 wftp_profile.log)"
+		continue
+	fi
+	echo "== $name ($opts)"
+	$PYTHON bench.py -u user -p pass -P $PORT "$@" 2> /dev/null
+	kill $pid
+	wait $pid 2> /dev/null || true
+done
+
+# vim: ft=sh
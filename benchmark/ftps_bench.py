@@ -0,0 +1,150 @@
+#!/usr/bin/env python3
+# $File: ftps_bench.py
+# $Date: Mon Oct 19 21:40:12 2026 +0800
+# $Author: jiakai <jia.kai66@gmail.com>
+#
+# compare transfer throughput of plain FTP and FTPS (AUTH TLS + PROT P) on
+# a local wftp_server, started with a self-signed certificate generated on
+# the fly; the server log tells whether kernel TLS is used
+#
+# usage: ./ftps_bench.py [-s size] [-n rounds] [-b path to wftp_server]
+
+import argparse
+import ftplib
+import os
+import re
+import shutil
+import socket
+import ssl
+import subprocess
+import sys
+import tempfile
+import time
+
+MB = 1024 * 1024
+
+
+def wait_port(port, timeout=5):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        try:
+            socket.create_connection(('127.0.0.1', port), 0.5).close()
+            return
+        except OSError:
+            time.sleep(0.05)
+    sys.exit('server did not start on port %d' % port)
+
+
+def connect(port, tls):
+    if not tls:
+        ftp = ftplib.FTP()
+    else:
+        ctx = ssl.create_default_context()
+        ctx.check_hostname = False
+        ctx.verify_mode = ssl.CERT_NONE
+        ftp = ftplib.FTP_TLS(context=ctx)
+    ftp.connect('127.0.0.1', port)
+    ftp.login('bench', 'bench')
+    if tls:
+        ftp.prot_p()
+    ftp.voidcmd('TYPE I')
+    return ftp
+
+
+def bench(ftp, name, size, rounds):
+    buf = bytearray(1024 * 1024)
+    rst = {}
+
+    start = time.time()
+    for i in range(rounds):
+        got = [0]
+
+        def on_data(data):
+            got[0] += len(data)
+        ftp.retrbinary('RETR ' + name, on_data, blocksize=len(buf))
+        assert got[0] == size, (got[0], size)
+    rst['RETR'] = size * rounds / MB / (time.time() - start)
+
+    start = time.time()
+    for i in range(rounds):
+        src = RepeatReader(size)
+        ftp.storbinary('STOR upload.bin', src, blocksize=len(buf))
+    rst['STOR'] = size * rounds / MB / (time.time() - start)
+
+    start = time.time()
+    for i in range(rounds * 10):
+        ftp.nlst()
+    rst['NLST'] = rounds * 10 / (time.time() - start)
+    return rst
+
+
+class RepeatReader:
+    """file-like object producing *size* bytes without touching the disk"""
+
+    def __init__(self, size):
+        self.left = size
+        self.chunk = os.urandom(1024 * 1024)
+
+    def read(self, n):
+        n = min(n, self.left, len(self.chunk))
+        self.left -= n
+        return self.chunk[:n]
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('-s', '--size', type=int, default=256,
+                        help='file size in MB')
+    parser.add_argument('-n', '--rounds', type=int, default=3)
+    parser.add_argument('-p', '--port', type=int, default=1106)
+    parser.add_argument('-b', '--binary', default=os.path.join(
+        os.path.dirname(os.path.abspath(__file__)),
+        '../server/wftp_server'))
+    args = parser.parse_args()
+
+    tmpdir = tempfile.mkdtemp(prefix='ftps_bench.')
+    server = None
+    try:
+        cert = os.path.join(tmpdir, 'cert.pem')
+        subprocess.check_call(
+            ['openssl', 'req', '-x509', '-newkey', 'rsa:2048', '-nodes',
+             '-days', '1', '-subj', '/CN=localhost', '-keyout', cert,
+             '-out', cert], stderr=subprocess.DEVNULL)
+        root = os.path.join(tmpdir, 'root')
+        os.mkdir(root)
+        size = args.size * MB
+        with open(os.path.join(root, 'data.bin'), 'wb') as fout:
+            chunk = os.urandom(MB)
+            for i in range(args.size):
+                fout.write(chunk)
+
+        log = open(os.path.join(tmpdir, 'server.log'), 'w+')
+        server = subprocess.Popen(
+            [args.binary, '-p', str(args.port), '-d', root, '-C', cert],
+            stderr=log)
+        wait_port(args.port)
+
+        print('%d MB file, %d rounds' % (args.size, args.rounds))
+        for tls in (False, True):
+            ftp = connect(args.port, tls)
+            rst = bench(ftp, 'data.bin', size, args.rounds)
+            ftp.quit()
+            print('%-6s RETR %8.1f MB/s  STOR %8.1f MB/s  NLST %7.1f/s' % (
+                'FTPS' if tls else 'FTP', rst['RETR'], rst['STOR'],
+                rst['NLST']))
+
+        log.seek(0)
+        for line in log:
+            if 'encrypted' in line:
+                line = re.sub(r'\x1b\[[0-9;]*m', '', line)
+                print('server:', line.split('] ', 1)[-1].strip())
+                break
+    finally:
+        if server:
+            server.terminate()
+            server.wait()
+        shutil.rmtree(tmpdir)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,58 @@
+#!/bin/bash -e
+# $File: pgo_train.sh
+# $Date: Mon Oct 19 13:05:40 2026 +0800
+# $Author: jiakai <jia.kai66@gmail.com>
+#
+# run the typical workload on an instrumented wftp binary to collect
+# profiles for "make pgo"; the binary must exit normally for profiles to be
+# written, so the server is stopped by SIGUSR1
+#
+# usage: ./pgo_train.sh server|client <path to binary>
+
+cd "$(dirname "$0")"
+
+PORT=${PORT:-1105}
+PYTHON=${PYTHON:-python}
+ROLE=$1
+BINARY=$2
+mkdir -p root
+
+if [ "$ROLE" = server ]; then
+	SERVER=$BINARY
+else
+	SERVER=../server/wftp_server
+fi
+$SERVER -p $PORT -d root 2> pgo_train.log &
+pid=$!
+trap "kill $pid 2> /dev/null || true" EXIT
+sleep 0.5
+
+if [ "$ROLE" = server ]; then
+	$PYTHON bench.py -u user -p pass -P $PORT -b transfer 2> /dev/null
+	$PYTHON bench.py -u user -p pass -P $PORT -b concurrence \
+		-n 50 -s 1M 2> /dev/null
+else
+	head -c 20M /dev/urandom > pgo_train.bin
+	for i in 1 2 3; do
+		cat <<-END
+		put pgo_train.bin
+		size pgo_train.bin
+		ls
+		get pgo_train.bin
+		mode z
+		put pgo_train.bin
+		get pgo_train.bin
+		ls
+		mode s
+		cp pgo_train.bin pgo_train_copy.bin
+		rm pgo_train_copy.bin
+		END
+	done | $BINARY localhost $PORT > /dev/null 2>> pgo_train.log
+	rm -f pgo_train.bin root/pgo_train.bin
+fi
+
+kill -USR1 $pid
+wait $pid
+trap - EXIT
+
+# vim: ft=sh
@@ -5,15 +5,25 @@
  */
 
 #include "socket.hh"
+#include "chunk.hh"
 #include "cmdparser.hh"
+#include "zstream.hh"
+#include "tar.hh"
+#include "sparse.hh"
+#include "sha256.hh"
+
+#define PIPELINE_WINDOW		256
 
 #include <iostream>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <cctype>
+#include <vector>
 
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 class AbortCurCmd { };
 class Exit {};
@@ -21,20 +31,24 @@ class Exit {};
 class WFTPClient {
 	std::shared_ptr<SocketBase> m_ctrl;
 	CMDParser m_parser;
+	bool m_mode_z = false, m_sparse = false, m_dedup = false;
 	char m_buf[1024 * 1024];
 
 	/*!
 	 * send a command and receive response
+	 * \param intermediate_ok whether to accept 3xx replies
 	 */
-	CMDPair send_cmd(const std::string &cmd) {
-		wftp_log("--> %s", cmd.c_str());
+	CMDPair send_cmd(const std::string &cmd, bool intermediate_ok = false) {
+		wftp_log("--> %s", cmd.compare(0, 5, "PASS ") ? cmd.c_str() :
+				"PASS ****");
 		m_ctrl->send((cmd + "\r\n").c_str(), cmd.length() + 2);
-		return get_resp();
+		return get_resp(intermediate_ok);
 	}
 
-	CMDPair get_resp() {
+	CMDPair get_resp(bool intermediate_ok = false) {
 		auto cmd = m_parser.recv();
-		if (cmd.cmd[0] != '1' && cmd.cmd[0] != '2') {
+		if (cmd.cmd[0] != '1' && cmd.cmd[0] != '2' &&
+				!(intermediate_ok && cmd.cmd[0] == '3')) {
 			wftp_log("bad response: %s %s",
 					cmd.cmd.c_str(), cmd.arg.c_str());
 			throw AbortCurCmd();
@@ -58,19 +72,54 @@ class WFTPClient {
 	}
 
 	public:
-		WFTPClient(std::shared_ptr<SocketBase> socket):
+		/*!
+		 * the password is asked on the terminal if the server requires
+		 * one
+		 */
+		WFTPClient(std::shared_ptr<SocketBase> socket,
+				const std::string &user):
 			m_ctrl(socket), m_parser(socket)
 		{
 			get_resp();
-			send_cmd("USER anonymous");
+			if (send_cmd("USER " + user, true).cmd[0] == '3')
+				send_cmd(std::string("PASS ") + getpass("password: "));
 			send_cmd("TYPE I");
 		}
 
+		/*!
+		 * enable sparse transfer extension, so holes in files are not sent
+		 */
+		void set_sparse(bool enable) {
+			send_cmd(enable ? "OPTS SPARSE ON" : "OPTS SPARSE OFF");
+			m_sparse = enable;
+		}
+
+		/*!
+		 * probe the server by SITE HASH before uploading, so known content
+		 * is not sent again
+		 */
+		void set_dedup(bool enable) {
+			m_dedup = enable;
+		}
+
+		/*!
+		 * switch between stream mode and deflate-compressed mode
+		 */
+		void set_mode_z(bool enable) {
+			send_cmd(enable ? "MODE Z" : "MODE S");
+			m_mode_z = enable;
+		}
+
 		void list(const std::string &path, FILE *fout) {
 			auto data_conn = open_pasv_data_conn();
 			send_cmd("LIST " + path);
+			std::unique_ptr<ZReceiver> zreceiver;
+			if (m_mode_z)
+				zreceiver.reset(new ZReceiver(data_conn));
 			for (;; ) {
-				size_t s = data_conn->recv(m_buf, sizeof(m_buf));
+				size_t s = zreceiver ?
+					zreceiver->recv(m_buf, sizeof(m_buf)) :
+					data_conn->recv(m_buf, sizeof(m_buf));
 				if (s <= 0)
 					break;
 				fwrite(m_buf, 1, s, fout);
@@ -79,6 +128,24 @@ class WFTPClient {
 			get_resp();
 		}
 
+		/*!
+		 * write a remote file to *fout* and keep following data appended
+		 * to it, until the server ends the transfer
+		 */
+		void tail(const std::string &remote_name, FILE *fout) {
+			auto data_conn = open_pasv_data_conn();
+			send_cmd("SITE TAIL " + remote_name);
+			for (; ; ) {
+				auto size = data_conn->recv(m_buf, sizeof(m_buf));
+				if (size <= 0)
+					break;
+				fwrite(m_buf, 1, size, fout);
+				fflush(fout);
+			}
+			data_conn->close();
+			get_resp();
+		}
+
 		void chdir(const std::string &dir) {
 			send_cmd("CWD " + dir);
 		}
@@ -88,30 +155,277 @@ class WFTPClient {
 		}
 
 		void send_file(const std::string &remote_name, FILE *fin) {
+			if (m_dedup && probe_hash(remote_name, fileno(fin)))
+				return;
 			auto data_conn = open_pasv_data_conn();
 			send_cmd("STOR " + remote_name);
-			for (; ; ) {
-				auto size = fread(m_buf, 1, sizeof(m_buf), fin);
+			std::unique_ptr<ZSender> zsender;
+			if (m_mode_z)
+				zsender.reset(new ZSender(data_conn));
+			AdaptiveChunk chunk(*data_conn, true);
+			if (m_sparse)
+				send_file_segments(fileno(fin), *data_conn, zsender.get(),
+						chunk);
+			else for (; ; ) {
+				auto size = fread(chunk.data(), 1, chunk.size(), fin);
 				if (size <= 0)
 					break;
-				data_conn->send(m_buf, size);
+				if (zsender)
+					zsender->send(chunk.data(), size);
+				else
+					data_conn->send(chunk.data(), size);
+				chunk.update(size);
 			}
+			if (zsender)
+				zsender->finish();
 			data_conn->close();
 			get_resp();
 		}
 
+		/*!
+		 * \return whether the server already has the content of *fd* and
+		 *		has stored it as *remote_name*
+		 */
+		bool probe_hash(const std::string &remote_name, int fd) {
+			auto cmd = "SITE HASH " + sha256_file(fd) + " " + remote_name;
+			wftp_log("--> %s", cmd.c_str());
+			cmd.append("\r\n");
+			m_ctrl->send(cmd.c_str(), cmd.length());
+			auto resp = m_parser.recv();
+			wftp_log("<-- %s %s", resp.cmd.c_str(), resp.arg.c_str());
+			return resp.cmd == "250";
+		}
+
+		/*!
+		 * send a file as sparse frames, skipping its holes
+		 */
+		void send_file_segments(int fd, SocketBase &data_conn,
+				ZSender *zsender, AdaptiveChunk &chunk) {
+			struct stat st;
+			if (fstat(fd, &st))
+				throw WFTPError("fstat: %m");
+			auto send = [&](const void *buf, size_t size) {
+				if (zsender)
+					zsender->send(buf, size);
+				else
+					data_conn.send(buf, size);
+			};
+			for_each_file_segment(fd, st.st_size,
+					[&](off_t offset, off_t length, bool hole) {
+				auto hdr = sparse_frame_header(hole ?
+						SPARSE_FRAME_HOLE : SPARSE_FRAME_DATA, length);
+				send(hdr.data(), hdr.size());
+				if (hole)
+					return;
+				off_t done = 0;
+				while (done < length) {
+					auto s = pread(fd, chunk.data(), std::min<off_t>(
+								chunk.size(), length - done), offset + done);
+					if (s <= 0)
+						throw WFTPError("file changed while sending");
+					send(chunk.data(), s);
+					chunk.update(s);
+					done += s;
+				}
+			});
+		}
+
 		void recv_file(const std::string &remote_name, FILE *fout) {
 			auto data_conn = open_pasv_data_conn();
 			send_cmd("RETR " + remote_name);
+			std::unique_ptr<ZReceiver> zreceiver;
+			if (m_mode_z)
+				zreceiver.reset(new ZReceiver(data_conn));
+
+			// long zero runs are stored as holes, even if not marked by the
+			// server
+			SparseWriter writer(fileno(fout));
+			SparseDecoder decoder(
+					[&writer](const char *buf, size_t size) {
+						writer.write(buf, size);
+					},
+					[&writer](uint64_t length) {
+						writer.write_hole(length);
+					});
+			AdaptiveChunk chunk(*data_conn, false);
 			for (; ; ) {
-				auto size = data_conn->recv(m_buf, sizeof(m_buf));
+				auto size = zreceiver ?
+					zreceiver->recv(chunk.data(), chunk.size()) :
+					data_conn->recv(chunk.data(), chunk.size());
 				if (size <= 0)
 					break;
-				if (fwrite(m_buf, 1, size, fout) != size)
-					throw WFTPError("failed to write locally: %m");
+				if (m_sparse)
+					decoder.feed(chunk.data(), size);
+				else
+					writer.write(chunk.data(), size);
+				chunk.update(size);
 			}
+			if (m_sparse && !decoder.at_boundary())
+				throw WFTPError("truncated sparse frame");
+			writer.finish();
+			data_conn->close();
+			get_resp();
+		}
+
+		/*!
+		 * upload local directory tree *local_dir* into *remote_dir* as a
+		 * tar stream by SITE UNTAR
+		 *
+		 * \return number of files sent
+		 */
+		int send_tree(const std::string &local_dir,
+				const std::string &remote_dir) {
+			struct stat st;
+			if (stat(local_dir.c_str(), &st) || !S_ISDIR(st.st_mode)) {
+				wftp_log("`%s' is not a directory", local_dir.c_str());
+				throw AbortCurCmd();
+			}
+			auto data_conn = open_pasv_data_conn();
+			send_cmd("SITE UNTAR " + remote_dir);
+			data_conn->set_cork(true);
+			std::unique_ptr<ZSender> zsender;
+			if (m_mode_z)
+				zsender.reset(new ZSender(data_conn));
+			auto send = [&](const void *buf, size_t size) {
+				if (zsender)
+					zsender->send(buf, size);
+				else
+					data_conn->send(buf, size);
+			};
+			int nr_file = tar_write_tree(local_dir, send,
+					[&](int fd, uint64_t size) -> uint64_t {
+						if (!zsender)
+							return data_conn->send_file(fd, 0, size);
+						uint64_t done = 0;
+						ssize_t s;
+						while (done < size && (s = pread(fd, m_buf,
+										std::min<uint64_t>(sizeof(m_buf),
+											size - done), done)) > 0) {
+							zsender->send(m_buf, s);
+							done += s;
+						}
+						return done;
+					});
+			if (zsender)
+				zsender->finish();
 			data_conn->close();
 			get_resp();
+			return nr_file;
+		}
+
+		/*!
+		 * download a remote directory tree by SITE TAR into *local_dir*,
+		 * unpacking the stream as it arrives
+		 *
+		 * \return number of files received
+		 */
+		int recv_tree(const std::string &remote_dir,
+				const std::string &local_dir) {
+			if (mkdir(local_dir.c_str(), 0755) && errno != EEXIST)
+				throw WFTPError("failed to mkdir `%s': %m",
+						local_dir.c_str());
+			auto data_conn = open_pasv_data_conn();
+			send_cmd("SITE TAR " + remote_dir);
+			std::unique_ptr<ZReceiver> zreceiver;
+			if (m_mode_z)
+				zreceiver.reset(new ZReceiver(data_conn));
+
+			int fd = -1, nr_file = 0;
+			std::string fpath;
+			TarParser parser(
+				[&](const TarEntry &entry) {
+					if (!tar_safe_path(entry.name))
+						throw WFTPError("unsafe path in tar stream: %s",
+								entry.name.c_str());
+					fpath = local_dir + "/" + entry.name;
+					if (entry.type == TarEntry::DIRECTORY) {
+						if (mkdir(fpath.c_str(), entry.mode & 0777) &&
+								errno != EEXIST)
+							throw WFTPError("failed to mkdir `%s': %m",
+									fpath.c_str());
+					} else if (entry.type == TarEntry::REGULAR) {
+						fd = open(fpath.c_str(), O_WRONLY | O_CREAT |
+								O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+								entry.mode & 0777);
+						if (fd < 0)
+							throw WFTPError("failed to open `%s': %m",
+									fpath.c_str());
+						nr_file ++;
+					}
+				},
+				[&](const char *buf, size_t size) {
+					if (fd < 0)
+						return;
+					for (size_t done = 0; done < size; ) {
+						auto s = write(fd, buf + done, size - done);
+						if (s < 0)
+							throw WFTPError("failed to write `%s': %m",
+									fpath.c_str());
+						done += s;
+					}
+				},
+				[&]() {
+					if (fd >= 0) {
+						close(fd);
+						fd = -1;
+					}
+				});
+
+			try {
+				for (; ; ) {
+					auto size = zreceiver ?
+						zreceiver->recv(m_buf, sizeof(m_buf)) :
+						data_conn->recv(m_buf, sizeof(m_buf));
+					if (size <= 0)
+						break;
+					parser.feed(m_buf, size);
+				}
+			} catch (...) {
+				if (fd >= 0)
+					close(fd);
+				throw;
+			}
+			data_conn->close();
+			get_resp();
+			if (!parser.finished())
+				throw WFTPError("tar stream truncated");
+			return nr_file;
+		}
+
+		/*!
+		 * query sizes of remote files by pipelining SIZE commands, so that the
+		 * whole batch costs about one round trip for every PIPELINE_WINDOW
+		 * files
+		 *
+		 * \return file sizes, -1 for files whose size is unavailable
+		 */
+		std::vector<long long> probe_sizes(
+				const std::vector<std::string> &names) {
+			std::vector<long long> rst;
+			for (size_t start = 0; start < names.size();
+					start += PIPELINE_WINDOW) {
+				size_t end = std::min(names.size(), start + PIPELINE_WINDOW);
+				std::string req;
+				for (size_t i = start; i < end; i ++)
+					req.append("SIZE " + names[i] + "\r\n");
+				wftp_log("--> SIZE * %d", int(end - start));
+				m_ctrl->send(req.c_str(), req.length());
+				for (size_t i = start; i < end; i ++) {
+					auto resp = m_parser.recv();
+					rst.push_back(resp.cmd == "213" ?
+							atoll(resp.arg.c_str()) : -1);
+				}
+			}
+			return rst;
+		}
+
+		/*!
+		 * copy a file on the server side
+		 */
+		void copy(const std::string &src, const std::string &dst) {
+			auto cmd = send_cmd("SITE COPY " + src + " " + dst);
+			while (cmd.cmd[0] == '1')
+				cmd = get_resp();
 		}
 
 		void pwd() {
@@ -153,6 +467,28 @@ static void interactive_console(WFTPClient &client) {
 				client.chdir(arg);
 			else if (cmd == "rm")
 				client.rm(arg);
+			else if (cmd == "size") {
+				std::vector<std::string> names;
+				std::istringstream iss(arg);
+				for (std::string i; iss >> i; )
+					names.push_back(i);
+				auto sizes = client.probe_sizes(names);
+				for (size_t i = 0; i < names.size(); i ++)
+					if (sizes[i] < 0)
+						printf("%s: unavailable\n", names[i].c_str());
+					else
+						printf("%s: %lld\n", names[i].c_str(), sizes[i]);
+			}
+			else if (cmd == "tail")
+				client.tail(arg, stdout);
+			else if (cmd == "cp") {
+				// same rule as SITE COPY: only src may contain spaces
+				auto sep = arg.rfind(' ');
+				if (sep == std::string::npos)
+					printf("usage: cp <src> <dst>\n");
+				else
+					client.copy(arg.substr(0, sep), arg.substr(sep + 1));
+			}
 			else if (cmd == "put") {
 				FILE *fin = fopen(arg.c_str(), "rb");
 				if (!fin) {
@@ -177,10 +513,47 @@ static void interactive_console(WFTPClient &client) {
 					throw;
 				}
 				fclose(fout);
+			} else if (cmd == "puttree" && arg.empty()) {
+				printf("usage: puttree <local dir> [remote dir]\n");
+			} else if (cmd == "puttree") {
+				auto sep = arg.find(' ');
+				auto local = arg.substr(0, sep),
+					 remote = sep == std::string::npos ?
+						 std::string(".") : arg.substr(sep + 1);
+				int nr = client.send_tree(local, remote);
+				printf("sent %d files into %s\n", nr, remote.c_str());
+			} else if (cmd == "gettree" && arg.empty()) {
+				printf("usage: gettree <remote dir> [local dir]\n");
+			} else if (cmd == "gettree") {
+				auto sep = arg.find(' ');
+				auto remote = arg.substr(0, sep),
+					 local = sep == std::string::npos ?
+						 basename(strdupa(remote.c_str())) :
+						 arg.substr(sep + 1);
+				int nr = client.recv_tree(remote, local);
+				printf("received %d files into %s\n", nr, local.c_str());
 			} else if (cmd == "pwd") {
 				client.pwd();
+			} else if (cmd == "sparse") {
+				if (arg == "on" || arg == "off")
+					client.set_sparse(arg == "on");
+				else
+					printf("usage: sparse <on|off>\n");
+			} else if (cmd == "dedup") {
+				if (arg == "on" || arg == "off")
+					client.set_dedup(arg == "on");
+				else
+					printf("usage: dedup <on|off>\n");
+			} else if (cmd == "mode") {
+				if (arg == "z" || arg == "Z")
+					client.set_mode_z(true);
+				else if (arg == "s" || arg == "S")
+					client.set_mode_z(false);
+				else
+					printf("usage: mode <s|z>\n");
 			} else  {
-				printf("commands: ls q cd rm put get\n");
+				printf("commands: ls q cd rm cp size put get tail puttree "
+						"gettree pwd mode sparse dedup\n");
 			}
 		} catch (AbortCurCmd) {
 		} catch (Exit) {
@@ -191,13 +564,17 @@ static void interactive_console(WFTPClient &client) {
 }
 
 int main (int argc, char **argv) {
-	if (argc != 3) {
-		fprintf(stderr, "usage: %s <host> <port>\n", argv[0]);
+	if (argc != 3 && argc != 4) {
+		fprintf(stderr, "usage: %s <host> <port> [user]\n", argv[0]);
 		return -1;
 	}
 	try {
-		WFTPClient client(SocketBase::connect(argv[1], argv[2]));
+		WFTPClient client(SocketBase::connect(argv[1], argv[2]),
+				argc == 4 ? argv[3] : "anonymous");
 		interactive_console(client);
+	} catch (AbortCurCmd) {
+		wftp_log("failed to login");
+		return -1;
 	} catch (std::exception &exc) {
 		wftp_log("unexpected exception: %s", exc.what());
 	}
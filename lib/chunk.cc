@@ -0,0 +1,105 @@
+/*
+ * $File: chunk.cc
+ * $Date: Mon Oct 19 22:10:37 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+#define CHUNK_MIN_SIZE		(64 * 1024)
+#define CHUNK_MAX_SIZE		(8 * 1024 * 1024)
+#define CHUNK_INIT_SIZE		(256 * 1024)
+
+// a chunk should take about this long to move, in microseconds
+#define CHUNK_TARGET_TIME	2000
+
+// total size of chunks in a process; each gets an equal share when there
+// are many concurrent transfers
+#define CHUNK_MEM_BUDGET	(64 * 1024 * 1024)
+
+#include "chunk.hh"
+#include "socket.hh"
+
+#include <algorithm>
+#include <atomic>
+
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+
+namespace {
+	std::atomic<size_t> nr_chunk_active{0};
+
+	//! the largest power of two not above *size*, within the size limits
+	size_t chunk_size_cap(size_t size) {
+		size_t rst = CHUNK_MIN_SIZE;
+		while (rst * 2 <= size && rst < CHUNK_MAX_SIZE)
+			rst *= 2;
+		return rst;
+	}
+}
+
+constexpr std::chrono::milliseconds AdaptiveChunk::WINDOW;
+
+AdaptiveChunk::AdaptiveChunk(SocketBase &conn, bool sending):
+	m_fd(conn.get_socket_fd()), m_sending(sending)
+{
+	auto nr = ++ nr_chunk_active;
+	resize(std::min<size_t>(CHUNK_INIT_SIZE,
+				chunk_size_cap(CHUNK_MEM_BUDGET / nr)));
+	m_win_start = clock::now();
+}
+
+AdaptiveChunk::~AdaptiveChunk() {
+	-- nr_chunk_active;
+}
+
+size_t AdaptiveChunk::nr_active() {
+	return nr_chunk_active.load(std::memory_order_relaxed);
+}
+
+void AdaptiveChunk::adjust(clock::time_point now) {
+	auto usec = std::chrono::duration_cast<std::chrono::microseconds>(
+			now - m_win_start).count();
+	auto want = m_win_bytes * CHUNK_TARGET_TIME / std::max<int64_t>(usec, 1);
+
+	// unsent bytes still in the send buffer, or received bytes not read yet
+	int queued = 0;
+	if (ioctl(m_fd, m_sending ? SIOCOUTQ : SIOCINQ, &queued))
+		queued = 0;
+	if (m_sending) {
+		// the network is the bottleneck: larger chunks would only block
+		// longer in send()
+		if (size_t(queued) >= m_size)
+			want = std::min<uint64_t>(want, m_size);
+	} else if (m_win_max < m_size)
+		// a recv returns at most what has arrived, so a buffer that is
+		// never filled is only wasted memory
+		want = std::min<uint64_t>(want, m_win_max);
+	else if (size_t(queued) >= m_size)
+		// data arrives faster than it is consumed
+		want = std::max<uint64_t>(want, m_size * 2);
+
+	// change by at most a factor of two per window
+	size_t size = m_size;
+	if (want >= m_size * 2)
+		size = m_size * 2;
+	else if (want * 2 < m_size)
+		size = m_size / 2;
+	size = std::max<size_t>(std::min(size,
+				chunk_size_cap(CHUNK_MEM_BUDGET / nr_active())),
+			CHUNK_MIN_SIZE);
+	if (size != m_size)
+		resize(size);
+
+	m_win_bytes = 0;
+	m_win_max = 0;
+	m_win_start = now;
+}
+
+void AdaptiveChunk::resize(size_t size) {
+	// the old buffer is dropped first, so that memory is returned when
+	// shrinking and not doubled when growing
+	m_buf.reset();
+	m_buf.reset(new char[size]);
+	m_size = size;
+}
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
@@ -0,0 +1,86 @@
+/*
+ * $File: chunk.hh
+ * $Date: Mon Oct 19 22:10:37 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+class SocketBase;
+
+/*!
+ * \brief transfer buffer of a data connection whose size adapts to the
+ *		connection
+ *
+ * the chunk size is a power of two, re-evaluated periodically from the
+ * measured throughput, so that moving one chunk takes a few milliseconds:
+ * slow connections use small buffers, and fast ones large chunks that
+ * amortize syscalls; occupancy of the socket buffer (SIOCOUTQ for sending,
+ * SIOCINQ for receiving) tells whether the network or this process is the
+ * bottleneck; the size is also capped by a per-process memory budget shared
+ * by all chunks alive, so each transfer gets less memory under high
+ * concurrency
+ */
+class AdaptiveChunk {
+	public:
+		/*!
+		 * \param conn connection the data is sent to (if *sending*) or
+		 *		received from
+		 */
+		AdaptiveChunk(SocketBase &conn, bool sending);
+		~AdaptiveChunk();
+
+		AdaptiveChunk(const AdaptiveChunk &) = delete;
+		AdaptiveChunk& operator = (const AdaptiveChunk &) = delete;
+
+		char* data() {
+			return m_buf.get();
+		}
+
+		//! number of bytes to move in the next chunk
+		size_t size() const {
+			return m_size;
+		}
+
+		/*!
+		 * \brief report that *done* bytes have been moved through data();
+		 *		size() and data() may change afterwards
+		 */
+		void update(size_t done) {
+			m_win_bytes += done;
+			m_win_max = std::max(m_win_max, done);
+			auto now = clock::now();
+			if (now - m_win_start >= WINDOW)
+				adjust(now);
+		}
+
+		//! number of AdaptiveChunk objects alive in this process
+		static size_t nr_active();
+
+	private:
+		typedef std::chrono::steady_clock clock;
+
+		//! period of re-evaluating the size
+		static constexpr std::chrono::milliseconds WINDOW{50};
+
+		int m_fd;
+		bool m_sending;
+		size_t m_size = 0;
+		std::unique_ptr<char[]> m_buf;
+
+		// bytes moved since m_win_start, and the largest chunk among them
+		uint64_t m_win_bytes = 0;
+		size_t m_win_max = 0;
+		clock::time_point m_win_start;
+
+		void adjust(clock::time_point now);
+		void resize(size_t size);
+};
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
@@ -11,6 +11,7 @@
 
 #include <cctype>
 #include <string>
+#include <vector>
 
 struct CMDPair {
 	std::string cmd, arg;
@@ -18,37 +19,101 @@ struct CMDPair {
 
 /*!
  * parse ftp command (command, argument)
+ *
+ * input is read in large blocks, so commands pipelined by the peer are
+ * parsed without further syscalls; in coalescing mode replies are buffered
+ * until there is no complete command left to process (or flush() is called),
+ * so that replies to pipelined commands are sent in one write
  */
 class CMDParser {
+	static constexpr size_t MAX_LINE_SIZE = 4096,
+			  RECV_SIZE = 4096,
+			  MAX_OUTBUF_SIZE = 64 * 1024;
+
 	std::shared_ptr<SocketBase> m_socket;
+	std::string m_inbuf, m_outbuf, m_last_code;
+	size_t m_inbuf_pos = 0;
+	bool m_coalesce = false;
+
+	void write(const std::string &data) {
+		if (!m_coalesce) {
+			m_socket->send(data.c_str(), data.length());
+			return;
+		}
+		m_outbuf.append(data);
+		if (m_outbuf.size() >= MAX_OUTBUF_SIZE)
+			flush();
+	}
 
 	public:
 		CMDParser(std::shared_ptr<SocketBase> socket):
 			m_socket(socket)
 		{ }
 
+		/*!
+		 * whether to buffer replies; see class description
+		 */
+		void set_coalesce(bool coalesce) {
+			m_coalesce = coalesce;
+			if (!coalesce)
+				flush();
+		}
+
+		/*!
+		 * send buffered replies
+		 */
+		void flush() {
+			if (m_outbuf.empty())
+				return;
+			m_socket->send(m_outbuf.c_str(), m_outbuf.length());
+			m_outbuf.clear();
+		}
+
+		/*!
+		 * whether a complete line has already been received
+		 */
+		bool has_pending_line() const {
+			return m_inbuf.find('\n', m_inbuf_pos) != std::string::npos;
+		}
+
+		/*!
+		 * whether any input, even a partial line, has been received but
+		 * not returned by recv(); must be false when switching the
+		 * connection to TLS, since such bytes were sent in cleartext
+		 */
+		bool has_buffered_input() const {
+			return m_inbuf_pos < m_inbuf.size();
+		}
+
 		CMDPair recv() {
-			static thread_local char buf[1024];
+			static thread_local char buf[RECV_SIZE];
 
-			CMDPair rst;
-			size_t size = 0;
-			for (; ; ) {
-				if (!m_socket->recv(buf + size, 1))
+			size_t end;
+			while ((end = m_inbuf.find('\n', m_inbuf_pos)) ==
+					std::string::npos) {
+				if (m_inbuf.size() - m_inbuf_pos > MAX_LINE_SIZE)
+					throw WFTPError("line too long");
+				flush();
+				size_t size = m_socket->recv(buf, sizeof(buf));
+				if (!size)
 					throw WFTPError(
 							"unexpected EOF when trying to find line break");
-				if (buf[size] == '\n')
-					break;
-				size ++;
+				m_inbuf.erase(0, m_inbuf_pos);
+				m_inbuf_pos = 0;
+				m_inbuf.append(buf, size);
 			}
-			if (size && buf[size - 1] == '\r')
+
+			size_t start = m_inbuf_pos, size = end - start;
+			m_inbuf_pos = end + 1;
+			if (size && m_inbuf[start + size - 1] == '\r')
 				size --;
-			buf[size] = 0;
-			rst.cmd.assign(buf);
-			for (size_t i = 0; i < size; i ++)
-				if (std::isspace(buf[i])) {
-					buf[i] = 0;
-					rst.cmd.assign(buf);
-					rst.arg.assign(buf + i + 1);
+
+			CMDPair rst;
+			rst.cmd.assign(m_inbuf, start, size);
+			for (size_t i = 0; i < rst.cmd.size(); i ++)
+				if (std::isspace(rst.cmd[i])) {
+					rst.arg.assign(rst.cmd, i + 1, std::string::npos);
+					rst.cmd.erase(i);
 					break;
 				}
 			for (auto &i: rst.cmd)
@@ -56,15 +121,38 @@ class CMDParser {
 			return rst;
 		}
 
+		/*!
+		 * code of the last reply sent
+		 */
+		const std::string& last_code() const {
+			return m_last_code;
+		}
+
 		void send(const std::string &cmd,
 				const std::string &arg = std::string()) {
 			static thread_local std::string buf;
+			m_last_code = cmd;
 			if (arg.empty())
 				buf = cmd;
 			else
 				buf = cmd + " " + arg;
 			buf.append("\r\n");
-			m_socket->send(buf.c_str(), buf.length());
+			write(buf);
+		}
+
+		/*!
+		 * send a multi-line reply: "code-first", each of *lines* prefixed by
+		 * a space, and then "code last"
+		 */
+		void send_multiline(const std::string &code, const std::string &first,
+				const std::vector<std::string> &lines,
+				const std::string &last) {
+			m_last_code = code;
+			std::string buf = code + "-" + first + "\r\n";
+			for (auto &i: lines)
+				buf.append(" " + i + "\r\n");
+			buf.append(code + " " + last + "\r\n");
+			write(buf);
 		}
 };
 
@@ -13,6 +13,8 @@
 #include <sstream>
 #include <cstdio>
 
+#include <unistd.h>
+
 class AutoCloser {
 	FILE *m_fptr;
 	public:
@@ -26,6 +28,19 @@ class AutoCloser {
 		}
 };
 
+class AutoFDCloser {
+	int m_fd;
+	public:
+		AutoFDCloser(int fd):
+			m_fd(fd)
+		{ }
+
+		~AutoFDCloser() {
+			if (m_fd >= 0)
+				close(m_fd);
+		}
+};
+
 /*!
  * \brief string stream with C printf-like functions
  */
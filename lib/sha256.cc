@@ -0,0 +1,80 @@
+/*
+ * $File: sha256.cc
+ * $Date: Mon Oct 19 16:12:05 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+#include "sha256.hh"
+#include "common.hh"
+
+#include <algorithm>
+
+#include <unistd.h>
+
+Sha256::Sha256():
+	m_ctx(EVP_MD_CTX_new())
+{
+	if (!m_ctx || !EVP_DigestInit_ex(m_ctx, EVP_sha256(), nullptr)) {
+		EVP_MD_CTX_free(m_ctx);
+		throw WFTPError("failed to init SHA-256");
+	}
+}
+
+Sha256::~Sha256() {
+	EVP_MD_CTX_free(m_ctx);
+}
+
+void Sha256::update(const void *buf, size_t size) {
+	if (!EVP_DigestUpdate(m_ctx, buf, size))
+		throw WFTPError("EVP_DigestUpdate failed");
+}
+
+void Sha256::update_zeros(uint64_t size) {
+	static const char zeros[64 * 1024] = {0};
+	while (size) {
+		auto s = std::min<uint64_t>(size, sizeof(zeros));
+		update(zeros, s);
+		size -= s;
+	}
+}
+
+std::string Sha256::hexdigest() {
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned len = 0;
+	if (!EVP_DigestFinal_ex(m_ctx, md, &len))
+		throw WFTPError("EVP_DigestFinal_ex failed");
+	static const char digits[] = "0123456789abcdef";
+	std::string rst;
+	for (unsigned i = 0; i < len; i ++) {
+		rst.push_back(digits[md[i] >> 4]);
+		rst.push_back(digits[md[i] & 0xF]);
+	}
+	return rst;
+}
+
+bool is_sha256_hex(const std::string &hex) {
+	if (hex.size() != 64)
+		return false;
+	for (char c: hex)
+		if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f')))
+			return false;
+	return true;
+}
+
+std::string sha256_file(int fd) {
+	Sha256 hasher;
+	char buf[256 * 1024];
+	off_t offset = 0;
+	for (; ; ) {
+		auto s = pread(fd, buf, sizeof(buf), offset);
+		if (s < 0)
+			throw WFTPError("read: %m");
+		if (!s)
+			break;
+		hasher.update(buf, s);
+		offset += s;
+	}
+	return hasher.hexdigest();
+}
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
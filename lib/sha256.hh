@@ -0,0 +1,51 @@
+/*
+ * $File: sha256.hh
+ * $Date: Mon Oct 19 16:12:05 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include <openssl/evp.h>
+
+/*!
+ * \brief incremental SHA-256 by OpenSSL
+ */
+class Sha256 {
+	EVP_MD_CTX *m_ctx;
+
+	public:
+		Sha256();
+		~Sha256();
+
+		Sha256(const Sha256 &) = delete;
+		Sha256& operator = (const Sha256 &) = delete;
+
+		void update(const void *buf, size_t size);
+
+		/*!
+		 * \brief feed *size* zero bytes
+		 */
+		void update_zeros(uint64_t size);
+
+		/*!
+		 * \brief finish hashing and get the digest as 64 lower-case hex
+		 *		digits; no more update() is allowed
+		 */
+		std::string hexdigest();
+};
+
+/*!
+ * \brief whether *hex* looks like a digest returned by Sha256::hexdigest()
+ */
+bool is_sha256_hex(const std::string &hex);
+
+/*!
+ * \brief hash content of a file from its beginning
+ */
+std::string sha256_file(int fd);
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
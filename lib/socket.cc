@@ -5,19 +5,29 @@
  */
 
 #define SOCKET_TIMEOUT	100
+#define CRLF_STAGE_SIZE	(64 * 1024)
 
-#define SET_TCP_NODELAY
+// smaller sends are cheaper to copy than to set up page pinning
+#define ZEROCOPY_MIN_SIZE	(16 * 1024)
+
+// reap completions once this number of zerocopy sends are pending
+#define ZEROCOPY_REAP_THRESH	16
 
 #include "socket.hh"
 #include "common.hh"
 
+#include <algorithm>
+#include <atomic>
 #include <cstdio>
 #include <cstring>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -25,6 +35,100 @@
 #include <alloca.h>
 #include <arpa/inet.h>
 #include <sys/ioctl.h>
+#include <linux/errqueue.h>
+
+namespace {
+	struct {
+		std::atomic<uint64_t> bytes_zerocopy, bytes_copied, bytes_regular,
+			nr_send;
+	} zerocopy_stats;
+}
+
+static int parse_size(const std::string &str) {
+	char unit = 0;
+	long long val;
+	if (sscanf(str.c_str(), "%lld%c", &val, &unit) < 1 || val < 0)
+		throw WFTPError("bad size: %s", str.c_str());
+	switch (unit) {
+		case 0:
+			break;
+		case 'k': case 'K':
+			val <<= 10;
+			break;
+		case 'm': case 'M':
+			val <<= 20;
+			break;
+		default:
+			throw WFTPError("bad size unit: %s", str.c_str());
+	}
+	if (val > INT32_MAX)
+		throw WFTPError("size too large: %s", str.c_str());
+	return val;
+}
+
+void SocketProfile::update(const std::string &spec) {
+	size_t start = 0;
+	while (start < spec.size()) {
+		auto end = spec.find(',', start);
+		if (end == std::string::npos)
+			end = spec.size();
+		auto item = spec.substr(start, end - start);
+		start = end + 1;
+
+		auto eq = item.find('=');
+		if (eq == std::string::npos)
+			throw WFTPError("bad socket option: %s", item.c_str());
+		auto key = item.substr(0, eq), val = item.substr(eq + 1);
+		if (key == "nodelay")
+			nodelay = parse_size(val);
+		else if (key == "sndbuf")
+			sndbuf = parse_size(val);
+		else if (key == "rcvbuf")
+			rcvbuf = parse_size(val);
+		else if (key == "lowat")
+			notsent_lowat = parse_size(val);
+		else if (key == "cc")
+			congestion = val;
+		else
+			throw WFTPError("unknown socket option: %s", key.c_str());
+	}
+}
+
+void SocketProfile::check() const {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		throw WFTPError("failed to create socket: %m");
+	try {
+		apply_pre_connect(fd);
+		apply(fd);
+	} catch (...) {
+		::close(fd);
+		throw;
+	}
+	::close(fd);
+}
+
+void SocketProfile::apply_pre_connect(int fd) const {
+	if (sndbuf && setsockopt(fd, SOL_SOCKET, SO_SNDBUF,
+				&sndbuf, sizeof(sndbuf)))
+		throw WFTPError("setsockopt SO_SNDBUF: %m");
+	if (rcvbuf && setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+				&rcvbuf, sizeof(rcvbuf)))
+		throw WFTPError("setsockopt SO_RCVBUF: %m");
+}
+
+void SocketProfile::apply(int fd) const {
+	int flag = nodelay;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)))
+		throw WFTPError("failed to setsockopt: %s", strerror(errno));
+	if (notsent_lowat && setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+				&notsent_lowat, sizeof(notsent_lowat)))
+		throw WFTPError("setsockopt TCP_NOTSENT_LOWAT: %m");
+	if (!congestion.empty() && setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION,
+				congestion.c_str(), congestion.length()))
+		throw WFTPError("setsockopt TCP_CONGESTION %s: %m",
+				congestion.c_str());
+}
 
 SocketBase::SocketBase(int fd) {
 	set_socket_fd(fd);
@@ -37,13 +141,6 @@ SocketBase::~SocketBase() {
 void SocketBase::set_socket_fd(int fd) {
 	m_fd = fd;
 
-#ifdef SET_TCP_NODELAY
-	int flag = 1;
-	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
-				(const char*)&flag, sizeof(flag)))
-		throw WFTPError("failed to setsockopt: %s", strerror(errno));
-#endif
-
 
 	struct sockaddr_in local_addr;
 	struct sockaddr* local_addr_ptr = (struct sockaddr*)&local_addr;
@@ -54,6 +151,10 @@ void SocketBase::set_socket_fd(int fd) {
 
 	m_local_addr = ntohl(local_addr.sin_addr.s_addr);
 	m_local_port = ntohs(local_addr.sin_port);
+
+	addrlen = sizeof(local_addr);
+	if (!getpeername(fd, local_addr_ptr, &addrlen))
+		m_peer_addr = ntohl(local_addr.sin_addr.s_addr);
 }
 
 std::shared_ptr<SocketBase> SocketBase::make_from_fd(
@@ -65,6 +166,24 @@ std::shared_ptr<SocketBase> SocketBase::make_from_fd(
 }
 
 void SocketBase::close() {
+	if (m_fd != -1 && !m_zerocopy_pending.empty()) {
+		// the kernel may still read the buffers; wait before releasing them
+		try {
+			reap_zerocopy(0);
+		} catch (WFTPError &exc) {
+			wftp_log("failed to wait for zerocopy completion: %s",
+					exc.what());
+		}
+		m_zerocopy_pending.clear();
+	}
+	if (m_filter && m_fd != -1) {
+		try {
+			m_filter->shutdown();
+		} catch (WFTPError &exc) {
+			wftp_log("failed to shut down socket filter: %s", exc.what());
+		}
+	}
+	m_filter.reset();
 	if (m_fd != -1) {
 		if (::close(m_fd))
 			wftp_log("failed to close fd %d: %m", m_fd);
@@ -75,6 +194,10 @@ void SocketBase::close() {
 void SocketBase::send(const void *buf0, size_t size) {
 	if (m_fd < 0)
 		throw WFTPError("attempt to write to unbinded socket");
+	if (m_filter) {
+		m_filter->send(buf0, size);
+		return;
+	}
 	const char *buf = static_cast<const char *>(buf0);
 	while (size) {
 		ssize_t s = ::send(m_fd, buf, size, 0);
@@ -85,7 +208,168 @@ void SocketBase::send(const void *buf0, size_t size) {
 	}
 }
 
+size_t SocketBase::send_file(int fd, off_t offset, size_t size) {
+	if (m_fd < 0)
+		throw WFTPError("attempt to write to unbinded socket");
+	if (m_filter)
+		return m_filter->send_file(fd, offset, size);
+	size_t tot = 0;
+	while (tot < size) {
+		ssize_t s = sendfile(m_fd, fd, &offset, size - tot);
+		if (s < 0)
+			throw WFTPError("socket: sendfile failed: %s", strerror(errno));
+		if (!s)
+			break;
+		tot += s;
+	}
+	return tot;
+}
+
+void SocketBase::send_crlf(const char *msg, size_t size) {
+	static thread_local char stage[CRLF_STAGE_SIZE];
+	size_t stage_size = 0;
+	auto put = [&](const char *buf, size_t size) {
+		while (size) {
+			if (stage_size == sizeof(stage)) {
+				send(stage, stage_size);
+				stage_size = 0;
+			}
+			size_t s = std::min(size, sizeof(stage) - stage_size);
+			memcpy(stage + stage_size, buf, s);
+			stage_size += s;
+			buf += s;
+			size -= s;
+		}
+	};
+
+	// memchr() is vectorized in libc, so long lines are scanned quickly
+	const char *cur = msg, *end = msg + size;
+	while (cur < end) {
+		auto lf = static_cast<const char*>(memchr(cur, '\n', end - cur));
+		if (!lf) {
+			put(cur, end - cur);
+			break;
+		}
+		bool has_cr = lf > msg ? lf[-1] == '\r' : m_crlf_last_cr;
+		put(cur, lf - cur);
+		if (has_cr)
+			put("\n", 1);
+		else
+			put("\r\n", 2);
+		cur = lf + 1;
+	}
+	if (size)
+		m_crlf_last_cr = msg[size - 1] == '\r';
+	if (stage_size)
+		send(stage, stage_size);
+}
+
+void SocketBase::set_cork(bool enable) {
+	int flag = enable;
+	if (setsockopt(m_fd, IPPROTO_TCP, TCP_CORK, &flag, sizeof(flag)))
+		throw WFTPError("setsockopt TCP_CORK: %m");
+}
+
+bool SocketBase::enable_zerocopy() {
+	int flag = 1;
+	if (setsockopt(m_fd, SOL_SOCKET, SO_ZEROCOPY, &flag, sizeof(flag)))
+		return false;
+	m_zerocopy = true;
+	return true;
+}
+
+void SocketBase::send_zerocopy(std::shared_ptr<const void> owner,
+		const void *buf0, size_t size) {
+	if (!m_zerocopy || m_filter || size < ZEROCOPY_MIN_SIZE) {
+		send(buf0, size);
+		zerocopy_stats.bytes_regular += size;
+		return;
+	}
+	const char *buf = static_cast<const char *>(buf0);
+	while (size) {
+		ssize_t s = ::send(m_fd, buf, size, MSG_ZEROCOPY);
+		if (s < 0) {
+			// ENOBUFS: exceeded optmem limit with too many pending sends
+			if (errno == ENOBUFS && !m_zerocopy_pending.empty()) {
+				reap_zerocopy(m_zerocopy_pending.size() - 1);
+				continue;
+			}
+			throw WFTPError("socket: failed to write: %s", strerror(errno));
+		}
+		m_zerocopy_pending.push_back({m_zerocopy_next_id ++, size_t(s),
+				owner});
+		zerocopy_stats.nr_send ++;
+		size -= s;
+		buf += s;
+	}
+	if (m_zerocopy_pending.size() >= ZEROCOPY_REAP_THRESH)
+		reap_zerocopy(SIZE_MAX);
+}
+
+void SocketBase::reap_zerocopy(size_t max_pending) {
+	while (!m_zerocopy_pending.empty()) {
+		char control[128];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(m_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				throw WFTPError("recvmsg MSG_ERRQUEUE: %m");
+			if (m_zerocopy_pending.size() <= max_pending)
+				return;
+			// POLLERR is always reported
+			struct pollfd pfd;
+			pfd.fd = m_fd;
+			pfd.events = 0;
+			int rst = poll(&pfd, 1, SOCKET_TIMEOUT * 1000);
+			if (rst < 0 && errno != EINTR)
+				throw WFTPError("poll: %m");
+			if (!rst)
+				throw WFTPError("timeout waiting for zerocopy completion");
+			continue;
+		}
+
+		for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+				cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (!((cmsg->cmsg_level == SOL_IP &&
+						cmsg->cmsg_type == IP_RECVERR) ||
+					(cmsg->cmsg_level == SOL_IPV6 &&
+					 cmsg->cmsg_type == IPV6_RECVERR)))
+				continue;
+			auto serr = reinterpret_cast<struct sock_extended_err*>(
+					CMSG_DATA(cmsg));
+			if (serr->ee_errno != 0 ||
+					serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			uint32_t lo = serr->ee_info, hi = serr->ee_data;
+			bool copied = serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED;
+			// completions are reported in order, as a range of ids
+			while (!m_zerocopy_pending.empty()) {
+				auto &front = m_zerocopy_pending.front();
+				if (front.id - lo > hi - lo)
+					break;
+				(copied ? zerocopy_stats.bytes_copied :
+				 zerocopy_stats.bytes_zerocopy) += front.size;
+				m_zerocopy_pending.pop_front();
+			}
+		}
+	}
+}
+
+SocketBase::ZerocopyStats SocketBase::get_zerocopy_stats() {
+	ZerocopyStats rst;
+	rst.bytes_zerocopy = zerocopy_stats.bytes_zerocopy;
+	rst.bytes_copied = zerocopy_stats.bytes_copied;
+	rst.bytes_regular = zerocopy_stats.bytes_regular;
+	rst.nr_send = zerocopy_stats.nr_send;
+	return rst;
+}
+
 size_t SocketBase::recv(void *buf, size_t max_size) {
+	// the filter may have buffered data even if the fd has reached EOF
+	if (m_filter)
+		return m_filter->recv(buf, max_size);
 	if (is_closed())
 		return 0;
 	ssize_t s = ::recv(m_fd, buf, max_size, 0);
@@ -95,9 +379,16 @@ size_t SocketBase::recv(void *buf, size_t max_size) {
 }
 
 void SocketBase::recv_fixsize(void *buf0, size_t size) {
-	if (is_closed())
+	if (!m_filter && is_closed())
 		throw WFTPError("recv_fixsize from closed socket");
 	char *buf = static_cast<char *>(buf0);
+	while (size && m_filter) {
+		auto s = m_filter->recv(buf, size);
+		if (!s)
+			throw WFTPError("recv_fixsize: unexpected EOF");
+		size -= s;
+		buf += s;
+	}
 	while (size) {
 		ssize_t s = ::recv(m_fd, buf, size, 0);
 		if (s < 0)
@@ -124,7 +415,8 @@ bool SocketBase::is_closed() {
 }
 
 std::shared_ptr<SocketBase> SocketBase::connect(
-		const char *host, const char *service) {
+		const char *host, const char *service,
+		const SocketProfile &profile) {
 
 	struct addrinfo hints, *result;
 	memset(&hints, 0, sizeof(hints));
@@ -141,17 +433,34 @@ std::shared_ptr<SocketBase> SocketBase::connect(
 		if (fd == -1)
 			continue;
 
+		try {
+			profile.apply_pre_connect(fd);
+		} catch (...) {
+			::close(fd);
+			freeaddrinfo(result);
+			throw;
+		}
 		if (!::connect(fd, rp->ai_addr, rp->ai_addrlen))
 			break;  // return 0, successfully connected
 		::close(fd);
+		fd = -1;
 	}
 	freeaddrinfo(result);
 	if (fd == -1)
 		throw WFTPError("failed to connect to (%s, %s): %m", host, service);
+	try {
+		profile.apply(fd);
+	} catch (...) {
+		::close(fd);
+		throw;
+	}
 	return SocketBase::make_from_fd(fd);
 }
 
-ServerSocket::ServerSocket(uint16_t port, int backlog) {
+ServerSocket::ServerSocket(uint16_t port, int backlog,
+		const SocketProfile &profile):
+	m_profile(profile)
+{
 	int sockfd = socket(AF_INET, SOCK_STREAM, 0);
 	if (sockfd < 0)
 		throw WFTPError("failed to create socket: %m");
@@ -169,6 +478,10 @@ ServerSocket::ServerSocket(uint16_t port, int backlog) {
 				(const char *) &optval, sizeof(optval)))
 		throw WFTPError("setsockopt: %m");
 
+	// accepted sockets inherit buffer sizes, which must be set before listen()
+	// to take effect on the TCP window scale
+	m_profile.apply_pre_connect(sockfd);
+
 	if (bind(sockfd, srv_addr_ptr, sizeof(srv_addr)) < 0)
 		throw WFTPError("faied to bind to %d: %m", int(port));
 
@@ -199,6 +512,8 @@ std::shared_ptr<SocketBase> ServerSocket::accept() {
 		clifd = ::accept(get_socket_fd(),
 			(struct sockaddr*)&cli_addr, &cli_addr_len);
 		if (clifd == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return nullptr;
 			if (errno != EINTR)
 				wftp_log("bad client socket fd: %m");
 			continue;
@@ -211,9 +526,88 @@ std::shared_ptr<SocketBase> ServerSocket::accept() {
 			hostbuf, NI_MAXHOST,
 			servbuf, NI_MAXSERV,
 			NI_NUMERICHOST | NI_NUMERICSERV);
+	try {
+		m_profile.apply(clifd);
+	} catch (...) {
+		::close(clifd);
+		throw;
+	}
 	return SocketBase::make_from_fd(clifd,
 			std::string(hostbuf) + ":" + servbuf);
 }
 
+void ServerSocket::set_nonblocking() {
+	int fd = get_socket_fd();
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK))
+		throw WFTPError("fcntl O_NONBLOCK: %m");
+}
+
+bool ServerSocket::wait_accept(int wake_fd) {
+	struct pollfd pfd[2];
+	pfd[0].fd = get_socket_fd();
+	pfd[1].fd = wake_fd;
+	pfd[0].events = pfd[1].events = POLLIN;
+	for (; ; ) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			throw WFTPError("poll: %m");
+		}
+		if (pfd[1].revents)
+			return false;
+		if (pfd[0].revents)
+			return true;
+	}
+}
+
+void ServerSocket::handoff(int unix_fd) {
+	char cmsgbuf[CMSG_SPACE(sizeof(int))], data = 'L';
+	struct iovec iov;
+	iov.iov_base = &data;
+	iov.iov_len = 1;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	memset(cmsgbuf, 0, sizeof(cmsgbuf));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf;
+	msg.msg_controllen = sizeof(cmsgbuf);
+	auto cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	int fd = get_socket_fd();
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	if (sendmsg(unix_fd, &msg, 0) != 1)
+		throw WFTPError("failed to send listening socket: %m");
+}
+
+std::shared_ptr<ServerSocket> ServerSocket::takeover(int unix_fd,
+		const SocketProfile &profile) {
+	char cmsgbuf[CMSG_SPACE(sizeof(int))], data;
+	struct iovec iov;
+	iov.iov_base = &data;
+	iov.iov_len = 1;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf;
+	msg.msg_controllen = sizeof(cmsgbuf);
+	if (recvmsg(unix_fd, &msg, 0) != 1)
+		throw WFTPError("failed to receive listening socket: %m");
+	auto cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+			cmsg->cmsg_type != SCM_RIGHTS)
+		throw WFTPError("no socket received from handoff peer");
+	int fd;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+	std::shared_ptr<ServerSocket> rst(new ServerSocket(profile));
+	rst->set_socket_fd(fd);
+	return rst;
+}
+
 // vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
 
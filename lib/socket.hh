@@ -8,41 +8,162 @@
 
 #include "common.hh"
 #include <cstdint>
+#include <deque>
 #include <memory>
 #include <string>
 
+#include <sys/types.h>
+
+/*!
+ * \brief TCP tuning options of a socket, chosen by the role of the socket
+ *		(e.g. latency for control connections, throughput for bulk data)
+ */
+struct SocketProfile {
+	bool nodelay = true;
+
+	//! SO_SNDBUF and SO_RCVBUF; 0 to keep kernel autotuning
+	int sndbuf = 0, rcvbuf = 0;
+
+	//! TCP_NOTSENT_LOWAT; 0 for system default
+	int notsent_lowat = 0;
+
+	//! TCP_CONGESTION algorithm name; empty for system default
+	std::string congestion;
+
+	/*!
+	 * \brief update options from a comma-separated list, e.g.
+	 *		"nodelay=0,sndbuf=4M,rcvbuf=4M,lowat=128K,cc=bbr"
+	 */
+	void update(const std::string &spec);
+
+	/*!
+	 * \brief check that the options are accepted by the kernel, by applying
+	 *		them to a temporary socket
+	 */
+	void check() const;
+
+	/*!
+	 * \brief apply options that should be set before listen() or
+	 *		connect(), i.e. buffer sizes
+	 */
+	void apply_pre_connect(int fd) const;
+
+	void apply(int fd) const;
+};
+
+/*!
+ * \brief transformation of the byte stream of a connected socket, e.g. a
+ *		TLS session; once set, SocketBase passes its data through the filter
+ *		instead of using the fd directly
+ */
+class SocketFilter {
+	public:
+		virtual ~SocketFilter() = default;
+
+		virtual void send(const void *buf, size_t size) = 0;
+
+		//! \return 0 at the end of stream
+		virtual size_t recv(void *buf, size_t max_size) = 0;
+
+		//! see SocketBase::send_file()
+		virtual size_t send_file(int fd, off_t offset, size_t size) = 0;
+
+		/*!
+		 * \brief end the stream before the socket is closed, e.g. by a TLS
+		 *		close_notify
+		 */
+		virtual void shutdown() = 0;
+};
+
 class SocketBase {
 	public:
 		typedef unsigned addr_t;
 
+		/*!
+		 * \brief process-wide counters of send_zerocopy() traffic
+		 */
+		struct ZerocopyStats {
+			//! bytes sent with MSG_ZEROCOPY and not copied by the kernel
+			uint64_t bytes_zerocopy;
+
+			//! bytes sent with MSG_ZEROCOPY but copied by the kernel anyway
+			//! (e.g. loopback or unsupported device)
+			uint64_t bytes_copied;
+
+			//! bytes sent by normal send(), since zerocopy is disabled or the
+			//! buffer is too small to benefit
+			uint64_t bytes_regular;
+
+			//! number of sendmsg calls with MSG_ZEROCOPY
+			uint64_t nr_send;
+		};
+
 		SocketBase(const SocketBase &) = delete;
 		~SocketBase();
 
 		SocketBase& operator = (const SocketBase &) = delete;
 
 		void send(const void *buf, size_t size);
+
+		/*!
+		 * \brief send *size* bytes of file *fd* starting at *offset* with
+		 *		sendfile(), so file data is not copied through user space
+		 * \return number of bytes sent, less than *size* only if the file is
+		 *		shorter
+		 */
+		size_t send_file(int fd, off_t offset, size_t size);
+
 		void recv_fixsize(void *buf, size_t size);
 		size_t recv(void *buf, size_t max_size);
 
 		/*!
 		 * send text with CRLF linebreaks
+		 *
+		 * converted text is assembled in a staging buffer and written with
+		 * large sends, rather than one send per line
 		 */
-		void send_crlf(const char *msg, size_t size) {
-			size_t start = 0;
-			for (size_t i = 0; i < size; i ++)
-				if (msg[i] == '\n' && (!i || msg[i - 1] != '\r')) {
-					send(msg + start, i - start);
-					send("\r\n", 2);
-					start = i + 1;
-				}
-			if (start < size)
-				send(msg + start, size - start);
-		}
+		void send_crlf(const char *msg, size_t size);
 
 		void send_crlf(const std::string &msg) {
 			send_crlf(msg.c_str(), msg.size());
 		}
 
+		/*!
+		 * \brief enable SO_ZEROCOPY so that send_zerocopy() could avoid
+		 *		copying data into the kernel
+		 * \return whether zerocopy is supported
+		 */
+		bool enable_zerocopy();
+
+		bool zerocopy_enabled() const {
+			return m_zerocopy;
+		}
+
+		/*!
+		 * \brief send with MSG_ZEROCOPY; the buffer must not be modified until
+		 *		the kernel reports completion, so *owner* is held until then
+		 *
+		 * falls back to send() if zerocopy is not enabled or the buffer is
+		 * small
+		 */
+		void send_zerocopy(std::shared_ptr<const void> owner,
+				const void *buf, size_t size);
+
+		/*!
+		 * \brief process zerocopy completion notifications, releasing owners
+		 *		of completed buffers
+		 *
+		 * \param max_pending block until at most this number of sends are
+		 *		still pending; SIZE_MAX to never block
+		 */
+		void reap_zerocopy(size_t max_pending);
+
+		size_t nr_zerocopy_pending() const {
+			return m_zerocopy_pending.size();
+		}
+
+		static ZerocopyStats get_zerocopy_stats();
+
 		static std::string format_addr(addr_t addr, const char sep = '.') {
 			return ssprintf("%d%c%d%c%d%c%d",
 					(addr>>24)&0xFF, sep,
@@ -56,6 +177,12 @@ class SocketBase {
 
 		void enable_timeout();
 
+		/*!
+		 * \brief set TCP_CORK: hold partial frames until uncorked, used
+		 *		around bursts of small writes
+		 */
+		void set_cork(bool enable);
+
 		/*!
 		 * return a text description of the peer
 		 */
@@ -64,7 +191,8 @@ class SocketBase {
 		}
 
 		static std::shared_ptr<SocketBase> connect(
-				const char *host, const char *service);
+				const char *host, const char *service,
+				const SocketProfile &profile = SocketProfile());
 
 		/*!
 		 * \brief get local port number
@@ -78,38 +206,111 @@ class SocketBase {
 		addr_t local_addr() const
 		{ return m_local_addr; }
 
+		/*!
+		 * \brief get the address of the peer; 0 if not connected
+		 */
+		addr_t peer_addr() const
+		{ return m_peer_addr; }
+
 		bool is_closed();
 
-	protected:
-		static std::shared_ptr<SocketBase>
-			make_from_fd(int fd, const std::string &peerinfo = std::string());
+		/*!
+		 * \brief pass data through *filter* from now on; MSG_ZEROCOPY sends
+		 *		fall back to normal ones
+		 */
+		void set_filter(std::shared_ptr<SocketFilter> filter) {
+			m_filter = filter;
+		}
 
-		void set_socket_fd(int fd);
+		bool has_filter() const {
+			return static_cast<bool>(m_filter);
+		}
 
+		/*!
+		 * \brief the underlying fd, for waiting on it with poll()
+		 */
 		int get_socket_fd() const {
 			return m_fd;
 		}
 
+	protected:
+		static std::shared_ptr<SocketBase>
+			make_from_fd(int fd, const std::string &peerinfo = std::string());
+
+		void set_socket_fd(int fd);
+
 		SocketBase() = default;
 
 	private:
 		int m_fd = -1;
 		std::string m_peerinfo;
+		std::shared_ptr<SocketFilter> m_filter;
 
-		addr_t m_local_addr;
+		// whether last char passed to send_crlf() is '\r'
+		bool m_crlf_last_cr = false;
+
+		struct ZerocopyPending {
+			uint32_t id;
+			size_t size;
+			std::shared_ptr<const void> owner;
+		};
+		bool m_zerocopy = false;
+		uint32_t m_zerocopy_next_id = 0;
+		std::deque<ZerocopyPending> m_zerocopy_pending;
+
+		addr_t m_local_addr, m_peer_addr = 0;
 		int m_local_port;
 
 		SocketBase(int fd);
 };
 
 class ServerSocket: public SocketBase {
+	SocketProfile m_profile;
+
+	ServerSocket(const SocketProfile &profile):
+		m_profile(profile)
+	{ }
+
 	public:
 		/*!
 		 * \brief pass 0 to *port* to use an ephemeral port
+		 *
+		 * \param profile options for accepted sockets
 		 */
-		ServerSocket(uint16_t port, int backlog = 5);
+		ServerSocket(uint16_t port, int backlog = 5,
+				const SocketProfile &profile = SocketProfile());
 
+		/*!
+		 * \brief accept a connection
+		 * \return nullptr on timeout (see enable_timeout()), or if no
+		 *		connection is pending in non-blocking mode
+		 */
 		std::shared_ptr<SocketBase> accept();
+
+		/*!
+		 * \brief make accept() non-blocking, needed when the socket is
+		 *		shared by multiple processes and wait_accept() is used
+		 */
+		void set_nonblocking();
+
+		/*!
+		 * \brief wait until a connection could be accepted or *wake_fd*
+		 *		becomes readable
+		 * \return false if woken up by *wake_fd*
+		 */
+		bool wait_accept(int wake_fd);
+
+		/*!
+		 * \brief pass the listening socket to another process through a
+		 *		connected unix socket
+		 */
+		void handoff(int unix_fd);
+
+		/*!
+		 * \brief receive a listening socket passed by handoff()
+		 */
+		static std::shared_ptr<ServerSocket> takeover(int unix_fd,
+				const SocketProfile &profile = SocketProfile());
 };
 
 // vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
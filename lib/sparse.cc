@@ -0,0 +1,194 @@
+/*
+ * $File: sparse.cc
+ * $Date: Mon Oct 19 15:30:44 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+// granularity of holes created by SparseWriter
+
+#include "sparse.hh"
+#include "common.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+std::string sparse_frame_header(char type, uint64_t length) {
+	std::string rst(SPARSE_FRAME_HEADER_SIZE, type);
+	for (int i = 8; i >= 1; i --) {
+		rst[i] = length & 0xFF;
+		length >>= 8;
+	}
+	return rst;
+}
+
+void SparseDecoder::feed(const char *buf, size_t size) {
+	while (size) {
+		if (m_data_left) {
+			auto s = std::min<uint64_t>(size, m_data_left);
+			m_on_data(buf, s);
+			buf += s;
+			size -= s;
+			m_data_left -= s;
+			continue;
+		}
+		auto s = std::min(size, SPARSE_FRAME_HEADER_SIZE - m_hdr_size);
+		memcpy(m_hdr + m_hdr_size, buf, s);
+		m_hdr_size += s;
+		buf += s;
+		size -= s;
+		if (m_hdr_size < SPARSE_FRAME_HEADER_SIZE)
+			continue;
+		m_hdr_size = 0;
+		uint64_t length = 0;
+		for (int i = 1; i <= 8; i ++)
+			length = (length << 8) | m_hdr[i];
+		if (m_hdr[0] == SPARSE_FRAME_DATA)
+			m_data_left = length;
+		else if (m_hdr[0] == SPARSE_FRAME_HOLE)
+			m_on_hole(length);
+		else
+			throw WFTPError("bad sparse frame type: %d", m_hdr[0]);
+	}
+}
+
+void for_each_file_segment(int fd, off_t size,
+		std::function<void(off_t offset, off_t length, bool hole)> callback) {
+	off_t pos = 0;
+	while (pos < size) {
+		off_t data = lseek(fd, pos, SEEK_DATA);
+		if (data < 0) {
+			if (errno != ENXIO) {
+				// SEEK_DATA unsupported
+				callback(pos, size - pos, false);
+				return;
+			}
+			data = size;
+		}
+		data = std::min(data, size);
+		if (data > pos) {
+			callback(pos, data - pos, true);
+			pos = data;
+			if (pos == size)
+				break;
+		}
+		off_t hole = lseek(fd, pos, SEEK_HOLE);
+		if (hole <= pos || hole > size)
+			hole = size;
+		callback(pos, hole - pos, false);
+		pos = hole;
+	}
+}
+
+bool is_sparse_file(int fd) {
+	struct stat st;
+	if (fstat(fd, &st))
+		return false;
+	return st.st_blocks * 512 < st.st_size;
+}
+
+bool is_all_zero(const void *buf0, size_t size) {
+	auto buf = static_cast<const char*>(buf0);
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	while (size >= 64) {
+		auto p = reinterpret_cast<const __m128i*>(buf);
+		__m128i acc = _mm_or_si128(
+				_mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+				_mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF)
+			return false;
+		buf += 64;
+		size -= 64;
+	}
+#endif
+	for (; size; size --)
+		if (*(buf ++))
+			return false;
+	return true;
+}
+
+void SparseWriter::write_data(const char *buf, size_t size) {
+	while (size) {
+		auto s = pwrite(m_fd, buf, size, m_offset);
+		if (s < 0)
+			throw WFTPError("write: %m");
+		buf += s;
+		size -= s;
+		m_offset += s;
+	}
+}
+
+void SparseWriter::flush_zero_run() {
+	static const char zeros[SPARSE_MIN_HOLE] = {0};
+	if (m_zero_run >= SPARSE_MIN_HOLE)
+		m_offset += m_zero_run;
+	else
+		write_data(zeros, m_zero_run);
+	m_zero_run = 0;
+}
+
+void SparseWriter::flush_partial() {
+	flush_zero_run();
+	write_data(m_partial, m_partial_size);
+	m_partial_size = 0;
+}
+
+void SparseWriter::write(const void *buf0, size_t size) {
+	auto buf = static_cast<const char*>(buf0);
+	const size_t blk = SPARSE_BLOCK_SIZE;
+	while (size) {
+		// only whole blocks aligned in the file could become holes, so
+		// pieces of blocks are staged in m_partial
+		size_t misalign = (m_offset + m_zero_run) % blk;
+		if (m_partial_size || misalign || size < blk) {
+			auto s = std::min(size, blk - misalign - m_partial_size);
+			memcpy(m_partial + m_partial_size, buf, s);
+			m_partial_size += s;
+			buf += s;
+			size -= s;
+			if (misalign + m_partial_size == blk) {
+				if (!misalign && is_all_zero(m_partial, blk)) {
+					m_zero_run += blk;
+					m_partial_size = 0;
+				} else
+					flush_partial();
+			}
+			continue;
+		}
+
+		// a zero run may span several calls
+		size_t nr_byte = size / blk * blk, data_start = 0;
+		for (size_t pos = 0; pos < nr_byte; pos += blk) {
+			if (is_all_zero(buf + pos, blk)) {
+				write_data(buf + data_start, pos - data_start);
+				m_zero_run += blk;
+				data_start = pos + blk;
+			} else if (m_zero_run)
+				flush_zero_run();
+		}
+		write_data(buf + data_start, nr_byte - data_start);
+		buf += nr_byte;
+		size -= nr_byte;
+	}
+}
+
+void SparseWriter::write_hole(uint64_t length) {
+	flush_partial();
+	m_offset += length;
+}
+
+void SparseWriter::finish() {
+	flush_partial();
+	if (ftruncate(m_fd, m_offset))
+		throw WFTPError("ftruncate: %m");
+}
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
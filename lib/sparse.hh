@@ -0,0 +1,141 @@
+/*
+ * $File: sparse.hh
+ * $Date: Mon Oct 19 15:30:44 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include <sys/types.h>
+
+/*
+ * sparse file support
+ *
+ * with the sparse transfer extension (negotiated by "OPTS SPARSE ON"), file
+ * data on the data connection of RETR and STOR is a sequence of frames,
+ * each a 1-byte type and an 8-byte big-endian length: type 'D' is followed
+ * by *length* bytes of file data, and type 'H' stands for a hole of
+ * *length* zero bytes, which is not sent; in MODE Z the frames are
+ * compressed as a whole
+ */
+
+static constexpr char SPARSE_FRAME_DATA = 'D', SPARSE_FRAME_HOLE = 'H';
+static constexpr size_t SPARSE_FRAME_HEADER_SIZE = 9;
+
+/*!
+ * \brief holes shorter than this are not worth creating
+ */
+static constexpr size_t SPARSE_MIN_HOLE = 32 * 1024;
+
+/*!
+ * \brief granularity of holes created by SparseWriter
+ */
+static constexpr size_t SPARSE_BLOCK_SIZE = 4096;
+
+std::string sparse_frame_header(char type, uint64_t length);
+
+/*!
+ * \brief incremental decoder of sparse frames
+ */
+class SparseDecoder {
+	public:
+		typedef std::function<void(const char*, size_t)> on_data_t;
+		typedef std::function<void(uint64_t)> on_hole_t;
+
+		SparseDecoder(on_data_t on_data, on_hole_t on_hole):
+			m_on_data(on_data), m_on_hole(on_hole)
+		{ }
+
+		void feed(const char *buf, size_t size);
+
+		/*!
+		 * \brief whether the stream ends at a frame boundary
+		 */
+		bool at_boundary() const {
+			return !m_hdr_size && !m_data_left;
+		}
+
+	private:
+		on_data_t m_on_data;
+		on_hole_t m_on_hole;
+		unsigned char m_hdr[SPARSE_FRAME_HEADER_SIZE];
+		size_t m_hdr_size = 0;
+		uint64_t m_data_left = 0;
+};
+
+/*!
+ * \brief enumerate data segments and holes of the first *size* bytes of a
+ *		file by SEEK_DATA/SEEK_HOLE, in order
+ *
+ * a filesystem without hole support reports the whole file as data
+ */
+void for_each_file_segment(int fd, off_t size,
+		std::function<void(off_t offset, off_t length, bool hole)> callback);
+
+/*!
+ * \brief whether a file has fewer allocated blocks than its size needs
+ */
+bool is_sparse_file(int fd);
+
+/*!
+ * \brief whether a buffer contains only zero bytes; vectorized with SSE2
+ *		where available
+ */
+bool is_all_zero(const void *buf, size_t size);
+
+/*!
+ * \brief write to a file, skipping (instead of writing) aligned runs of at
+ *		least SPARSE_MIN_HOLE zero bytes, so they become holes
+ *
+ * the file must be newly created or truncated, since skipped ranges keep
+ * their previous content; finish() must be called to set the file size
+ * if it ends in a hole
+ */
+class SparseWriter {
+	int m_fd;
+	off_t m_offset = 0;
+
+	//! length of aligned zero blocks seen but not yet written
+	uint64_t m_zero_run = 0;
+
+	//! data following the zero run, not filling up a block yet
+	char m_partial[SPARSE_BLOCK_SIZE];
+	size_t m_partial_size = 0;
+
+	void write_data(const char *buf, size_t size);
+
+	/*!
+	 * \brief skip the pending zero run if it is long enough, and write it
+	 *		otherwise
+	 */
+	void flush_zero_run();
+
+	/*!
+	 * \brief flush the zero run and write the partial block
+	 */
+	void flush_partial();
+
+	public:
+		SparseWriter(int fd):
+			m_fd(fd)
+		{ }
+
+		void write(const void *buf, size_t size);
+
+		/*!
+		 * \brief skip *length* bytes known to be zero
+		 */
+		void write_hole(uint64_t length);
+
+		void finish();
+
+		off_t offset() const {
+			return m_offset + m_zero_run + m_partial_size;
+		}
+};
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
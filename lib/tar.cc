@@ -0,0 +1,332 @@
+/*
+ * $File: tar.cc
+ * $Date: Mon Oct 19 13:40:12 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+#include "tar.hh"
+#include "common.hh"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <memory>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+const char TAR_ZERO_BLOCK[TAR_BLOCK_SIZE] = {0};
+
+namespace {
+
+// offsets of ustar header fields
+enum {
+	OFF_NAME = 0, OFF_MODE = 100, OFF_UID = 108, OFF_GID = 116,
+	OFF_SIZE = 124, OFF_MTIME = 136, OFF_CHKSUM = 148, OFF_TYPE = 156,
+	OFF_MAGIC = 257, OFF_VERSION = 263, OFF_PREFIX = 345
+};
+
+const size_t NAME_SIZE = 100, PREFIX_SIZE = 155;
+const char GNU_LONGNAME = 'L';
+
+void put_octal(char *field, size_t width, uint64_t val) {
+	// base-256 for values not fitting in width - 1 octal digits
+	if (val >> ((width - 1) * 3)) {
+		for (size_t i = width - 1; i > 0; i --) {
+			field[i] = val & 0xFF;
+			val >>= 8;
+		}
+		field[0] = char(0x80);
+		return;
+	}
+	snprintf(field, width, "%0*llo", int(width - 1), (unsigned long long)val);
+}
+
+uint64_t get_octal(const char *field, size_t width) {
+	if (field[0] & 0x80) {
+		uint64_t val = field[0] & 0x7F;
+		for (size_t i = 1; i < width; i ++)
+			val = (val << 8) | uint8_t(field[i]);
+		return val;
+	}
+	uint64_t val = 0;
+	for (size_t i = 0; i < width && field[i]; i ++) {
+		if (field[i] == ' ')
+			continue;
+		if (field[i] < '0' || field[i] > '7')
+			throw WFTPError("bad octal field in tar header");
+		val = (val << 3) | (field[i] - '0');
+	}
+	return val;
+}
+
+unsigned checksum(const char *hdr) {
+	unsigned sum = 0;
+	for (size_t i = 0; i < TAR_BLOCK_SIZE; i ++)
+		if (i >= OFF_CHKSUM && i < OFF_CHKSUM + 8)
+			sum += ' ';
+		else
+			sum += uint8_t(hdr[i]);
+	return sum;
+}
+
+void make_block(char *hdr, const std::string &name, const std::string &prefix,
+		char type, mode_t mode, uint64_t size, time_t mtime) {
+	memset(hdr, 0, TAR_BLOCK_SIZE);
+	memcpy(hdr + OFF_NAME, name.c_str(), std::min(name.size(), NAME_SIZE));
+	memcpy(hdr + OFF_PREFIX, prefix.c_str(), prefix.size());
+	put_octal(hdr + OFF_MODE, 8, mode & 07777);
+	put_octal(hdr + OFF_UID, 8, 0);
+	put_octal(hdr + OFF_GID, 8, 0);
+	put_octal(hdr + OFF_SIZE, 12, size);
+	put_octal(hdr + OFF_MTIME, 12, std::max<time_t>(mtime, 0));
+	hdr[OFF_TYPE] = type;
+	memcpy(hdr + OFF_MAGIC, "ustar", 6);
+	memcpy(hdr + OFF_VERSION, "00", 2);
+	snprintf(hdr + OFF_CHKSUM, 8, "%06o", checksum(hdr));
+	hdr[OFF_CHKSUM + 7] = ' ';
+}
+
+} // anonymous namespace
+
+std::string tar_header(const TarEntry &entry) {
+	std::string name = entry.name, prefix;
+	if (name.size() > NAME_SIZE) {
+		// split at a slash so that both parts fit in ustar fields
+		auto pos = name.find('/', name.size() - NAME_SIZE - 1);
+		if (pos != std::string::npos && pos && pos <= PREFIX_SIZE &&
+				pos + 1 < name.size()) {
+			prefix = name.substr(0, pos);
+			name.erase(0, pos + 1);
+		}
+	}
+
+	std::string rst;
+	char hdr[TAR_BLOCK_SIZE];
+	if (name.size() > NAME_SIZE) {
+		name = entry.name;
+		prefix.clear();
+		make_block(hdr, "././@LongLink", "", GNU_LONGNAME, 0644,
+				name.size() + 1, 0);
+		rst.append(hdr, sizeof(hdr));
+		rst.append(name);
+		rst.append(tar_padding(name.size() + 1) + 1, 0);
+	}
+	make_block(hdr, name, prefix, entry.type, entry.mode, entry.size,
+			entry.mtime);
+	rst.append(hdr, sizeof(hdr));
+	return rst;
+}
+
+std::string tar_trailer() {
+	return std::string(TAR_BLOCK_SIZE * 2, 0);
+}
+
+bool tar_safe_path(const std::string &name) {
+	if (name.empty() || name[0] == '/')
+		return false;
+	for (size_t pos = 0; pos < name.size(); ) {
+		auto end = name.find('/', pos);
+		if (end == std::string::npos)
+			end = name.size();
+		if (name.compare(pos, end - pos, "..") == 0)
+			return false;
+		pos = end + 1;
+	}
+	return true;
+}
+
+TarParser::TarParser(on_entry_t on_entry, on_data_t on_data,
+		on_entry_end_t on_entry_end):
+	m_on_entry(on_entry), m_on_data(on_data), m_on_entry_end(on_entry_end)
+{
+}
+
+void TarParser::feed(const char *buf, size_t size) {
+	while (size && !m_finished) {
+		if (m_body_left) {
+			auto s = std::min<uint64_t>(size, m_body_left);
+			if (m_in_longname) {
+				if (m_longname.size() + s > PATH_MAX)
+					throw WFTPError("tar long name too long");
+				m_longname.append(buf, s);
+			}
+			else if (m_in_entry)
+				m_on_data(buf, s);
+			buf += s;
+			size -= s;
+			if (!(m_body_left -= s))
+				end_body();
+		} else if (m_pad_left) {
+			auto s = std::min<uint64_t>(size, m_pad_left);
+			buf += s;
+			size -= s;
+			m_pad_left -= s;
+		} else {
+			auto s = std::min(size, TAR_BLOCK_SIZE - m_hdr_size);
+			memcpy(m_hdr + m_hdr_size, buf, s);
+			m_hdr_size += s;
+			buf += s;
+			size -= s;
+			if (m_hdr_size == TAR_BLOCK_SIZE) {
+				m_hdr_size = 0;
+				parse_header();
+			}
+		}
+	}
+}
+
+void TarParser::parse_header() {
+	if (!memcmp(m_hdr, TAR_ZERO_BLOCK, TAR_BLOCK_SIZE)) {
+		m_finished = true;
+		return;
+	}
+	if (get_octal(m_hdr + OFF_CHKSUM, 8) != checksum(m_hdr))
+		throw WFTPError("bad tar header checksum");
+
+	uint64_t size = get_octal(m_hdr + OFF_SIZE, 12);
+	m_body_left = size;
+	m_pad_left = tar_padding(size);
+	if (m_hdr[OFF_TYPE] == GNU_LONGNAME) {
+		// the body is buffered whole, so its size from the stream must be
+		// bounded; it includes the trailing NUL, like PATH_MAX
+		if (size > PATH_MAX)
+			throw WFTPError("tar long name too long: %llu bytes",
+					(unsigned long long)size);
+		m_in_longname = true;
+		m_longname.clear();
+		if (!size)
+			end_body();
+		return;
+	}
+
+	TarEntry entry;
+	if (!m_longname.empty()) {
+		entry.name = m_longname.c_str();	// strip trailing NUL
+		m_longname.clear();
+	} else {
+		if (m_hdr[OFF_PREFIX]) {
+			entry.name.assign(m_hdr + OFF_PREFIX,
+					strnlen(m_hdr + OFF_PREFIX, PREFIX_SIZE));
+			entry.name.append("/");
+		}
+		entry.name.append(m_hdr + OFF_NAME,
+				strnlen(m_hdr + OFF_NAME, NAME_SIZE));
+	}
+	entry.type = TarEntry::Type(m_hdr[OFF_TYPE] ? m_hdr[OFF_TYPE] : '0');
+	entry.mode = get_octal(m_hdr + OFF_MODE, 8);
+	entry.size = size;
+	entry.mtime = get_octal(m_hdr + OFF_MTIME, 12);
+	m_in_entry = true;
+	m_on_entry(entry);
+	if (!size)
+		end_body();
+}
+
+void TarParser::end_body() {
+	if (m_in_longname)
+		m_in_longname = false;
+	else if (m_in_entry) {
+		m_in_entry = false;
+		m_on_entry_end();
+	}
+}
+
+static void walk_dir_fd(int fd, const std::string &prefix,
+		const std::function<void(const std::string&, int, const char*,
+			const struct stat&)> &on_entry, const struct stat *skip) {
+	// closed when on_entry() throws, e.g. on a send error
+	std::unique_ptr<DIR, int(*)(DIR*)> dir_guard(fdopendir(fd), closedir);
+	DIR *dir = dir_guard.get();
+	if (!dir) {
+		close(fd);
+		return;
+	}
+	while (auto ent = readdir(dir)) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+		struct stat st;
+		if (fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW))
+			continue;
+		if (skip && S_ISDIR(st.st_mode) && st.st_dev == skip->st_dev &&
+				st.st_ino == skip->st_ino)
+			continue;
+		std::string relpath = prefix + ent->d_name;
+		on_entry(relpath, dirfd(dir), ent->d_name, st);
+		if (S_ISDIR(st.st_mode)) {
+			int sub = openat(dirfd(dir), ent->d_name,
+					O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (sub >= 0)
+				walk_dir_fd(sub, relpath + "/", on_entry, skip);
+		}
+	}
+}
+
+void walk_dir_tree(const std::string &root,
+		std::function<void(const std::string &relpath, int dirfd,
+			const char *name, const struct stat &st)> on_entry,
+		const std::string &skip_dir) {
+	struct stat skip;
+	bool has_skip = !skip_dir.empty() && !stat(skip_dir.c_str(), &skip);
+	int fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		throw WFTPError("failed to open directory `%s': %m", root.c_str());
+	walk_dir_fd(fd, "", on_entry, has_skip ? &skip : nullptr);
+}
+
+int tar_write_tree(const std::string &root,
+		std::function<void(const void*, size_t)> send,
+		std::function<uint64_t(int fd, uint64_t size)> send_body,
+		const std::string &skip_dir) {
+	int nr_file = 0;
+	walk_dir_tree(root, [&](const std::string &relpath, int dirfd,
+				const char *name, const struct stat &st0) {
+		TarEntry entry;
+		entry.name = relpath;
+		entry.mode = st0.st_mode;
+		entry.mtime = st0.st_mtime;
+		entry.size = 0;
+		if (S_ISDIR(st0.st_mode)) {
+			entry.type = TarEntry::DIRECTORY;
+			entry.name.append("/");
+			auto hdr = tar_header(entry);
+			send(hdr.data(), hdr.size());
+			return;
+		}
+		if (!S_ISREG(st0.st_mode))
+			return;
+		int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		struct stat st;
+		if (fd < 0 || fstat(fd, &st)) {
+			if (fd >= 0)
+				close(fd);
+			return;
+		}
+		entry.type = TarEntry::REGULAR;
+		entry.size = st.st_size;
+		auto hdr = tar_header(entry);
+		send(hdr.data(), hdr.size());
+
+		uint64_t done;
+		try {
+			done = send_body(fd, entry.size);
+		} catch (...) {
+			close(fd);
+			throw;
+		}
+		close(fd);
+		for (uint64_t left = entry.size - done; left; ) {
+			auto s = std::min<uint64_t>(left, TAR_BLOCK_SIZE);
+			send(TAR_ZERO_BLOCK, s);
+			left -= s;
+		}
+		send(TAR_ZERO_BLOCK, tar_padding(entry.size));
+		nr_file ++;
+	}, skip_dir);
+	auto trailer = tar_trailer();
+	send(trailer.data(), trailer.size());
+	return nr_file;
+}
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
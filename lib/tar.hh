@@ -0,0 +1,136 @@
+/*
+ * $File: tar.hh
+ * $Date: Mon Oct 19 13:40:12 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ * ustar archive streams, used to transfer directory trees over a single data
+ * connection; names longer than the ustar name/prefix fields are stored in
+ * GNU long name entries, and sizes over 8GB in GNU base-256 encoding
+ */
+
+static constexpr size_t TAR_BLOCK_SIZE = 512;
+
+struct TarEntry {
+	enum Type: char {
+		REGULAR = '0', DIRECTORY = '5'
+	};
+
+	std::string name;	//!< relative path; directories end with '/'
+	Type type;
+	mode_t mode;
+	uint64_t size;
+	time_t mtime;
+};
+
+/*!
+ * \brief build header blocks of an entry
+ */
+std::string tar_header(const TarEntry &entry);
+
+/*!
+ * \brief number of zero bytes following an entry body of given size
+ */
+static inline size_t tar_padding(uint64_t size) {
+	return (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+}
+
+/*!
+ * \brief zero bytes that end an archive
+ */
+std::string tar_trailer();
+
+/*!
+ * \brief a block of zeros, for padding
+ */
+extern const char TAR_ZERO_BLOCK[TAR_BLOCK_SIZE];
+
+/*!
+ * \brief whether *name* from an archive is a relative path that stays in the
+ *		extraction directory
+ */
+bool tar_safe_path(const std::string &name);
+
+/*!
+ * \brief incremental parser of an archive stream
+ *
+ * data could be fed in arbitrary pieces; callbacks are invoked when an entry
+ * header is parsed, for each piece of entry body, and at the end of each
+ * entry; unsupported entry types are reported with their type unchanged and
+ * their body skipped
+ */
+class TarParser {
+	public:
+		typedef std::function<void(const TarEntry&)> on_entry_t;
+		typedef std::function<void(const char*, size_t)> on_data_t;
+		typedef std::function<void()> on_entry_end_t;
+
+		TarParser(on_entry_t on_entry, on_data_t on_data,
+				on_entry_end_t on_entry_end);
+
+		void feed(const char *buf, size_t size);
+
+		/*!
+		 * \brief whether the end-of-archive marker has been seen
+		 */
+		bool finished() const {
+			return m_finished;
+		}
+
+	private:
+		on_entry_t m_on_entry;
+		on_data_t m_on_data;
+		on_entry_end_t m_on_entry_end;
+
+		char m_hdr[TAR_BLOCK_SIZE];
+		size_t m_hdr_size = 0;
+		uint64_t m_body_left = 0, m_pad_left = 0;
+		bool m_in_longname = false, m_in_entry = false, m_finished = false;
+		std::string m_longname;
+
+		void parse_header();
+		void end_body();
+};
+
+/*!
+ * walk the directory tree under *root* in pre-order without following
+ * symlinks; *on_entry* is called for every entry with its path relative to
+ * *root*, fd of its parent directory, its name and lstat() result
+ *
+ * directories that could not be opened are skipped
+ *
+ * \param skip_dir a directory to be left out with its contents, compared by
+ *		device and inode so that no other name reaches it; ignored if empty
+ */
+void walk_dir_tree(const std::string &root,
+		std::function<void(const std::string &relpath, int dirfd,
+			const char *name, const struct stat &st)> on_entry,
+		const std::string &skip_dir = std::string());
+
+/*!
+ * \brief write the directory tree under *root* as an archive, ending with
+ *		the trailer; symlinks and special files are skipped
+ *
+ * \param send called with headers, paddings and the trailer
+ * \param send_body called to send the first *size* bytes of file *fd*;
+ *		returns the number of bytes actually sent, which is less than *size*
+ *		if the file has shrunk, and then the rest is padded with zeros
+ * \param skip_dir directory not to be archived, as in walk_dir_tree()
+ * \return number of regular files written
+ */
+int tar_write_tree(const std::string &root,
+		std::function<void(const void*, size_t)> send,
+		std::function<uint64_t(int fd, uint64_t size)> send_body,
+		const std::string &skip_dir = std::string());
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
@@ -0,0 +1,189 @@
+/*
+ * $File: zstream.cc
+ * $Date: Mon Oct 19 11:20:13 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+#define ZSTREAM_BUF_SIZE	(256 * 1024)
+#define ZSTREAM_NR_OUT_BUF	4
+
+#include "zstream.hh"
+#include "common.hh"
+
+#include <cstring>
+
+ZSender::ZSender(std::shared_ptr<SocketBase> socket, int level):
+	m_socket(socket),
+	m_fill(ZSTREAM_BUF_SIZE), m_pending(ZSTREAM_BUF_SIZE)
+{
+	memset(&m_zs, 0, sizeof(m_zs));
+	if (deflateInit(&m_zs, level) != Z_OK)
+		throw WFTPError("deflateInit failed: %s", m_zs.msg);
+	m_worker = std::thread(&ZSender::worker, this);
+}
+
+ZSender::~ZSender() {
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		m_stop = true;
+	}
+	m_cv.notify_all();
+	if (m_worker.joinable())
+		m_worker.join();
+	deflateEnd(&m_zs);
+}
+
+void ZSender::worker() {
+	std::unique_lock<std::mutex> lock(m_mtx);
+	for (; ; ) {
+		m_cv.wait(lock, [this](){ return m_has_pending || m_stop; });
+		if (m_stop)
+			return;
+		bool finishing = m_finishing;
+		lock.unlock();
+
+		try {
+			m_zs.next_in = reinterpret_cast<Bytef*>(m_pending.data());
+			m_zs.avail_in = m_pending_size;
+			int flush = finishing ? Z_FINISH : Z_NO_FLUSH, rst;
+			do {
+				auto out = get_out_buf();
+				m_zs.next_out = reinterpret_cast<Bytef*>(out->data());
+				m_zs.avail_out = out->size();
+				rst = deflate(&m_zs, flush);
+				if (rst == Z_STREAM_ERROR)
+					throw WFTPError("deflate failed: %s", m_zs.msg);
+				size_t size = out->size() - m_zs.avail_out;
+				if (size)
+					m_socket->send_zerocopy(out, out->data(), size);
+			} while (m_zs.avail_out == 0 ||
+					(finishing && rst != Z_STREAM_END));
+		} catch (...) {
+			lock.lock();
+			m_error = std::current_exception();
+			m_has_pending = false;
+			m_cv.notify_all();
+			return;
+		}
+
+		lock.lock();
+		m_has_pending = false;
+		m_cv.notify_all();
+		if (finishing)
+			return;
+	}
+}
+
+std::shared_ptr<std::vector<char>> ZSender::get_out_buf() {
+	for (; ; ) {
+		for (auto &i: m_out)
+			if (i.use_count() == 1)
+				return i;
+		if (m_out.size() < ZSTREAM_NR_OUT_BUF) {
+			m_out.emplace_back(
+					std::make_shared<std::vector<char>>(ZSTREAM_BUF_SIZE));
+			return m_out.back();
+		}
+		m_socket->reap_zerocopy(m_socket->nr_zerocopy_pending() - 1);
+	}
+}
+
+void ZSender::submit(bool finish) {
+	std::unique_lock<std::mutex> lock(m_mtx);
+	m_cv.wait(lock, [this](){ return !m_has_pending || m_error; });
+	if (m_error)
+		std::rethrow_exception(m_error);
+	std::swap(m_fill, m_pending);
+	m_pending_size = m_fill_size;
+	m_fill_size = 0;
+	m_has_pending = true;
+	m_finishing = finish;
+	m_cv.notify_all();
+}
+
+void ZSender::append(const void *buf0, size_t size) {
+	auto buf = static_cast<const char*>(buf0);
+	while (size) {
+		size_t s = std::min(size, m_fill.size() - m_fill_size);
+		memcpy(m_fill.data() + m_fill_size, buf, s);
+		m_fill_size += s;
+		buf += s;
+		size -= s;
+		if (m_fill_size == m_fill.size())
+			submit(false);
+	}
+}
+
+void ZSender::send(const void *buf, size_t size) {
+	append(buf, size);
+}
+
+void ZSender::send_crlf(const char *msg, size_t size) {
+	const char *cur = msg, *end = msg + size;
+	while (cur < end) {
+		auto lf = static_cast<const char*>(memchr(cur, '\n', end - cur));
+		if (!lf) {
+			append(cur, end - cur);
+			break;
+		}
+		bool has_cr = lf > msg ? lf[-1] == '\r' : m_crlf_last_cr;
+		append(cur, lf - cur);
+		if (has_cr)
+			append("\n", 1);
+		else
+			append("\r\n", 2);
+		cur = lf + 1;
+	}
+	if (size)
+		m_crlf_last_cr = msg[size - 1] == '\r';
+}
+
+void ZSender::finish() {
+	submit(true);
+	m_worker.join();
+	if (m_error)
+		std::rethrow_exception(m_error);
+}
+
+ZReceiver::ZReceiver(std::shared_ptr<SocketBase> socket):
+	m_socket(socket), m_in(ZSTREAM_BUF_SIZE)
+{
+	memset(&m_zs, 0, sizeof(m_zs));
+	if (inflateInit(&m_zs) != Z_OK)
+		throw WFTPError("inflateInit failed: %s", m_zs.msg);
+}
+
+ZReceiver::~ZReceiver() {
+	inflateEnd(&m_zs);
+}
+
+size_t ZReceiver::recv(void *buf, size_t max_size) {
+	if (m_stream_end)
+		return 0;
+	m_zs.next_out = static_cast<Bytef*>(buf);
+	m_zs.avail_out = max_size;
+	for (; ; ) {
+		if (!m_zs.avail_in && !m_eof) {
+			size_t size = m_socket->recv(m_in.data(), m_in.size());
+			if (!size)
+				m_eof = true;
+			m_zs.next_in = reinterpret_cast<Bytef*>(m_in.data());
+			m_zs.avail_in = size;
+		}
+		int rst = inflate(&m_zs, Z_NO_FLUSH);
+		size_t size = max_size - m_zs.avail_out;
+		if (rst == Z_STREAM_END) {
+			m_stream_end = true;
+			return size;
+		}
+		if (rst != Z_OK && rst != Z_BUF_ERROR)
+			throw WFTPError("inflate failed: %s",
+					m_zs.msg ? m_zs.msg : "unknown error");
+		if (size)
+			return size;
+		if (m_eof && !m_zs.avail_in)
+			throw WFTPError("unexpected EOF in deflate stream");
+	}
+}
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
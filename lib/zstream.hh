@@ -0,0 +1,109 @@
+/*
+ * $File: zstream.hh
+ * $Date: Mon Oct 19 11:20:13 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+#pragma once
+
+#include "socket.hh"
+
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <zlib.h>
+
+/*!
+ * \brief deflate data and send it through a socket (MODE Z transfer)
+ *
+ * compression and socket writing run in a background thread, so the caller
+ * could fill the next input buffer while the previous one is being
+ * compressed; finish() must be called to terminate the stream
+ *
+ * compressed data is sent by SocketBase::send_zerocopy() from a small ring
+ * of output buffers, so it is not copied again if the socket has zerocopy
+ * enabled
+ */
+class ZSender {
+	std::shared_ptr<SocketBase> m_socket;
+	z_stream m_zs;
+
+	// m_fill is filled by the caller, m_pending is consumed by the worker
+	std::vector<char> m_fill, m_pending;
+	std::vector<std::shared_ptr<std::vector<char>>> m_out;
+	size_t m_fill_size = 0, m_pending_size = 0;
+	bool m_has_pending = false, m_finishing = false, m_stop = false;
+	bool m_crlf_last_cr = false;
+	std::exception_ptr m_error;
+
+	std::mutex m_mtx;
+	std::condition_variable m_cv;
+	std::thread m_worker;
+
+	void worker();
+
+	/*!
+	 * get an output buffer not referenced by pending zerocopy sends
+	 */
+	std::shared_ptr<std::vector<char>> get_out_buf();
+
+	/*!
+	 * hand m_fill to the worker, waiting for the previous buffer to be
+	 * consumed
+	 */
+	void submit(bool finish);
+
+	void append(const void *buf, size_t size);
+
+	public:
+		/*!
+		 * \param level zlib compression level; Z_NO_COMPRESSION would only
+		 *		wrap the data in stored blocks
+		 */
+		ZSender(std::shared_ptr<SocketBase> socket,
+				int level = Z_DEFAULT_COMPRESSION);
+		ZSender(const ZSender &) = delete;
+		~ZSender();
+
+		ZSender& operator = (const ZSender &) = delete;
+
+		void send(const void *buf, size_t size);
+
+		/*!
+		 * send text with CRLF linebreaks, see SocketBase::send_crlf
+		 */
+		void send_crlf(const char *msg, size_t size);
+
+		/*!
+		 * flush remaining data and end the deflate stream
+		 */
+		void finish();
+};
+
+/*!
+ * \brief receive and inflate data sent by a ZSender
+ */
+class ZReceiver {
+	std::shared_ptr<SocketBase> m_socket;
+	z_stream m_zs;
+	std::vector<char> m_in;
+	bool m_eof = false, m_stream_end = false;
+
+	public:
+		ZReceiver(std::shared_ptr<SocketBase> socket);
+		ZReceiver(const ZReceiver &) = delete;
+		~ZReceiver();
+
+		ZReceiver& operator = (const ZReceiver &) = delete;
+
+		/*!
+		 * receive decompressed data; return 0 on end of stream
+		 */
+		size_t recv(void *buf, size_t max_size);
+};
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
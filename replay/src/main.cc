@@ -0,0 +1,493 @@
+/*
+ * $File: main.cc
+ * $Date: Mon Oct 19 12:31:05 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+/*
+ * replay control-channel command streams captured by "wftp_server -r"
+ * against a server, keeping the original timing (optionally sped up), and
+ * report per-command latencies
+ */
+
+#include "socket.hh"
+#include "cmdparser.hh"
+#include "zstream.hh"
+#include "tar.hh"
+
+#define DATA_BUF_SIZE	(1024 * 1024)
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+typedef std::chrono::steady_clock clock_type;
+
+struct Record {
+	uint64_t start_us;
+	int session;
+	std::string code;
+	uint64_t size;
+	std::string cwd;
+	CMDPair cmd;
+};
+
+/*!
+ * latencies and transfer sizes collected from all sessions
+ */
+class Stats {
+	std::mutex m_mtx;
+	std::map<std::string, std::vector<double>> m_latency;
+	uint64_t m_bytes_down = 0, m_bytes_up = 0;
+	int m_nr_mismatch = 0, m_nr_failed_session = 0;
+
+	public:
+		void add(const std::string &cmd, double latency_ms,
+				uint64_t bytes_down, uint64_t bytes_up, bool mismatch) {
+			std::lock_guard<std::mutex> lock(m_mtx);
+			m_latency[cmd].push_back(latency_ms);
+			m_bytes_down += bytes_down;
+			m_bytes_up += bytes_up;
+			m_nr_mismatch += mismatch;
+		}
+
+		void add_failed_session() {
+			std::lock_guard<std::mutex> lock(m_mtx);
+			m_nr_failed_session ++;
+		}
+
+		void report(FILE *fout) {
+			std::lock_guard<std::mutex> lock(m_mtx);
+			fprintf(fout, "%-8s %8s %10s %10s %10s %10s\n",
+					"cmd", "count", "mean_ms", "p50_ms", "p99_ms", "max_ms");
+			for (auto &i: m_latency) {
+				auto &lat = i.second;
+				std::sort(lat.begin(), lat.end());
+				double sum = 0;
+				for (auto j: lat)
+					sum += j;
+				fprintf(fout, "%-8s %8d %10.3f %10.3f %10.3f %10.3f\n",
+						i.first.c_str(), int(lat.size()), sum / lat.size(),
+						lat[lat.size() / 2], lat[lat.size() * 99 / 100],
+						lat.back());
+			}
+			fprintf(fout, "downloaded %llu bytes, uploaded %llu bytes\n",
+					(unsigned long long)m_bytes_down,
+					(unsigned long long)m_bytes_up);
+			fprintf(fout, "%d replies differ from capture, "
+					"%d sessions failed\n",
+					m_nr_mismatch, m_nr_failed_session);
+		}
+};
+
+static std::vector<Record> load_capture(const char *fpath) {
+	std::ifstream fin(fpath);
+	if (!fin)
+		throw WFTPError("failed to open `%s'", fpath);
+	std::vector<Record> rst;
+	std::string line;
+	for (int lineno = 1; std::getline(fin, line); lineno ++) {
+		std::string field[7];
+		size_t pos = 0;
+		for (int i = 0; i < 6; i ++) {
+			auto end = line.find('\t', pos);
+			if (end == std::string::npos)
+				throw WFTPError("%s:%d: bad capture line", fpath, lineno);
+			field[i] = line.substr(pos, end - pos);
+			pos = end + 1;
+		}
+		field[6] = line.substr(pos);
+		Record rec;
+		rec.start_us = strtoull(field[0].c_str(), nullptr, 10);
+		rec.session = atoi(field[1].c_str());
+		rec.code = field[2];
+		rec.size = strtoull(field[3].c_str(), nullptr, 10);
+		rec.cwd = field[4];
+		rec.cmd.cmd = field[5];
+		rec.cmd.arg = field[6];
+		rst.push_back(rec);
+	}
+	return rst;
+}
+
+/*!
+ * path of *fpath* sent in working dir *cwd* relative to server root;
+ * return empty string for paths escaping the root
+ */
+static std::string resolve_path(const std::string &cwd,
+		const std::string &fpath) {
+	std::string path = fpath[0] == '/' ? fpath : cwd + "/" + fpath;
+	for (size_t pos = 0; pos < path.length(); ) {
+		auto end = path.find('/', pos);
+		if (end == std::string::npos)
+			end = path.length();
+		if (path.compare(pos, end - pos, "..") == 0)
+			return std::string();
+		pos = end + 1;
+	}
+	return path;
+}
+
+static void makedirs(const std::string &path) {
+	for (size_t pos = 1; pos <= path.length(); pos ++)
+		if (pos == path.length() || path[pos] == '/')
+			mkdir(path.substr(0, pos).c_str(), 0755);
+}
+
+static void create_file(const std::string &path, uint64_t size) {
+	struct stat st;
+	if (!stat(path.c_str(), &st) && uint64_t(st.st_size) == size)
+		return;
+	makedirs(path.substr(0, path.rfind('/')));
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		throw WFTPError("failed to create `%s': %m", path.c_str());
+	std::vector<char> buf(std::min<uint64_t>(size, DATA_BUF_SIZE));
+	for (auto &i: buf)
+		i = rand();
+	while (size) {
+		auto s = std::min<uint64_t>(size, buf.size());
+		if (write(fd, buf.data(), s) != ssize_t(s)) {
+			close(fd);
+			throw WFTPError("failed to write `%s': %m", path.c_str());
+		}
+		size -= s;
+	}
+	close(fd);
+}
+
+/*!
+ * \brief upper-cased subcommand of a SITE command
+ * \param arg set to the argument of the subcommand if not null
+ */
+static std::string site_subcmd(const CMDPair &cmd, std::string *arg = nullptr) {
+	auto sep = cmd.arg.find(' ');
+	auto sub = cmd.arg.substr(0, sep);
+	for (auto &i: sub)
+		i = std::toupper(i);
+	if (arg)
+		*arg = sep == std::string::npos ? std::string() :
+			cmd.arg.substr(sep + 1);
+	return sub;
+}
+
+/*!
+ * \brief whether a command transfers data over a data connection
+ */
+static bool uses_data_conn(const CMDPair &cmd) {
+	if (cmd.cmd == "RETR" || cmd.cmd == "STOR" ||
+			cmd.cmd == "LIST" || cmd.cmd == "NLST")
+		return true;
+	if (cmd.cmd != "SITE")
+		return false;
+	auto sub = site_subcmd(cmd);
+	return sub == "TAR" || sub == "UNTAR" || sub == "TAIL";
+}
+
+/*!
+ * create directories and files referenced by the capture under *root*, so
+ * that commands succeeding in the capture also succeed when replayed
+ */
+static void prepare_root(const std::string &root,
+		const std::vector<Record> &records) {
+	std::map<std::string, uint64_t> files;
+	for (auto &rec: records) {
+		makedirs(root + rec.cwd);
+		auto cmd = rec.cmd.cmd, arg = rec.cmd.arg;
+		if (cmd == "SITE") {
+			cmd = "SITE " + site_subcmd(rec.cmd, &arg);
+			if (arg.empty())
+				arg = ".";
+		}
+		if (rec.code[0] != '2' || arg.empty())
+			continue;
+		auto path = resolve_path(rec.cwd, arg);
+		if (path.empty())
+			continue;
+		if (cmd == "CWD" || cmd == "RMD" || cmd == "SITE TAR" ||
+				cmd == "SITE UNTAR")
+			makedirs(root + path);
+		else if (cmd == "RETR" || cmd == "SITE TAIL")
+			files.insert({path, rec.size});	// keep the first size seen
+		else if (cmd == "SIZE" || cmd == "DELE")
+			files.insert({path, 0});
+	}
+	for (auto &i: files)
+		create_file(root + i.first, i.second);
+	printf("prepared %d files under %s\n", int(files.size()), root.c_str());
+}
+
+/*!
+ * replay commands of a single session
+ */
+class SessionReplayer {
+	std::shared_ptr<SocketBase> m_ctrl;
+	CMDParser m_parser;
+	Stats &m_stats;
+	bool m_mode_z = false;
+	std::vector<char> m_buf;
+	uint64_t m_bytes_down, m_bytes_up;
+
+	void send_cmd(const CMDPair &cmd) {
+		auto line = cmd.arg.empty() ? cmd.cmd : cmd.cmd + " " + cmd.arg;
+		line.append("\r\n");
+		m_ctrl->send(line.c_str(), line.length());
+	}
+
+	/*!
+	 * receive a reply, skipping lines of multi-line replies
+	 */
+	CMDPair get_reply() {
+		for (; ; ) {
+			auto rst = m_parser.recv();
+			if (rst.cmd.size() == 3 && std::isdigit(rst.cmd[0]))
+				return rst;
+		}
+	}
+
+	CMDPair get_final_reply() {
+		auto rst = get_reply();
+		while (rst.cmd[0] == '1')
+			rst = get_reply();
+		return rst;
+	}
+
+	std::shared_ptr<SocketBase> open_pasv_data_conn() {
+		send_cmd({"PASV", ""});
+		auto rst = get_reply();
+		int h0, h1, h2, h3, p0, p1;
+		if (rst.cmd != "227" || sscanf(
+					rst.arg.substr(rst.arg.rfind(' ') + 1).c_str(),
+					"(%d,%d,%d,%d,%d,%d)",
+					&h0, &h1, &h2, &h3, &p0, &p1) != 6)
+			throw WFTPError("bad response for PASV: %s %s",
+					rst.cmd.c_str(), rst.arg.c_str());
+		return SocketBase::connect(
+				ssprintf("%d.%d.%d.%d", h0, h1, h2, h3).c_str(),
+				ssprintf("%d", p0 * 256 + p1).c_str());
+	}
+
+	/*!
+	 * \param limit stop after this number of bytes, for streams that the
+	 *		server does not end by itself
+	 */
+	void recv_data(std::shared_ptr<SocketBase> data_conn,
+			uint64_t limit = UINT64_MAX) {
+		std::unique_ptr<ZReceiver> zreceiver;
+		if (m_mode_z)
+			zreceiver.reset(new ZReceiver(data_conn));
+		while (m_bytes_down < limit) {
+			auto size = zreceiver ?
+				zreceiver->recv(m_buf.data(), m_buf.size()) :
+				data_conn->recv(m_buf.data(), m_buf.size());
+			if (!size)
+				break;
+			m_bytes_down += size;
+		}
+	}
+
+	/*!
+	 * \param tar send a tar stream of about *size* bytes with a single
+	 *		file, rather than raw bytes
+	 */
+	void send_data(std::shared_ptr<SocketBase> data_conn, uint64_t size,
+			bool tar = false) {
+		std::unique_ptr<ZSender> zsender;
+		if (m_mode_z)
+			zsender.reset(new ZSender(data_conn));
+		auto send = [&](const char *buf, size_t s) {
+			if (zsender)
+				zsender->send(buf, s);
+			else
+				data_conn->send(buf, s);
+			m_bytes_up += s;
+		};
+		std::string trailer;
+		if (tar) {
+			uint64_t overhead = TAR_BLOCK_SIZE + tar_trailer().size();
+			size = size > overhead ? size - overhead : 0;
+			auto hdr = tar_header({"replay.bin", TarEntry::REGULAR, 0644,
+					size, time(nullptr)});
+			send(hdr.data(), hdr.size());
+			trailer.assign(tar_padding(size), 0);
+			trailer.append(tar_trailer());
+		}
+		while (size) {
+			auto s = std::min<uint64_t>(size, m_buf.size());
+			send(m_buf.data(), s);
+			size -= s;
+		}
+		send(trailer.data(), trailer.size());
+		if (zsender)
+			zsender->finish();
+	}
+
+	CMDPair replay_transfer(const Record &rec) {
+		auto data_conn = open_pasv_data_conn();
+		send_cmd(rec.cmd);
+		auto rst = get_reply();
+		if (rst.cmd[0] != '1')
+			return rst;
+		auto sub = rec.cmd.cmd == "SITE" ? site_subcmd(rec.cmd) :
+			std::string();
+		if (rec.cmd.cmd == "STOR")
+			send_data(data_conn, rec.size);
+		else if (sub == "UNTAR")
+			send_data(data_conn, rec.size, true);
+		else if (sub == "TAIL")
+			// the client ended the original TAIL by closing the connection
+			recv_data(data_conn, rec.size);
+		else
+			recv_data(data_conn);
+		data_conn->close();
+		return get_final_reply();
+	}
+
+	public:
+		SessionReplayer(std::shared_ptr<SocketBase> socket, Stats &stats):
+			m_ctrl(socket), m_parser(socket), m_stats(stats),
+			m_buf(DATA_BUF_SIZE)
+		{
+			m_ctrl->enable_timeout();
+			get_final_reply();
+		}
+
+		void replay(const Record &rec) {
+			auto &cmd = rec.cmd.cmd;
+			if (cmd == "PASV" || cmd == "PORT" || cmd == "QUIT")
+				return;
+			m_bytes_down = m_bytes_up = 0;
+			auto start = clock_type::now();
+			CMDPair rst;
+			if (uses_data_conn(rec.cmd))
+				rst = replay_transfer(rec);
+			else {
+				send_cmd(rec.cmd);
+				rst = get_final_reply();
+			}
+			std::chrono::duration<double, std::milli> latency =
+				clock_type::now() - start;
+			if (cmd == "MODE" && rst.cmd[0] == '2')
+				m_mode_z = rec.cmd.arg == "Z" || rec.cmd.arg == "z";
+			m_stats.add(cmd, latency.count(), m_bytes_down, m_bytes_up,
+					rst.cmd[0] != rec.code[0]);
+		}
+
+		void quit() {
+			send_cmd({"QUIT", ""});
+			get_final_reply();
+		}
+};
+
+static void replay_session(const char *host, const char *port,
+		const std::vector<Record> &records, Stats &stats,
+		clock_type::time_point base, uint64_t first_us, double speedup) {
+	auto wait = [&](const Record &rec) {
+		std::this_thread::sleep_until(base +
+				std::chrono::microseconds(uint64_t(
+						(rec.start_us - first_us) / speedup)));
+	};
+	try {
+		wait(records[0]);
+		SessionReplayer replayer(SocketBase::connect(host, port), stats);
+		for (auto &rec: records) {
+			wait(rec);
+			replayer.replay(rec);
+		}
+		replayer.quit();
+	} catch (std::exception &exc) {
+		wftp_log("session %d failed: %s", records[0].session, exc.what());
+		stats.add_failed_session();
+	}
+}
+
+int main(int argc, char **argv) {
+	double speedup = 1;
+	const char *root = nullptr;
+	std::vector<const char*> pos_args;
+	for (int i = 1; i < argc; i ++) {
+		if (!strcmp(argv[i], "-s")) {
+			if (i == argc - 1 || sscanf(argv[i + 1], "%lf", &speedup) != 1 ||
+					speedup <= 0) {
+				fprintf(stderr, "bad speed-up factor\n");
+				return -1;
+			}
+			i ++;
+		} else if (!strcmp(argv[i], "-d")) {
+			if (i == argc - 1) {
+				fprintf(stderr, "argument required\n");
+				return -1;
+			}
+			root = argv[++ i];
+		} else
+			pos_args.push_back(argv[i]);
+	}
+	if (pos_args.size() != 3) {
+		fprintf(stderr, "usage: %s [-s speedup] [-d scratch_root] "
+				"<capture_file> <host> <port>\n"
+				"  -s: replay faster than captured by given factor\n"
+				"  -d: create files and directories referenced by the "
+				"capture under\n"
+				"      scratch_root, which should be the root dir of the "
+				"server\n", argv[0]);
+		return -1;
+	}
+
+	try {
+		auto records = load_capture(pos_args[0]);
+		if (records.empty()) {
+			fprintf(stderr, "empty capture\n");
+			return -1;
+		}
+		if (root)
+			prepare_root(root, records);
+
+		std::map<int, std::vector<Record>> sessions;
+		uint64_t first_us = records[0].start_us, last_us = first_us;
+		for (auto &rec: records) {
+			sessions[rec.session].push_back(rec);
+			first_us = std::min(first_us, rec.start_us);
+			last_us = std::max(last_us, rec.start_us);
+		}
+
+		Stats stats;
+		auto base = clock_type::now();
+		std::vector<std::thread> threads;
+		for (auto &i: sessions) {
+			auto &rec = i.second;
+			std::sort(rec.begin(), rec.end(),
+					[](const Record &a, const Record &b) {
+						return a.start_us < b.start_us;
+					});
+			threads.emplace_back(replay_session, pos_args[1], pos_args[2],
+					std::cref(rec), std::ref(stats), base, first_us, speedup);
+		}
+		for (auto &i: threads)
+			i.join();
+		std::chrono::duration<double> elapsed = clock_type::now() - base;
+
+		printf("replayed %d commands of %d sessions in %.3fs "
+				"(captured span %.3fs, speed-up %g)\n",
+				int(records.size()), int(sessions.size()), elapsed.count(),
+				(last_us - first_us) / 1e6, speedup);
+		stats.report(stdout);
+	} catch (std::exception &exc) {
+		wftp_log("unexpected exception: %s", exc.what());
+		return -1;
+	}
+}
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
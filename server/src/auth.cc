@@ -0,0 +1,225 @@
+/*
+ * $File: auth.cc
+ * $Date: Mon Oct 19 20:12:46 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+// threads computing password hashes
+#define AUTH_NR_THREAD		2
+
+// max number of logins waiting for a hashing thread
+#define AUTH_MAX_PENDING	128
+
+// seconds a successful verification is cached
+#define AUTH_CACHE_TTL		600
+
+#define AUTH_CACHE_NR_SHARD	16
+
+// max number of cached users in a shard
+#define AUTH_CACHE_SHARD_SIZE	1024
+
+#include "auth.hh"
+#include "common.hh"
+
+#include <cstring>
+#include <ctime>
+#include <fstream>
+
+#include <crypt.h>
+#include <sys/stat.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+BoundedPool::BoundedPool(int nr_thread, size_t max_pending):
+	m_nr_thread(nr_thread), m_max_pending(max_pending)
+{
+}
+
+BoundedPool::~BoundedPool() {
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		m_stop = true;
+	}
+	m_cv.notify_all();
+	for (auto &i: m_threads)
+		i.join();
+}
+
+void BoundedPool::worker() {
+	std::unique_lock<std::mutex> lock(m_mtx);
+	for (; ; ) {
+		m_cv.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+		if (m_stop)
+			return;
+		auto job = std::move(m_jobs.front());
+		m_jobs.pop_front();
+		lock.unlock();
+		job();
+		lock.lock();
+	}
+}
+
+bool BoundedPool::submit(std::function<void()> job) {
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		if (m_jobs.size() >= m_max_pending)
+			return false;
+		// threads are not inherited by fork(), so they are started by the
+		// process that serves the logins
+		if (m_threads.empty())
+			for (int i = 0; i < m_nr_thread; i ++)
+				m_threads.emplace_back(&BoundedPool::worker, this);
+		m_jobs.emplace_back(std::move(job));
+	}
+	m_cv.notify_one();
+	return true;
+}
+
+PasswdFileAuth::PasswdFileAuth(const std::string &path):
+	m_path(path), m_cache(new CacheShard[AUTH_CACHE_NR_SHARD]),
+	m_pool(AUTH_NR_THREAD, AUTH_MAX_PENDING)
+{
+	if (RAND_bytes(m_mac_key, sizeof(m_mac_key)) != 1)
+		throw WFTPError("failed to generate MAC key");
+	std::string hash;
+	get_hash("", hash);
+	if (!m_file_ino)
+		throw WFTPError("failed to read password file `%s'", path.c_str());
+	wftp_log("%zu users loaded from `%s'", m_hashes.size(), path.c_str());
+}
+
+void PasswdFileAuth::reload() {
+	struct stat st;
+	if (stat(m_path.c_str(), &st) || (st.st_ino == m_file_ino &&
+				st.st_mtime == m_file_mtime && st.st_size == m_file_size))
+		return;
+	std::ifstream fin(m_path);
+	if (!fin)
+		return;
+	std::map<std::string, std::string> hashes, homes;
+	for (std::string line; std::getline(fin, line); ) {
+		auto sep = line.find(':');
+		if (line.empty() || line[0] == '#' || sep == std::string::npos)
+			continue;
+		auto user = line.substr(0, sep);
+		auto end = line.find(':', sep + 1);
+		hashes[user] = line.substr(sep + 1,
+				end == std::string::npos ? end : end - sep - 1);
+		if (end != std::string::npos) {
+			auto home = line.substr(end + 1, line.find(':', end + 1) - end - 1);
+			if (!home.empty())
+				homes[user] = home;
+		}
+	}
+	m_hashes.swap(hashes);
+	m_homes.swap(homes);
+	if (!m_hashes.empty())
+		m_dummy_hash = m_hashes.begin()->second;
+	m_file_ino = st.st_ino;
+	m_file_mtime = st.st_mtime;
+	m_file_size = st.st_size;
+}
+
+bool PasswdFileAuth::get_hash(const std::string &user, std::string &hash) {
+	std::lock_guard<std::mutex> lock(m_file_mtx);
+	reload();
+	auto iter = m_hashes.find(user);
+	if (iter == m_hashes.end()) {
+		hash = m_dummy_hash;
+		return false;
+	}
+	hash = iter->second;
+	return true;
+}
+
+std::string PasswdFileAuth::home_dir(const std::string &user) {
+	std::lock_guard<std::mutex> lock(m_file_mtx);
+	reload();
+	auto iter = m_homes.find(user);
+	return iter == m_homes.end() ? std::string() : iter->second;
+}
+
+std::string PasswdFileAuth::compute_mac(const std::string &user,
+		const std::string &password) {
+	auto msg = user + '\0' + password;
+	unsigned char mac[EVP_MAX_MD_SIZE];
+	unsigned mac_size = 0;
+	if (!HMAC(EVP_sha256(), m_mac_key, sizeof(m_mac_key),
+				reinterpret_cast<const unsigned char*>(msg.data()), msg.size(),
+				mac, &mac_size))
+		throw WFTPError("HMAC failed");
+	return std::string(reinterpret_cast<char*>(mac), mac_size);
+}
+
+PasswdFileAuth::CacheShard& PasswdFileAuth::shard_of(const std::string &user) {
+	return m_cache[std::hash<std::string>()(user) % AUTH_CACHE_NR_SHARD];
+}
+
+bool PasswdFileAuth::verify(const std::string &user,
+		const std::string &password) {
+	std::string hash;
+	bool known = get_hash(user, hash);
+	if (hash.empty())
+		return false;
+	auto mac = compute_mac(user, password);
+	auto key = user + '\0' + mac;
+	auto &shard = shard_of(user);
+	std::shared_future<bool> future;
+	std::shared_ptr<std::promise<bool>> result;
+	{
+		std::lock_guard<std::mutex> lock(shard.mtx);
+		auto iter = shard.entries.find(user);
+		if (known && iter != shard.entries.end()) {
+			auto &entry = iter->second;
+			if (entry.expire > time(nullptr) && entry.hash == hash &&
+					!CRYPTO_memcmp(entry.mac.data(), mac.data(), mac.size()))
+				return true;
+		}
+		auto pending = shard.pending.find(key);
+		if (pending != shard.pending.end())
+			future = pending->second;
+		else {
+			result = std::make_shared<std::promise<bool>>();
+			future = result->get_future().share();
+			shard.pending[key] = future;
+		}
+	}
+	if (!result)
+		return future.get() && known;
+
+	bool submitted = m_pool.submit([result, hash, password]() {
+		// struct crypt_data is too large for the stack
+		std::unique_ptr<struct crypt_data> data(new struct crypt_data);
+		memset(data.get(), 0, sizeof(*data));
+		auto rst = crypt_r(password.c_str(), hash.c_str(), data.get());
+		result->set_value(rst && strlen(rst) == hash.size() &&
+				!CRYPTO_memcmp(rst, hash.data(), hash.size()));
+	});
+	if (!submitted)
+		result->set_value(false);
+	bool ok = future.get() && known;
+
+	std::lock_guard<std::mutex> lock(shard.mtx);
+	shard.pending.erase(key);
+	if (!submitted)
+		throw WFTPError("too many logins in progress");
+	if (!ok)
+		return false;
+	auto now = time(nullptr);
+	if (shard.entries.size() >= AUTH_CACHE_SHARD_SIZE) {
+		for (auto i = shard.entries.begin(); i != shard.entries.end(); )
+			if (i->second.expire <= now)
+				i = shard.entries.erase(i);
+			else
+				++ i;
+		if (shard.entries.size() >= AUTH_CACHE_SHARD_SIZE)
+			shard.entries.erase(shard.entries.begin());
+	}
+	shard.entries[user] = {hash, mac, now + AUTH_CACHE_TTL};
+	return true;
+}
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
@@ -0,0 +1,149 @@
+/*
+ * $File: auth.hh
+ * $Date: Mon Oct 19 20:12:46 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*!
+ * \brief verifies login credentials
+ */
+class Authenticator {
+	public:
+		virtual ~Authenticator() = default;
+
+		/*!
+		 * \brief check *password* of *user*; may block for a while
+		 *
+		 * throws WFTPError if the check could not be done now, e.g. when
+		 * the server is overloaded
+		 */
+		virtual bool verify(const std::string &user,
+				const std::string &password) = 0;
+
+		/*!
+		 * \brief home directory of *user* relative to the server root, to
+		 *		which the session is confined after login
+		 * \return empty if the user could access the whole tree
+		 */
+		virtual std::string home_dir(const std::string &user) {
+			static_cast<void>(user);
+			return {};
+		}
+};
+
+/*!
+ * \brief fixed number of threads running jobs from a bounded queue
+ *
+ * the threads are started by the first submit(), so a pool created before
+ * the server forks its workers works in each of them
+ */
+class BoundedPool {
+	std::mutex m_mtx;
+	std::condition_variable m_cv;
+	std::deque<std::function<void()>> m_jobs;
+	int m_nr_thread;
+	size_t m_max_pending;
+	bool m_stop = false;
+	std::vector<std::thread> m_threads;
+
+	void worker();
+
+	public:
+		BoundedPool(int nr_thread, size_t max_pending);
+		~BoundedPool();
+
+		BoundedPool(const BoundedPool &) = delete;
+		BoundedPool& operator = (const BoundedPool &) = delete;
+
+		/*!
+		 * \brief queue *job*
+		 * \return false if max_pending jobs are already waiting
+		 */
+		bool submit(std::function<void()> job);
+};
+
+/*!
+ * \brief credentials in a password file with `user:hash[:home]' lines, where
+ *		hash is in crypt(3) format, e.g. bcrypt ($2b$) or yescrypt ($y$), and
+ *		home is an optional directory relative to the server root
+ *
+ * the file is reloaded when it changes; hashes are computed on a bounded
+ * thread pool, so a login storm could not occupy all CPUs, and logins
+ * beyond its queue are refused instead of waiting
+ *
+ * successful verifications are cached for a while as HMAC-SHA256 of the
+ * password under a random per-process key, so repeated logins skip the
+ * slow hash; the cache is sharded by user to avoid lock contention
+ */
+class PasswdFileAuth: public Authenticator {
+	struct CacheEntry {
+		std::string hash;	//!< entry in the password file when cached
+		std::string mac;
+		time_t expire;
+	};
+
+	struct CacheShard {
+		std::mutex mtx;
+		std::map<std::string, CacheEntry> entries;
+
+		//! verifications in progress, by user and MAC; concurrent logins
+		//! with the same credentials wait for the same result
+		std::map<std::string, std::shared_future<bool>> pending;
+	};
+
+	std::string m_path;
+
+	std::mutex m_file_mtx;
+	std::map<std::string, std::string> m_hashes;	//!< by user
+	std::map<std::string, std::string> m_homes;		//!< by user
+	std::string m_dummy_hash;
+	ino_t m_file_ino = 0;
+	time_t m_file_mtime = 0;
+	off_t m_file_size = 0;
+
+	unsigned char m_mac_key[32];
+	std::unique_ptr<CacheShard[]> m_cache;
+
+	BoundedPool m_pool;
+
+	/*!
+	 * \brief reload the password file if it has changed, and get the hash
+	 *		of *user*
+	 * \return false if the user is unknown, and then *hash* is a dummy
+	 *		used to make the check take the same time
+	 */
+	bool get_hash(const std::string &user, std::string &hash);
+
+	//! reload the password file if it has changed; m_file_mtx must be held
+	void reload();
+
+	std::string compute_mac(const std::string &user,
+			const std::string &password);
+
+	CacheShard& shard_of(const std::string &user);
+
+	public:
+		PasswdFileAuth(const std::string &path);
+
+		bool verify(const std::string &user,
+				const std::string &password) override;
+
+		std::string home_dir(const std::string &user) override;
+};
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
@@ -0,0 +1,56 @@
+/*
+ * $File: capture.cc
+ * $Date: Mon Oct 19 12:31:05 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+#include "capture.hh"
+#include "common.hh"
+
+#include <ctime>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+bool TrafficCapture::sm_enabled = false;
+
+static int capture_fd = -1;
+
+void TrafficCapture::open(const char *fpath) {
+	capture_fd = ::open(fpath, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND |
+			O_CLOEXEC, 0644);
+	if (capture_fd < 0)
+		throw WFTPError("failed to open capture file `%s': %m", fpath);
+	sm_enabled = true;
+}
+
+uint64_t TrafficCapture::now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+void TrafficCapture::record(uint64_t start_us, int session,
+		const std::string &reply_code, uint64_t xfer_size,
+		const std::string &cwd, const CMDPair &cmd) {
+	static thread_local std::string line;
+	line = ssprintf("%llu\t%d\t%s\t%llu\t",
+			(unsigned long long)start_us, session, reply_code.c_str(),
+			(unsigned long long)xfer_size);
+	line.append(cwd);
+	line.append("\t");
+	line.append(cmd.cmd);
+	line.append("\t");
+	if (cmd.cmd == "PASS")
+		line.append("-");
+	else
+		line.append(cmd.arg);
+	line.append("\n");
+	// a single write() on O_APPEND file does not interleave with other
+	// threads or worker processes
+	if (write(capture_fd, line.c_str(), line.length()) !=
+			ssize_t(line.length()))
+		wftp_log("failed to write capture file: %m");
+}
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
@@ -0,0 +1,49 @@
+/*
+ * $File: capture.hh
+ * $Date: Mon Oct 19 12:31:05 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+#pragma once
+
+#include "cmdparser.hh"
+
+#include <cstdint>
+#include <string>
+
+/*!
+ * \brief record control-channel commands of all sessions to a capture file,
+ *		to be replayed by wftp_replay
+ *
+ * each command is a line of tab-separated fields, written when the command
+ * finishes:
+ *
+ *		start_us session reply_code xfer_size cwd cmd arg
+ *
+ * start_us is CLOCK_MONOTONIC time in microseconds, xfer_size is the
+ * number of (uncompressed) bytes transferred on the data connection, cwd is
+ * the working directory relative to server root, and arg extends to the end
+ * of the line; password of PASS is not recorded
+ */
+class TrafficCapture {
+	static bool sm_enabled;
+
+	public:
+		/*!
+		 * \brief start capturing into *fpath*; must be called before any
+		 *		session thread starts
+		 */
+		static void open(const char *fpath);
+
+		static bool enabled() {
+			return sm_enabled;
+		}
+
+		static uint64_t now_us();
+
+		static void record(uint64_t start_us, int session,
+				const std::string &reply_code, uint64_t xfer_size,
+				const std::string &cwd, const CMDPair &cmd);
+};
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
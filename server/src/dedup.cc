@@ -0,0 +1,137 @@
+/*
+ * $File: dedup.cc
+ * $Date: Mon Oct 19 16:12:05 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+// xattr of blobs recording their hash
+#define BLOB_XATTR	"user.wftp.sha256"
+
+#include "dedup.hh"
+#include "common.hh"
+#include "util.hh"
+#include "sha256.hh"
+
+#include <cerrno>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+static void make_dir(const std::string &path) {
+	if (mkdir(path.c_str(), 0755) && errno != EEXIST)
+		throw WFTPError("failed to create directory `%s': %m", path.c_str());
+}
+
+DedupStore::DedupStore(const std::string &dir) {
+	make_dir(dir);
+	auto p = realpath(dir.c_str(), nullptr);
+	if (!p)
+		throw WFTPError("failed to get realpath for `%s': %m", dir.c_str());
+	m_dir.assign(p);
+	free(p);
+	if (m_dir.back() != '/')
+		m_dir.append("/");
+	make_dir(m_dir + "tmp");
+}
+
+FILE* DedupStore::open_tmpfile(std::string &tmppath) {
+	tmppath = m_dir + "tmp/upload-XXXXXX";
+	int fd = mkostemp(&tmppath[0], O_CLOEXEC);
+	if (fd < 0)
+		return nullptr;
+	fchmod(fd, 0644);
+	FILE *rst = fdopen(fd, "wb");
+	if (!rst) {
+		close(fd);
+		unlink(tmppath.c_str());
+	}
+	return rst;
+}
+
+bool DedupStore::add(const std::string &tmppath, const std::string &hash) {
+	auto blob = blob_path(hash);
+	make_dir(blob.substr(0, blob.rfind('/')));
+	// link() rather than rename() never replaces an existing blob, which
+	// may be linked to by files
+	bool is_new = true;
+	// without the xattr, the blob is simply never released
+	setxattr(tmppath.c_str(), BLOB_XATTR, hash.data(), hash.size(), 0);
+	if (link(tmppath.c_str(), blob.c_str())) {
+		if (errno != EEXIST)
+			throw WFTPError("failed to add blob: %m");
+		is_new = false;
+	}
+	unlink(tmppath.c_str());
+	return is_new;
+}
+
+bool DedupStore::link_to(const std::string &hash, int dirfd,
+		const std::string &name) {
+	auto blob = blob_path(hash);
+	int src = open(blob.c_str(), O_RDONLY | O_CLOEXEC);
+	if (src < 0) {
+		if (errno == ENOENT)
+			return false;
+		throw WFTPError("failed to open blob: %m");
+	}
+	AutoFDCloser src_closer(src);
+	struct stat src_stat, dst_stat;
+	if (fstat(src, &src_stat))
+		throw WFTPError("fstat: %m");
+	// rename() does nothing if both names are links to the same file
+	if (!fstatat(dirfd, name.c_str(), &dst_stat, AT_SYMLINK_NOFOLLOW) &&
+			dst_stat.st_dev == src_stat.st_dev &&
+			dst_stat.st_ino == src_stat.st_ino)
+		return true;
+
+	int dst = openat(dirfd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+	if (dst >= 0) {
+		AutoFDCloser dst_closer(dst);
+		if (!ioctl(dst, FICLONE, src)) {
+			if (link_fd_at(dst, dirfd, name))
+				throw WFTPError("failed to link clone: %m");
+			return true;
+		}
+	}
+	if (replace_by_link(dirfd, name, [&](const char *tmpname) {
+				return linkat(AT_FDCWD, blob.c_str(), dirfd, tmpname, 0);
+			})) {
+		// released by another session since opened
+		if (errno == ENOENT)
+			return false;
+		throw WFTPError("failed to link blob: %m");
+	}
+	return true;
+}
+
+std::string DedupStore::blob_of(int dirfd, const std::string &name) const {
+	int fd = openat(dirfd, name.c_str(),
+			O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		return {};
+	AutoFDCloser closer(fd);
+	struct stat st, blob_st;
+	char buf[64];
+	auto size = fgetxattr(fd, BLOB_XATTR, buf, sizeof(buf));
+	if (size != sizeof(buf) || fstat(fd, &st) || st.st_nlink < 2)
+		return {};
+	std::string hash(buf, size);
+	if (!is_sha256_hex(hash) || stat(blob_path(hash).c_str(), &blob_st) ||
+			blob_st.st_dev != st.st_dev || blob_st.st_ino != st.st_ino)
+		return {};
+	return hash;
+}
+
+void DedupStore::release(const std::string &hash) {
+	auto blob = blob_path(hash);
+	struct stat st;
+	if (!stat(blob.c_str(), &st) && st.st_nlink == 1)
+		unlink(blob.c_str());
+}
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
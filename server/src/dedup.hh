@@ -0,0 +1,77 @@
+/*
+ * $File: dedup.hh
+ * $Date: Mon Oct 19 16:12:05 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+#pragma once
+
+#include <cstdio>
+#include <string>
+
+/*!
+ * \brief content-addressed store of uploaded files
+ *
+ * each distinct content is kept once as a blob named by its SHA-256 under
+ * the store directory (e.g. ab/cdef... for digest abcdef...), so the
+ * directory itself is the persistent hash index; files are materialized at
+ * their paths by reflink (FICLONE) where supported, or by hard link
+ * otherwise, so the store must be on the same filesystem as the files
+ *
+ * since hard-linked files share storage, writers must replace rather than
+ * modify existing files
+ *
+ * blobs carry their hash in an xattr, which hard links share, so that a
+ * blob is found from a file and removed when its last file is gone; blobs
+ * only used by reflinks are never removed, since clones are separate files
+ */
+class DedupStore {
+	std::string m_dir;	//!< with trailing '/'
+
+	public:
+		/*!
+		 * \brief use the store at *dir*, which is created if not existing
+		 */
+		DedupStore(const std::string &dir);
+
+		const std::string& dir() const {
+			return m_dir;
+		}
+
+		std::string blob_path(const std::string &hash) const {
+			return m_dir + hash.substr(0, 2) + "/" + hash.substr(2);
+		}
+
+		/*!
+		 * \brief create a temp file in the store for an upload
+		 */
+		FILE* open_tmpfile(std::string &tmppath);
+
+		/*!
+		 * \brief move a complete temp file into the store as blob *hash*;
+		 *		if the blob exists, the temp file is removed
+		 * \return whether the content is new
+		 */
+		bool add(const std::string &tmppath, const std::string &hash);
+
+		/*!
+		 * \brief atomically replace *name* in directory *dirfd* by the
+		 *		content of blob *hash*
+		 * \return false if there is no such blob
+		 */
+		bool link_to(const std::string &hash, int dirfd,
+				const std::string &name);
+
+		/*!
+		 * \brief hash of the blob that *name* in *dirfd* is a hard link to
+		 * \return empty if it is not linked to a blob
+		 */
+		std::string blob_of(int dirfd, const std::string &name) const;
+
+		/*!
+		 * \brief remove blob *hash* if no file links to it any more
+		 */
+		void release(const std::string &hash);
+};
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
@@ -0,0 +1,158 @@
+/*
+ * $File: extract.cc
+ * $Date: Mon Oct 19 14:22:30 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+// max number of directory fds kept open by TarExtractor
+#define MAX_DIR_CACHE	256
+
+#include "extract.hh"
+#include "common.hh"
+
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+TarExtractor::TarExtractor(int root_fd, const std::string &excluded):
+	m_root_fd(root_fd)
+{
+	struct stat st;
+	if (!excluded.empty() && !stat(excluded.c_str(), &st)) {
+		m_has_excluded = true;
+		m_excluded_dev = st.st_dev;
+		m_excluded_ino = st.st_ino;
+	}
+	check_excluded(m_root_fd, ".");
+}
+
+void TarExtractor::check_excluded(int fd, const std::string &relpath) {
+	if (!m_has_excluded)
+		return;
+	// compared by identity rather than by path, so the directory could not
+	// be reached by another name
+	struct stat st;
+	if (fstat(fd, &st) || (st.st_dev == m_excluded_dev &&
+				st.st_ino == m_excluded_ino)) {
+		close(fd);
+		if (fd == m_root_fd)
+			m_root_fd = -1;
+		throw WFTPError("`%s' is a reserved directory", relpath.c_str());
+	}
+}
+
+TarExtractor::~TarExtractor() {
+	if (m_fd >= 0)
+		close(m_fd);
+	for (auto &i: m_dir_cache)
+		close(i.second);
+	close(m_root_fd);
+}
+
+int TarExtractor::open_dir(const std::string &relpath) {
+	if (relpath.empty())
+		return m_root_fd;
+	auto iter = m_dir_cache.find(relpath);
+	if (iter != m_dir_cache.end())
+		return iter->second;
+
+	auto sep = relpath.rfind('/');
+	int parent = open_dir(sep == std::string::npos ?
+			std::string() : relpath.substr(0, sep));
+	const char *name = relpath.c_str() +
+		(sep == std::string::npos ? 0 : sep + 1);
+	int fd = openat(parent, name,
+			O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0 && errno == ENOENT) {
+		if (mkdirat(parent, name, 0755) && errno != EEXIST)
+			throw WFTPError("failed to mkdir `%s': %m", relpath.c_str());
+		fd = openat(parent, name,
+				O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	}
+	if (fd < 0)
+		throw WFTPError("failed to open directory `%s': %m",
+				relpath.c_str());
+	check_excluded(fd, relpath);
+	m_dir_cache[relpath] = fd;
+	return fd;
+}
+
+void TarExtractor::begin(const TarEntry &entry) {
+	if (!tar_safe_path(entry.name))
+		throw WFTPError("unsafe path: %s", entry.name.c_str());
+
+	// normalize: drop empty and "." components
+	std::string path;
+	for (size_t pos = 0; pos < entry.name.size(); ) {
+		auto end = entry.name.find('/', pos);
+		if (end == std::string::npos)
+			end = entry.name.size();
+		if (end > pos && entry.name.compare(pos, end - pos, ".")) {
+			if (!path.empty())
+				path.append("/");
+			path.append(entry.name, pos, end - pos);
+		}
+		pos = end + 1;
+	}
+	if (path.empty())
+		return;
+
+	// evicting only between entries keeps fds returned by open_dir() valid
+	if (m_dir_cache.size() >= MAX_DIR_CACHE) {
+		for (auto &i: m_dir_cache)
+			close(i.second);
+		m_dir_cache.clear();
+	}
+
+	if (entry.type == TarEntry::DIRECTORY) {
+		open_dir(path);
+		return;
+	}
+	if (entry.type != TarEntry::REGULAR)
+		return;
+	auto sep = path.rfind('/');
+	int parent = open_dir(sep == std::string::npos ?
+			std::string() : path.substr(0, sep));
+	m_cur_name = path;
+	auto name = path.c_str() + (sep == std::string::npos ? 0 : sep + 1);
+	// like GNU tar, replace existing files instead of writing through them,
+	// since they may be hard links sharing content with other files
+	unlinkat(parent, name, 0);
+	m_fd = openat(parent, name,
+			O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+			entry.mode & 0777);
+	if (m_fd < 0)
+		throw WFTPError("failed to open `%s': %m", path.c_str());
+	m_nr_file ++;
+}
+
+void TarExtractor::write(const char *buf, size_t size) {
+	if (m_fd < 0)
+		return;
+	while (size) {
+		auto s = ::write(m_fd, buf, size);
+		if (s < 0)
+			throw WFTPError("failed to write `%s': %m", m_cur_name.c_str());
+		buf += s;
+		size -= s;
+	}
+}
+
+void TarExtractor::end() {
+	if (m_fd < 0)
+		return;
+	sync_file_range(m_fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+	int rst = close(m_fd);
+	m_fd = -1;
+	if (rst)
+		throw WFTPError("failed to close `%s': %m", m_cur_name.c_str());
+}
+
+void TarExtractor::finish() {
+	if (syncfs(m_root_fd))
+		throw WFTPError("syncfs failed: %m");
+}
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
@@ -0,0 +1,75 @@
+/*
+ * $File: extract.hh
+ * $Date: Mon Oct 19 14:22:30 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+#pragma once
+
+#include "tar.hh"
+
+#include <map>
+#include <string>
+
+#include <sys/types.h>
+
+/*!
+ * \brief unpack tar entries under a directory
+ *
+ * every path component is opened relative to its parent with O_NOFOLLOW,
+ * so entries could not escape the directory through symlinks; opened
+ * directories are cached across entries, and instead of fsync for every
+ * file, writeback is started when a file is closed and finish() persists
+ * the whole batch with one syncfs()
+ */
+class TarExtractor {
+	int m_root_fd, m_fd = -1, m_nr_file = 0;
+	std::map<std::string, int> m_dir_cache;
+	std::string m_cur_name;
+
+	//! device and inode of the directory entries must not be written into
+	bool m_has_excluded = false;
+	dev_t m_excluded_dev = 0;
+	ino_t m_excluded_ino = 0;
+
+	/*!
+	 * throw if *fd* is the excluded directory; *fd* is closed then
+	 */
+	void check_excluded(int fd, const std::string &relpath);
+
+	/*!
+	 * open a directory relative to m_root_fd, creating it if needed; the
+	 * returned fd is owned by m_dir_cache
+	 */
+	int open_dir(const std::string &relpath);
+
+	public:
+		/*!
+		 * \param root_fd the directory to unpack into, which is taken
+		 *		over
+		 * \param excluded directory that entries must not be put into,
+		 *		e.g. the dedup store when it is under the server root;
+		 *		ignored if empty
+		 */
+		TarExtractor(int root_fd,
+				const std::string &excluded = std::string());
+		TarExtractor(const TarExtractor &) = delete;
+		~TarExtractor();
+
+		TarExtractor& operator = (const TarExtractor &) = delete;
+
+		void begin(const TarEntry &entry);
+		void write(const char *buf, size_t size);
+		void end();
+
+		/*!
+		 * \brief wait for all extracted data to reach the disk
+		 */
+		void finish();
+
+		int nr_file() const {
+			return m_nr_file;
+		}
+};
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
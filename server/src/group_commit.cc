@@ -0,0 +1,87 @@
+/*
+ * $File: group_commit.cc
+ * $Date: Mon Oct 19 14:58:16 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+// min number of files on a filesystem to be synced by syncfs()
+#define SYNCFS_BATCH_SIZE	4
+
+#include "group_commit.hh"
+#include "common.hh"
+
+#include <cerrno>
+#include <cstring>
+#include <map>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+GroupCommitter::GroupCommitter():
+	m_worker(&GroupCommitter::worker, this)
+{
+}
+
+GroupCommitter::~GroupCommitter() {
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		m_stop = true;
+	}
+	m_cv.notify_all();
+	m_worker.join();
+}
+
+GroupCommitter& GroupCommitter::instance() {
+	static GroupCommitter committer;
+	return committer;
+}
+
+void GroupCommitter::sync(int fd) {
+	Request req{fd, 0, false};
+	std::unique_lock<std::mutex> lock(m_mtx);
+	m_pending.push_back(&req);
+	m_cv.notify_one();
+	m_done_cv.wait(lock, [&req](){ return req.done; });
+	if (req.err)
+		throw WFTPError("failed to sync: %s", strerror(req.err));
+}
+
+void GroupCommitter::worker() {
+	std::unique_lock<std::mutex> lock(m_mtx);
+	for (; ; ) {
+		m_cv.wait(lock, [this](){ return !m_pending.empty() || m_stop; });
+		if (m_pending.empty())
+			return;
+		std::vector<Request*> batch;
+		batch.swap(m_pending);
+		lock.unlock();
+		sync_batch(batch);
+		lock.lock();
+		for (auto i: batch)
+			i->done = true;
+		m_done_cv.notify_all();
+	}
+}
+
+void GroupCommitter::sync_batch(const std::vector<Request*> &batch) {
+	std::map<dev_t, std::vector<Request*>> by_dev;
+	for (auto i: batch) {
+		struct stat st;
+		if (fstat(i->fd, &st))
+			i->err = errno;
+		else
+			by_dev[st.st_dev].push_back(i);
+	}
+	for (auto &i: by_dev) {
+		auto &reqs = i.second;
+		if (reqs.size() >= SYNCFS_BATCH_SIZE) {
+			int err = syncfs(reqs[0]->fd) ? errno : 0;
+			for (auto j: reqs)
+				j->err = err;
+		} else
+			for (auto j: reqs)
+				j->err = fsync(j->fd) ? errno : 0;
+	}
+}
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
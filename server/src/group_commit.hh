@@ -0,0 +1,57 @@
+/*
+ * $File: group_commit.hh
+ * $Date: Mon Oct 19 14:58:16 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*!
+ * \brief make files durable for concurrent sessions in batches
+ *
+ * a background thread takes all requests pending when it wakes up; for
+ * files on the same filesystem, a large enough batch is synced by a single
+ * syncfs() instead of one fsync() each, so sessions uploading concurrently
+ * share the latency of a disk flush
+ */
+class GroupCommitter {
+	struct Request {
+		int fd, err;
+		bool done;
+	};
+
+	std::mutex m_mtx;
+	std::condition_variable m_cv, m_done_cv;
+	std::vector<Request*> m_pending;
+	bool m_stop = false;
+	std::thread m_worker;
+
+	GroupCommitter();
+	~GroupCommitter();
+
+	void worker();
+	static void sync_batch(const std::vector<Request*> &batch);
+
+	public:
+		GroupCommitter(const GroupCommitter &) = delete;
+		GroupCommitter& operator = (const GroupCommitter &) = delete;
+
+		/*!
+		 * \brief get the committer of this process, started on first use
+		 *		so that it is created after fork() in prefork workers
+		 */
+		static GroupCommitter& instance();
+
+		/*!
+		 * \brief block until data and metadata of *fd* (a file or
+		 *		directory) are durable
+		 */
+		void sync(int fd);
+};
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
@@ -0,0 +1,370 @@
+/*
+ * $File: listing.cc
+ * $Date: Mon Oct 19 18:20:37 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+// number of threads searching directories for a listing
+#define SEARCH_NR_THREAD	4
+
+// max number of found batches not yet sent, limiting memory usage when the
+// client is slow
+#define SEARCH_MAX_PENDING	64
+
+#include "listing.hh"
+#include "common.hh"
+
+#include <algorithm>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <grp.h>
+#include <pwd.h>
+#include <unistd.h>
+
+namespace {
+
+std::string mode_string(mode_t mode) {
+	char s[11];
+	s[0] = S_ISDIR(mode) ? 'd' : S_ISLNK(mode) ? 'l' : S_ISCHR(mode) ? 'c' :
+		S_ISBLK(mode) ? 'b' : S_ISFIFO(mode) ? 'p' : S_ISSOCK(mode) ? 's' : '-';
+	for (int i = 0; i < 9; i ++)
+		s[i + 1] = (mode & (0400 >> i)) ? "rwxrwxrwx"[i] : '-';
+	if (mode & S_ISUID)
+		s[3] = s[3] == 'x' ? 's' : 'S';
+	if (mode & S_ISGID)
+		s[6] = s[6] == 'x' ? 's' : 'S';
+	if (mode & S_ISVTX)
+		s[9] = s[9] == 'x' ? 't' : 'T';
+	return std::string(s, 10);
+}
+
+/*!
+ * user or group name, or the id if unknown
+ */
+std::string id_name(bool is_user, unsigned id) {
+	static std::mutex mtx;
+	static std::map<std::pair<bool, unsigned>, std::string> cache;
+	std::lock_guard<std::mutex> lock(mtx);
+	auto iter = cache.find({is_user, id});
+	if (iter != cache.end())
+		return iter->second;
+
+	char buf[4096];
+	std::string name;
+	if (is_user) {
+		struct passwd pw, *rst = nullptr;
+		if (!getpwuid_r(id, &pw, buf, sizeof(buf), &rst) && rst)
+			name = rst->pw_name;
+	} else {
+		struct group gr, *rst = nullptr;
+		if (!getgrgid_r(id, &gr, buf, sizeof(buf), &rst) && rst)
+			name = rst->gr_name;
+	}
+	if (name.empty())
+		name = ssprintf("%u", id);
+	cache[{is_user, id}] = name;
+	return name;
+}
+
+/*!
+ * names in a directory except . and .., sorted
+ */
+std::vector<std::string> read_dir_names(DIR *dir) {
+	std::vector<std::string> names;
+	while (auto ent = readdir(dir))
+		if (strcmp(ent->d_name, ".") && strcmp(ent->d_name, ".."))
+			names.emplace_back(ent->d_name);
+	std::sort(names.begin(), names.end());
+	return names;
+}
+
+} // anonymous namespace
+
+bool load_list_entry(int dirfd, const char *name, ListEntry &entry) {
+	if (fstatat(dirfd, name, &entry.st, AT_SYMLINK_NOFOLLOW))
+		return false;
+	if (S_ISLNK(entry.st.st_mode)) {
+		char buf[PATH_MAX];
+		auto size = readlinkat(dirfd, name, buf, sizeof(buf));
+		if (size > 0)
+			entry.link_target.assign(buf, size);
+	}
+	return true;
+}
+
+bool load_dir_entries(int fd, std::vector<ListEntry> &entries) {
+	DIR *dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return false;
+	}
+	for (auto &name: read_dir_names(dir)) {
+		ListEntry entry;
+		if (!load_list_entry(dirfd(dir), name.c_str(), entry))
+			continue;
+		entry.name = std::move(name);
+		entries.emplace_back(std::move(entry));
+	}
+	closedir(dir);
+	return true;
+}
+
+std::string format_dir_listing(const std::string &path,
+		const std::vector<ListEntry> &entries, bool long_format) {
+	struct Item {
+		const ListEntry *entry;
+		bool is_dir;
+	};
+	ListEntry dot, dotdot;
+	dot.name = ".";
+	dotdot.name = "..";
+	if (::stat((path + "/.").c_str(), &dot.st))
+		memset(&dot.st, 0, sizeof(dot.st));
+	if (::stat((path + "/..").c_str(), &dotdot.st))
+		memset(&dotdot.st, 0, sizeof(dotdot.st));
+
+	std::vector<Item> items;
+	items.reserve(entries.size() + 2);
+	for (auto i: {&dot, &dotdot})
+		items.push_back({i, true});
+	for (auto &i: entries) {
+		bool is_dir = S_ISDIR(i.st.st_mode);
+		// ls groups symlinks to directories with directories
+		if (S_ISLNK(i.st.st_mode)) {
+			struct stat st;
+			is_dir = !::stat((path + "/" + i.name).c_str(), &st) &&
+				S_ISDIR(st.st_mode);
+		}
+		items.push_back({&i, is_dir});
+	}
+	std::sort(items.begin(), items.end(), [](const Item &a, const Item &b) {
+		if (a.is_dir != b.is_dir)
+			return a.is_dir;
+		return strcmp(a.entry->name.c_str(), b.entry->name.c_str()) < 0;
+	});
+
+	// the first line, which is "." or the header of the long format, is
+	// dropped
+	if (!long_format) {
+		std::string rst;
+		for (size_t i = 1; i < items.size(); i ++) {
+			rst.append(items[i].entry->name);
+			rst.append("\n");
+		}
+		return rst;
+	}
+	std::vector<const ListEntry*> sorted;
+	sorted.reserve(items.size());
+	for (auto &i: items)
+		sorted.push_back(i.entry);
+	return format_long_entries(sorted);
+}
+
+std::string format_long_entries(const std::vector<const ListEntry*> &entries) {
+	struct Fields {
+		std::string nlink, owner, group, size, time;
+	};
+	std::vector<Fields> fields(entries.size());
+	size_t w_nlink = 0, w_owner = 0, w_group = 0, w_size = 0;
+	time_t now = time(nullptr), six_months_ago = now - 31556952 / 2;
+	for (size_t i = 0; i < entries.size(); i ++) {
+		auto &st = entries[i]->st;
+		auto &f = fields[i];
+		f.nlink = ssprintf("%lu", (unsigned long)st.st_nlink);
+		f.owner = id_name(true, st.st_uid);
+		f.group = id_name(false, st.st_gid);
+		f.size = ssprintf("%lld", (long long)st.st_size);
+		struct tm tm;
+		char tbuf[64];
+		localtime_r(&st.st_mtime, &tm);
+		bool recent = st.st_mtime > six_months_ago && st.st_mtime <= now;
+		strftime(tbuf, sizeof(tbuf), recent ? "%b %e %H:%M" : "%b %e  %Y",
+				&tm);
+		f.time = tbuf;
+		w_nlink = std::max(w_nlink, f.nlink.length());
+		w_owner = std::max(w_owner, f.owner.length());
+		w_group = std::max(w_group, f.group.length());
+		w_size = std::max(w_size, f.size.length());
+	}
+	std::string rst;
+	for (size_t i = 0; i < entries.size(); i ++) {
+		auto &entry = *entries[i];
+		auto &f = fields[i];
+		rst.append(ssprintf("%s %*s %-*s %-*s %*s %s %s",
+					mode_string(entry.st.st_mode).c_str(),
+					int(w_nlink), f.nlink.c_str(),
+					int(w_owner), f.owner.c_str(),
+					int(w_group), f.group.c_str(),
+					int(w_size), f.size.c_str(),
+					f.time.c_str(), entry.name.c_str()));
+		if (S_ISLNK(entry.st.st_mode))
+			rst.append(" -> " + entry.link_target);
+		rst.append("\n");
+	}
+	return rst;
+}
+
+bool has_wildcard(const std::string &pattern) {
+	return pattern.find_first_of("*?[") != std::string::npos;
+}
+
+std::vector<SearchDir> expand_glob_dirs(const SearchDir &base,
+		const std::string &pattern) {
+	std::vector<SearchDir> cur{base}, next;
+	for (size_t pos = 0; pos < pattern.length(); ) {
+		auto end = pattern.find('/', pos);
+		if (end == std::string::npos)
+			end = pattern.length();
+		auto comp = pattern.substr(pos, end - pos);
+		pos = end + 1;
+		if (comp.empty() || comp == ".")
+			continue;
+		if (comp == "..")
+			throw WFTPError("`..' after wildcards is not allowed");
+
+		next.clear();
+		for (auto &dir: cur) {
+			int fd = open(dir.real.c_str(),
+					O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (fd < 0)
+				continue;
+			DIR *dirp = fdopendir(fd);
+			if (!dirp) {
+				close(fd);
+				continue;
+			}
+			std::vector<std::string> names;
+			if (has_wildcard(comp)) {
+				for (auto &i: read_dir_names(dirp))
+					if (!fnmatch(comp.c_str(), i.c_str(), FNM_PERIOD))
+						names.push_back(i);
+			} else
+				names.push_back(comp);
+			for (auto &i: names) {
+				struct stat st;
+				if (!fstatat(dirfd(dirp), i.c_str(), &st,
+							AT_SYMLINK_NOFOLLOW) && S_ISDIR(st.st_mode))
+					next.push_back({dir.real + "/" + i,
+							dir.display + i + "/"});
+			}
+			closedir(dirp);
+		}
+		cur.swap(next);
+	}
+	return cur;
+}
+
+void search_tree(const std::vector<SearchDir> &dirs,
+		const std::string &pattern, bool recursive,
+		const std::string &skip_dir,
+		std::function<void(std::vector<ListEntry> &batch)> on_batch) {
+	std::mutex mtx;
+	std::condition_variable work_cv, out_cv;
+	std::deque<SearchDir> work(dirs.begin(), dirs.end());
+	std::deque<std::vector<ListEntry>> out;
+	int nr_busy = 0;
+	bool stop = false;
+	auto done = [&]() {
+		return work.empty() && !nr_busy;
+	};
+
+	auto worker = [&]() {
+		std::unique_lock<std::mutex> lock(mtx);
+		for (; ; ) {
+			work_cv.wait(lock, [&]() {
+				return stop || !work.empty() || done();
+			});
+			if (stop || work.empty())
+				return;
+			auto dir = std::move(work.front());
+			work.pop_front();
+			nr_busy ++;
+			lock.unlock();
+
+			std::vector<ListEntry> batch;
+			std::vector<SearchDir> subdirs;
+			int fd = open(dir.real.c_str(),
+					O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			DIR *dirp = fd < 0 ? nullptr : fdopendir(fd);
+			if (dirp) {
+				for (auto &name: read_dir_names(dirp)) {
+					ListEntry entry;
+					if (!load_list_entry(dirfd(dirp), name.c_str(), entry))
+						continue;
+					if (recursive && S_ISDIR(entry.st.st_mode)) {
+						auto real = dir.real + "/" + name;
+						if (real + "/" != skip_dir)
+							subdirs.push_back({real, dir.display + name + "/"});
+					}
+					if (pattern.empty() || !fnmatch(pattern.c_str(),
+								name.c_str(), FNM_PERIOD)) {
+						entry.name = dir.display + name;
+						batch.emplace_back(std::move(entry));
+					}
+				}
+				closedir(dirp);
+			} else if (fd >= 0)
+				close(fd);
+
+			lock.lock();
+			for (auto &i: subdirs)
+				work.emplace_back(std::move(i));
+			work_cv.notify_all();
+			if (!batch.empty()) {
+				out_cv.wait(lock, [&]() {
+					return stop || out.size() < SEARCH_MAX_PENDING;
+				});
+				out.emplace_back(std::move(batch));
+			}
+			nr_busy --;
+			if (done())
+				work_cv.notify_all();
+			out_cv.notify_all();
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < SEARCH_NR_THREAD; i ++)
+		threads.emplace_back(worker);
+	auto join = [&]() {
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stop = true;
+		}
+		work_cv.notify_all();
+		out_cv.notify_all();
+		for (auto &i: threads)
+			i.join();
+	};
+
+	try {
+		std::unique_lock<std::mutex> lock(mtx);
+		for (; ; ) {
+			out_cv.wait(lock, [&]() { return !out.empty() || done(); });
+			if (out.empty())
+				break;
+			auto batch = std::move(out.front());
+			out.pop_front();
+			out_cv.notify_all();
+			lock.unlock();
+			on_batch(batch);
+			lock.lock();
+		}
+	} catch (...) {
+		join();
+		throw;
+	}
+	join();
+}
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
@@ -0,0 +1,90 @@
+/*
+ * $File: listing.hh
+ * $Date: Mon Oct 19 18:20:37 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*!
+ * \brief a directory entry with its metadata, as shown in listings
+ */
+struct ListEntry {
+	std::string name;			//!< a relative path in search results
+	struct stat st;				//!< lstat() result
+	std::string link_target;	//!< for symlinks
+};
+
+/*!
+ * \brief lstat() *name* in *dirfd* into *entry*, except entry.name
+ */
+bool load_list_entry(int dirfd, const char *name, ListEntry &entry);
+
+/*!
+ * \brief load entries of the directory opened as *fd* except . and ..,
+ *		sorted by name; *fd* is taken over and closed
+ */
+bool load_dir_entries(int fd, std::vector<ListEntry> &entries);
+
+/*!
+ * \brief format a directory listing like `ls -a --group-directories-first`
+ *		(or with -l if *long_format*) in C locale, without the first line
+ *
+ * \param entries entries of directory *path*, sorted by name
+ */
+std::string format_dir_listing(const std::string &path,
+		const std::vector<ListEntry> &entries, bool long_format);
+
+/*!
+ * \brief format entries in given order like `ls -ld`, with columns aligned
+ *		among them
+ */
+std::string format_long_entries(const std::vector<const ListEntry*> &entries);
+
+/*!
+ * \brief whether *pattern* contains fnmatch() wildcards
+ */
+bool has_wildcard(const std::string &pattern);
+
+/*!
+ * \brief a directory to be searched: its real path and the path shown to
+ *		the client, which is empty or ends with '/'
+ */
+struct SearchDir {
+	std::string real, display;
+};
+
+/*!
+ * \brief expand *pattern*, a relative path whose components may contain
+ *		wildcards, to the directories it matches under *base*
+ *
+ * symlinks are not followed, and wildcards do not match names starting
+ * with '.' unless the pattern does
+ */
+std::vector<SearchDir> expand_glob_dirs(const SearchDir &base,
+		const std::string &pattern);
+
+/*!
+ * \brief find entries whose names match *pattern* in directories *dirs* (and
+ *		their subdirectories if *recursive*) by a pool of threads
+ *
+ * results are passed to *on_batch* in the calling thread as they are
+ * found, a batch per directory sorted by name; batches of different
+ * directories come in no particular order; symlinks are not followed
+ *
+ * \param pattern fnmatch() pattern; empty to match all entries
+ * \param skip_dir real path of a directory to be skipped, with trailing '/'
+ */
+void search_tree(const std::vector<SearchDir> &dirs,
+		const std::string &pattern, bool recursive,
+		const std::string &skip_dir,
+		std::function<void(std::vector<ListEntry> &batch)> on_batch);
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
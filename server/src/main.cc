@@ -6,18 +6,82 @@
 
 #include "wftp_server.hh"
 #include "common.hh"
+#include "trace.hh"
+#include "capture.hh"
 
 #include <cstring>
 #include <cstdio>
 
 #include <signal.h>
 
+static WFTPServer *g_server;
+
+static void on_sigusr1(int) {
+	g_server->request_stop();
+}
+
 int main(int argc, char **argv) {
 	signal(SIGPIPE, SIG_IGN);
 	WFTPServer server;
+	std::string cert_path, key_path;
+	g_server = &server;
+	signal(SIGUSR1, on_sigusr1);
 	for (int i = 1; i < argc; i ++) {
 		if (!strcmp(argv[i], "-h")) {
-			fprintf(stderr, "usage: %s [-h] [-p port] [-d root_dir]\n",
+			fprintf(stderr, "usage: %s [-h] [-p port] [-d root_dir] "
+					"[-s role:opts ...] [-z] [-A] [-H path] [-T path] [-w nr]\n"
+					"       [-t trace_file] [-r capture_file] [-D dedup_dir] "
+					"[-i index_mb]\n"
+					"       [-u usage_snapshot] [-q quota_file] [-P passwd_file] "
+					"[-a admin_socket]\n"
+					"       [-C cert_file [-K key_file] [-e]]\n"
+					"  -s: set TCP options of sockets in a role, e.g.\n"
+					"      -s data:nodelay=0,sndbuf=4M,rcvbuf=4M,lowat=128K,cc=bbr\n"
+					"      role: ctrl, pasv, port (active data), data (pasv+port)\n"
+					"  -z: use MSG_ZEROCOPY for buffered data sends\n"
+					"  -A: atomic and durable STOR via temp file, fsync and "
+					"rename\n"
+					"  -H: accept listening socket handoff requests on unix "
+					"socket path\n"
+					"  -T: take over listening socket from the server at unix "
+					"socket path,\n"
+					"      which then drains its sessions and exits\n"
+					"  -w: prefork nr worker processes, pinned to CPUs\n"
+					"  -t: record per-session spans to trace_file, which could "
+					"be converted\n"
+					"      by trace2chrome.py for chrome://tracing\n"
+					"  -r: record commands of all sessions to capture_file, "
+					"for wftp_replay\n"
+					"  -D: deduplicate uploads by content in dedup_dir, on "
+					"the same filesystem\n"
+					"      as root_dir; enables SITE HASH unless -P is given\n"
+					"  -i: answer SIZE, CWD and listings from an in-memory "
+					"metadata index\n"
+					"      kept by inotify, using about index_mb MB\n"
+					"  -u: account disk usage by directory and user, with "
+					"snapshots saved to\n"
+					"      usage_snapshot; enables SITE USAGE\n"
+					"  -q: enforce quotas in quota_file at STOR and ALLO, "
+					"with lines like\n"
+					"      `dir /pub 10G' or `user alice 500M' (only with -P); "
+					"enables usage\n"
+					"      accounting\n"
+					"  -P: require login with users in passwd_file, of "
+					"`user:hash[:home]' lines\n"
+					"      with crypt(3) hashes, e.g. from `mkpasswd -m "
+					"bcrypt'; a user with home\n"
+					"      is confined to that directory under rootdir\n"
+					"  -a: accept `who', `kill <id>' and `throttle <id> <rate>' "
+					"on unix socket\n"
+					"      admin_socket, e.g. with `echo who | nc -U "
+					"admin_socket'\n"
+					"  -C: support AUTH TLS with the PEM certificate chain in "
+					"cert_file, and the\n"
+					"      private key in key_file (default: cert_file); data "
+					"is encrypted by the\n"
+					"      kernel (kTLS) when supported\n"
+					"  -e: require TLS on control and data connections\n"
+					"SIGUSR1 stops accepting and exits after sessions finish\n",
 					argv[0]);
 			return 0;
 		}
@@ -34,9 +98,106 @@ int main(int argc, char **argv) {
 				throw WFTPError("argument required");
 			server.set_rootdir(argv[i + 1]);
 			i ++;
+		}
+		else if (!strcmp(argv[i], "-H") || !strcmp(argv[i], "-T")) {
+			if (i == argc - 1)
+				throw WFTPError("argument required");
+			if (argv[i][1] == 'H')
+				server.set_handoff_path(argv[i + 1]);
+			else
+				server.set_takeover_path(argv[i + 1]);
+			i ++;
+		}
+		else if (!strcmp(argv[i], "-i")) {
+			int mb;
+			if (i == argc - 1 ||
+					sscanf(argv[i + 1], "%d", &mb) != 1 || mb < 0)
+				throw WFTPError("bad index budget");
+			server.set_meta_index_budget(size_t(mb) << 20);
+			i ++;
+		}
+		else if (!strcmp(argv[i], "-w")) {
+			int nr;
+			if (i == argc - 1 ||
+					sscanf(argv[i + 1], "%d", &nr) != 1 || nr < 0)
+				throw WFTPError("bad number of workers");
+			server.set_nr_worker(nr);
+			i ++;
+		}
+		else if (!strcmp(argv[i], "-u") || !strcmp(argv[i], "-q")) {
+			if (i == argc - 1)
+				throw WFTPError("argument required");
+			if (argv[i][1] == 'u')
+				server.set_usage_snapshot_path(argv[i + 1]);
+			else
+				server.set_quota_path(argv[i + 1]);
+			i ++;
+		}
+		else if (!strcmp(argv[i], "-C") || !strcmp(argv[i], "-K")) {
+			if (i == argc - 1)
+				throw WFTPError("argument required");
+			(argv[i][1] == 'C' ? cert_path : key_path) = argv[i + 1];
+			i ++;
+		}
+		else if (!strcmp(argv[i], "-e"))
+			server.set_tls_required(true);
+		else if (!strcmp(argv[i], "-a")) {
+			if (i == argc - 1)
+				throw WFTPError("argument required");
+			server.set_admin_path(argv[i + 1]);
+			i ++;
+		}
+		else if (!strcmp(argv[i], "-P")) {
+			if (i == argc - 1)
+				throw WFTPError("argument required");
+			server.set_passwd_path(argv[i + 1]);
+			i ++;
+		}
+		else if (!strcmp(argv[i], "-D")) {
+			if (i == argc - 1)
+				throw WFTPError("argument required");
+			server.set_dedup_dir(argv[i + 1]);
+			i ++;
+		}
+		else if (!strcmp(argv[i], "-t") || !strcmp(argv[i], "-r")) {
+			if (i == argc - 1)
+				throw WFTPError("argument required");
+			if (argv[i][1] == 't')
+				SpanTracer::open(argv[i + 1]);
+			else
+				TrafficCapture::open(argv[i + 1]);
+			i ++;
+		}
+		else if (!strcmp(argv[i], "-z"))
+			server.set_zerocopy(true);
+		else if (!strcmp(argv[i], "-A"))
+			server.set_atomic_stor(true);
+		else if (!strcmp(argv[i], "-s")) {
+			if (i == argc - 1)
+				throw WFTPError("argument required");
+			std::string arg = argv[i + 1], role;
+			auto sep = arg.find(':');
+			if (sep == std::string::npos)
+				throw WFTPError("bad socket profile: %s", argv[i + 1]);
+			role = arg.substr(0, sep);
+			arg.erase(0, sep + 1);
+			if (role == "ctrl")
+				server.set_socket_profile(SocketRole::CONTROL, arg);
+			else if (role == "pasv" || role == "data")
+				server.set_socket_profile(SocketRole::PASV_DATA, arg);
+			else if (role != "port")
+				throw WFTPError("unknown socket role: %s", role.c_str());
+			if (role == "port" || role == "data")
+				server.set_socket_profile(SocketRole::ACTIVE_DATA, arg);
+			i ++;
 		} else
 			throw WFTPError("unknown parameter: %s", argv[i]);
 	}
+	if (!cert_path.empty())
+		server.set_tls_cert(cert_path,
+				key_path.empty() ? cert_path : key_path);
+	else if (!key_path.empty())
+		throw WFTPError("-K requires -C");
 	server.serve_forever();
 }
 
@@ -0,0 +1,341 @@
+/*
+ * $File: meta_index.cc
+ * $Date: Mon Oct 19 17:03:41 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+// max number of watched directories, including those with entries evicted
+#define META_INDEX_MAX_DIRS	8192
+
+#include "meta_index.hh"
+#include "common.hh"
+
+#include <cerrno>
+#include <cstring>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+static const uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MODIFY |
+	IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF |
+	IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+MetaIndex::MetaIndex(const std::string &root, size_t budget):
+	m_root(root.substr(0, root.length() - 1)), m_budget(budget)
+{
+	m_inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if (m_inotify_fd < 0)
+		throw WFTPError("inotify_init1: %m");
+	if (pipe2(m_stop_pipe, O_CLOEXEC)) {
+		close(m_inotify_fd);
+		throw WFTPError("pipe: %m");
+	}
+	m_worker = std::thread(&MetaIndex::worker, this);
+}
+
+MetaIndex::~MetaIndex() {
+	char c = 0;
+	if (write(m_stop_pipe[1], &c, 1) == 1)
+		m_worker.join();
+	else
+		m_worker.detach();
+	close(m_stop_pipe[0]);
+	close(m_stop_pipe[1]);
+	close(m_inotify_fd);
+}
+
+void MetaIndex::worker() {
+	alignas(struct inotify_event) char buf[64 * 1024];
+	struct pollfd fds[2] = {
+		{m_inotify_fd, POLLIN, 0}, {m_stop_pipe[0], POLLIN, 0}
+	};
+	for (; ; ) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			wftp_log("meta index stopped: poll: %m");
+			return;
+		}
+		if (fds[1].revents)
+			return;
+		auto size = read(m_inotify_fd, buf, sizeof(buf));
+		if (size <= 0)
+			continue;
+		std::lock_guard<std::mutex> lock(m_mtx);
+		for (char *ptr = buf; ptr < buf + size; ) {
+			auto ev = reinterpret_cast<struct inotify_event*>(ptr);
+			handle_event(ev->wd, ev->mask, ev->len ? ev->name : nullptr);
+			ptr += sizeof(*ev) + ev->len;
+		}
+	}
+}
+
+void MetaIndex::handle_event(int wd, uint32_t mask, const char *name) {
+	if (mask & IN_Q_OVERFLOW) {
+		// events have been lost; start over
+		drop_tree(m_root);
+		return;
+	}
+	auto wd_iter = m_wd2path.find(wd);
+	if (wd_iter == m_wd2path.end())
+		return;
+	std::string path = wd_iter->second;
+	if (mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+		drop_tree(path);
+		return;
+	}
+	if (!name)
+		return;
+	if (mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))
+		drop_tree(path + "/" + name);
+	update_child(path, m_dirs.at(path), name);
+}
+
+MetaIndex::DirNode* MetaIndex::get_node(const std::string &path) {
+	auto iter = m_dirs.find(path);
+	if (iter != m_dirs.end())
+		return &iter->second;
+	if (path != m_root && !get_node(path.substr(0, path.rfind('/'))))
+		return nullptr;
+	if (m_dirs.size() >= META_INDEX_MAX_DIRS)
+		return nullptr;
+	int wd = inotify_add_watch(m_inotify_fd,
+			path.empty() ? "/" : path.c_str(), WATCH_MASK);
+	// an existing wd means the directory is watched under another path
+	if (wd < 0 || m_wd2path.count(wd))
+		return nullptr;
+	auto &node = m_dirs[path];
+	node.wd = wd;
+	node.last_use = ++ m_tick;
+	m_wd2path[wd] = path;
+	return &node;
+}
+
+MetaIndex::DirNode* MetaIndex::get_complete_node(const std::string &path,
+		std::unique_lock<std::mutex> &lock) {
+	auto node = get_node(path);
+	if (!node || node->oversized)
+		return nullptr;
+	node->last_use = ++ m_tick;
+	if (node->complete)
+		return node;
+	if (node->populating)
+		return nullptr;
+
+	// scan without the lock; changes in the meantime are recorded as dirty
+	// names by update_child()
+	node->populating = true;
+	int wd = node->wd;
+	lock.unlock();
+	std::map<std::string, Entry> children;
+	size_t mem = 0;
+	bool ok = false;
+	int fd = open(path.empty() ? "/" : path.c_str(),
+			O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR *dir = fd < 0 ? nullptr : fdopendir(fd);
+	if (dir) {
+		ok = true;
+		while (auto ent = readdir(dir)) {
+			if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+				continue;
+			Entry entry;
+			if (!load_list_entry(dirfd(dir), ent->d_name, entry))
+				continue;
+			entry.name = ent->d_name;
+			mem += entry_mem(entry);
+			if (mem > m_budget) {
+				ok = false;
+				break;
+			}
+			children.emplace(entry.name, std::move(entry));
+		}
+		closedir(dir);
+	} else if (fd >= 0)
+		close(fd);
+	lock.lock();
+
+	auto iter = m_dirs.find(path);
+	if (iter == m_dirs.end() || iter->second.wd != wd)
+		return nullptr;
+	node = &iter->second;
+	node->populating = false;
+	std::set<std::string> dirty;
+	dirty.swap(node->dirty);
+	if (!ok) {
+		node->oversized = dir != nullptr;
+		return nullptr;
+	}
+	node->children.swap(children);
+	node->complete = true;
+	node->mem = mem;
+	m_mem += mem;
+	for (auto &i: dirty)
+		update_child(path, *node, i);
+
+	// ancestors are used to reach this node, so keep them longer
+	for (auto p = path; p != m_root; ) {
+		p.erase(p.rfind('/'));
+		m_dirs.at(p).last_use = m_tick;
+	}
+	evict(path);
+	return node->complete ? node : nullptr;
+}
+
+void MetaIndex::update_child(const std::string &path, DirNode &node,
+		const std::string &name) {
+	if (node.populating) {
+		node.dirty.insert(name);
+		return;
+	}
+	if (!node.complete)
+		return;
+	auto iter = node.children.find(name);
+	if (iter != node.children.end()) {
+		auto mem = entry_mem(iter->second);
+		node.mem -= mem;
+		m_mem -= mem;
+		node.children.erase(iter);
+	}
+	Entry entry;
+	if (!load_list_entry(AT_FDCWD, (path + "/" + name).c_str(), entry))
+		return;
+	entry.name = name;
+	auto mem = entry_mem(entry);
+	node.mem += mem;
+	m_mem += mem;
+	node.children.emplace(name, std::move(entry));
+}
+
+void MetaIndex::drop_tree(const std::string &path) {
+	auto drop = [this](std::map<std::string, DirNode>::iterator iter) {
+		inotify_rm_watch(m_inotify_fd, iter->second.wd);
+		m_wd2path.erase(iter->second.wd);
+		m_mem -= iter->second.mem;
+		return m_dirs.erase(iter);
+	};
+	auto iter = m_dirs.find(path);
+	if (iter != m_dirs.end())
+		drop(iter);
+	auto prefix = path + "/";
+	for (iter = m_dirs.lower_bound(prefix); iter != m_dirs.end() &&
+			!iter->first.compare(0, prefix.length(), prefix); )
+		iter = drop(iter);
+}
+
+void MetaIndex::evict(const std::string &keep) {
+	// keep and its ancestors are never evicted
+	auto is_kept = [&keep](const std::string &p) {
+		return !keep.compare(0, p.length(), p) &&
+			(keep.length() == p.length() || keep[p.length()] == '/');
+	};
+
+	while (m_mem > m_budget) {
+		DirNode *victim = nullptr;
+		for (auto &i: m_dirs)
+			if (i.second.complete && !is_kept(i.first) &&
+					(!victim || i.second.last_use < victim->last_use))
+				victim = &i.second;
+		if (!victim)
+			break;
+		m_mem -= victim->mem;
+		victim->mem = 0;
+		victim->children.clear();
+		victim->complete = false;
+	}
+
+	while (m_dirs.size() > META_INDEX_MAX_DIRS) {
+		const std::string *victim = nullptr;
+		uint64_t last_use = 0;
+		for (auto &i: m_dirs)
+			if (!i.second.populating && !is_kept(i.first) &&
+					(!victim || i.second.last_use < last_use)) {
+				victim = &i.first;
+				last_use = i.second.last_use;
+			}
+		if (!victim)
+			break;
+		drop_tree(std::string(*victim));
+	}
+
+	if (m_mem > m_budget) {
+		auto &node = m_dirs.at(keep);
+		m_mem -= node.mem;
+		node.mem = 0;
+		node.children.clear();
+		node.complete = false;
+		node.oversized = true;
+	}
+}
+
+size_t MetaIndex::entry_mem(const Entry &entry) {
+	// map node overhead, key and the entry
+	return sizeof(std::pair<const std::string, Entry>) + 32 +
+		entry.name.length() * 2 + entry.link_target.length();
+}
+
+int MetaIndex::stat(const std::string &path, struct stat *st) {
+	auto sep = path.rfind('/');
+	if (path.length() > m_root.length() &&
+			!path.compare(0, m_root.length(), m_root) &&
+			path[m_root.length()] == '/' && sep + 1 < path.length()) {
+		auto dir = path.substr(0, sep), name = path.substr(sep + 1);
+		if (name != "." && name != "..") {
+			std::unique_lock<std::mutex> lock(m_mtx);
+			auto node = get_complete_node(dir, lock);
+			if (node) {
+				auto iter = node->children.find(name);
+				if (iter == node->children.end()) {
+					errno = ENOENT;
+					return -1;
+				}
+				// link targets and nlink/mtime of directories are not tracked
+				auto mode = iter->second.st.st_mode;
+				if (!S_ISLNK(mode) && !S_ISDIR(mode)) {
+					*st = iter->second.st;
+					return 0;
+				}
+			}
+		}
+	}
+	return ::stat(path.c_str(), st);
+}
+
+bool MetaIndex::list(const std::string &path, std::vector<Entry> &entries) {
+	std::unique_lock<std::mutex> lock(m_mtx);
+	auto node = get_complete_node(path, lock);
+	if (!node)
+		return false;
+	entries.clear();
+	entries.reserve(node->children.size());
+	for (auto &i: node->children)
+		entries.push_back(i.second);
+	lock.unlock();
+
+	// changes inside a subdirectory are not reported to its parent, so
+	// subdirectories are re-examined
+	int fd = open(path.empty() ? "/" : path.c_str(),
+			O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return true;
+	for (auto &i: entries)
+		if (S_ISDIR(i.st.st_mode))
+			fstatat(fd, i.name.c_str(), &i.st, AT_SYMLINK_NOFOLLOW);
+	close(fd);
+	return true;
+}
+
+void MetaIndex::refresh(const std::string &path) {
+	std::lock_guard<std::mutex> lock(m_mtx);
+	drop_tree(path);
+	auto sep = path.rfind('/');
+	if (sep == std::string::npos)
+		return;
+	auto iter = m_dirs.find(path.substr(0, sep));
+	if (iter != m_dirs.end())
+		update_child(iter->first, iter->second, path.substr(sep + 1));
+}
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
@@ -0,0 +1,133 @@
+/*
+ * $File: meta_index.hh
+ * $Date: Mon Oct 19 17:03:41 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+#pragma once
+
+#include "listing.hh"
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*!
+ * \brief in-memory index of file metadata in the served tree, kept current
+ *		by inotify
+ *
+ * directories are indexed lazily on first lookup, and the least recently
+ * used ones are evicted to keep memory usage within a budget; all
+ * ancestors of an indexed directory are watched (without caching their
+ * entries if evicted), so renaming or removing any of them invalidates the
+ * subtree
+ *
+ * changes made by the server itself should be reported by refresh(), so
+ * that the client making them never sees stale data; other changes are
+ * seen after the inotify event is handled
+ */
+class MetaIndex {
+	public:
+		typedef ListEntry Entry;
+
+	private:
+		struct DirNode {
+			int wd;
+			bool complete = false;	//!< whether children are all cached
+			bool populating = false;
+			bool oversized = false;	//!< too large to index within budget
+			uint64_t last_use = 0;
+			size_t mem = 0;
+			std::map<std::string, Entry> children;
+
+			//! names changed while populating
+			std::set<std::string> dirty;
+		};
+
+		std::string m_root;		//!< without trailing '/'
+		size_t m_budget, m_mem = 0;
+		int m_inotify_fd, m_stop_pipe[2];
+
+		std::mutex m_mtx;
+		std::map<std::string, DirNode> m_dirs;	//!< by path
+		std::unordered_map<int, std::string> m_wd2path;
+		uint64_t m_tick = 0;
+
+		std::thread m_worker;
+
+		void worker();
+		void handle_event(int wd, uint32_t mask, const char *name);
+
+		/*!
+		 * \brief get the node of directory *path*, creating watch-only nodes
+		 *		for it and its ancestors if needed
+		 * \return nullptr if it could not be watched
+		 */
+		DirNode* get_node(const std::string &path);
+
+		/*!
+		 * \brief get the node of directory *path* with children cached
+		 *
+		 * the lock is released while the directory is scanned
+		 * \return nullptr if the directory could not be indexed
+		 */
+		DirNode* get_complete_node(const std::string &path,
+				std::unique_lock<std::mutex> &lock);
+
+		/*!
+		 * \brief re-lstat entry *name* of a directory
+		 */
+		void update_child(const std::string &path, DirNode &node,
+				const std::string &name);
+
+		/*!
+		 * \brief remove nodes of directory *path* and its subdirectories
+		 */
+		void drop_tree(const std::string &path);
+
+		/*!
+		 * \brief evict least recently used nodes to fit in the budget,
+		 *		except *keep* and its ancestors
+		 */
+		void evict(const std::string &keep);
+
+		static size_t entry_mem(const Entry &entry);
+
+	public:
+		/*!
+		 * \param root root directory of the served tree, with trailing '/'
+		 * \param budget approximate max memory for cached entries in bytes
+		 */
+		MetaIndex(const std::string &root, size_t budget);
+		~MetaIndex();
+
+		MetaIndex(const MetaIndex &) = delete;
+		MetaIndex& operator = (const MetaIndex &) = delete;
+
+		/*!
+		 * \brief same as ::stat(), answered from the index when possible
+		 */
+		int stat(const std::string &path, struct stat *st);
+
+		/*!
+		 * \brief get entries of directory *path* sorted by name, excluding
+		 *		. and ..
+		 * \return false if the directory could not be indexed
+		 */
+		bool list(const std::string &path, std::vector<Entry> &entries);
+
+		/*!
+		 * \brief report that *path* has been changed by this process
+		 */
+		void refresh(const std::string &path);
+};
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
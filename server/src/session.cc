@@ -0,0 +1,269 @@
+/*
+ * $File: session.cc
+ * $Date: Mon Oct 19 20:31:07 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+// give up reading a slot that is still being written after this many tries;
+// a worker killed in the middle of a write leaves its slot odd forever
+#define SEQLOCK_MAX_RETRY	(1 << 16)
+
+#include "session.hh"
+#include "common.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <new>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+namespace {
+
+template<size_t N>
+void store_text(std::atomic<uint64_t> (&dst)[N], const std::string &src) {
+	for (size_t i = 0; i < N; i ++) {
+		uint64_t word = 0;
+		size_t off = i * sizeof(word);
+		if (off < src.size())
+			memcpy(&word, src.data() + off,
+					std::min(sizeof(word), src.size() - off));
+		dst[i].store(word, std::memory_order_relaxed);
+	}
+}
+
+template<size_t N>
+std::string load_text(const std::atomic<uint64_t> (&src)[N]) {
+	char buf[N * sizeof(uint64_t)];
+	for (size_t i = 0; i < N; i ++) {
+		uint64_t word = src[i].load(std::memory_order_relaxed);
+		memcpy(buf + i * sizeof(word), &word, sizeof(word));
+	}
+	return std::string(buf, strnlen(buf, sizeof(buf)));
+}
+
+} // anonymous namespace
+
+bool SessionRegistry::read(const Slot &slot, Info &info, int &ctrl_fd,
+		uint64_t &ctrl_ino) {
+	for (int retry = 0; retry < SEQLOCK_MAX_RETRY; retry ++) {
+		if (slot.state.load(std::memory_order_acquire) != Slot::ACTIVE)
+			return false;
+		auto seq = slot.seq.load(std::memory_order_acquire);
+		if (seq & 1)
+			continue;
+		auto r = std::memory_order_relaxed;
+		info.cli_id = slot.cli_id.load(r);
+		info.pid = slot.pid.load(r);
+		info.start_ms = slot.start_ms.load(r);
+		info.cmd_start_ms = slot.cmd_start_ms.load(r);
+		info.peer = load_text(slot.peer);
+		info.user = load_text(slot.user);
+		info.cmd = load_text(slot.cmd);
+		info.bytes = slot.bytes.load(r);
+		info.cmd_bytes = slot.cmd_bytes.load(r);
+		auto throttle = slot.throttle.load(r);
+		info.rate_limit = uint32_t(throttle) == uint32_t(info.cli_id) ?
+			(throttle >> 32) * 1024 : 0;
+		ctrl_fd = slot.ctrl_fd.load(r);
+		ctrl_ino = slot.ctrl_ino.load(r);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot.seq.load(std::memory_order_relaxed) == seq)
+			return info.cli_id >= 0;
+	}
+	return false;
+}
+
+void SessionRegistry::Slot::begin_write() {
+	seq.store(seq.load(std::memory_order_relaxed) + 1,
+			std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+}
+
+void SessionRegistry::Slot::end_write() {
+	seq.store(seq.load(std::memory_order_relaxed) + 1,
+			std::memory_order_release);
+}
+
+void SessionRegistry::Slot::set_user(const std::string &name) {
+	begin_write();
+	store_text(user, name);
+	end_write();
+}
+
+void SessionRegistry::Slot::set_command(const std::string &text) {
+	begin_write();
+	store_text(cmd, text);
+	cmd_start_ms.store(now_ms(), std::memory_order_relaxed);
+	cmd_bytes.store(0, std::memory_order_relaxed);
+	end_write();
+}
+
+SessionRegistry::SessionRegistry(size_t nr_slot):
+	m_nr_slot(nr_slot)
+{
+	// shared with worker processes forked later
+	void *mem = mmap(nullptr, sizeof(Slot) * nr_slot,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		throw WFTPError("failed to map session table: %m");
+	m_slots = static_cast<Slot*>(mem);
+	for (size_t i = 0; i < nr_slot; i ++)
+		new (m_slots + i) Slot();
+}
+
+SessionRegistry::~SessionRegistry() {
+	for (size_t i = 0; i < m_nr_slot; i ++)
+		m_slots[i].~Slot();
+	munmap(m_slots, sizeof(Slot) * m_nr_slot);
+}
+
+int64_t SessionRegistry::now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return int64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+SessionRegistry::Slot* SessionRegistry::attach(int64_t cli_id,
+		const std::string &peer, int ctrl_fd) {
+	struct stat st;
+	if (fstat(ctrl_fd, &st))
+		return nullptr;
+	for (size_t i = 0; i < m_nr_slot; i ++) {
+		auto &slot = m_slots[(cli_id + i) % m_nr_slot];
+		uint32_t expect = Slot::FREE;
+		if (slot.state.load(std::memory_order_relaxed) != Slot::FREE ||
+				!slot.state.compare_exchange_strong(expect, Slot::CLAIMED,
+					std::memory_order_acquire))
+			continue;
+		auto r = std::memory_order_relaxed;
+		// set first, so that the slot could be reclaimed if this process
+		// dies before it becomes active
+		slot.pid.store(getpid(), r);
+		auto now = now_ms();
+		slot.m_cli_id = cli_id;
+		slot.begin_write();
+		slot.cli_id.store(cli_id, r);
+		slot.start_ms.store(now, r);
+		slot.cmd_start_ms.store(now, r);
+		store_text(slot.peer, peer);
+		store_text(slot.user, "");
+		store_text(slot.cmd, "");
+		slot.ctrl_fd.store(ctrl_fd, r);
+		slot.ctrl_ino.store(st.st_ino, r);
+		slot.bytes.store(0, r);
+		slot.cmd_bytes.store(0, r);
+		slot.end_write();
+		slot.state.store(Slot::ACTIVE, std::memory_order_release);
+		return &slot;
+	}
+	return nullptr;
+}
+
+void SessionRegistry::detach(Slot *slot) {
+	slot->begin_write();
+	slot->cli_id.store(-1, std::memory_order_relaxed);
+	slot->ctrl_fd.store(-1, std::memory_order_relaxed);
+	slot->end_write();
+	slot->state.store(Slot::FREE, std::memory_order_release);
+}
+
+void SessionRegistry::detach_process(pid_t pid) {
+	// the owner is gone, so nothing writes these slots any more; they are
+	// not read through the seqlock, which may have been left odd
+	auto r = std::memory_order_relaxed;
+	for (size_t i = 0; i < m_nr_slot; i ++) {
+		auto &slot = m_slots[i];
+		if (slot.state.load(std::memory_order_acquire) == Slot::FREE ||
+				slot.pid.load(r) != pid)
+			continue;
+		auto seq = slot.seq.load(r);
+		slot.seq.store(seq + (seq & 1), r);
+		detach(&slot);
+	}
+}
+
+std::vector<SessionRegistry::Info> SessionRegistry::list() {
+	std::vector<Info> rst;
+	Info info;
+	int fd;
+	uint64_t ino;
+	for (size_t i = 0; i < m_nr_slot; i ++)
+		if (read(m_slots[i], info, fd, ino))
+			rst.push_back(info);
+	std::sort(rst.begin(), rst.end(), [](const Info &a, const Info &b) {
+		return a.cli_id < b.cli_id;
+	});
+	return rst;
+}
+
+SessionRegistry::Slot* SessionRegistry::find(int64_t cli_id, Info &info,
+		int &ctrl_fd, uint64_t &ctrl_ino) {
+	for (size_t i = 0; i < m_nr_slot; i ++) {
+		auto &slot = m_slots[(cli_id + i) % m_nr_slot];
+		if (read(slot, info, ctrl_fd, ctrl_ino) &&
+				info.cli_id == cli_id)
+			return &slot;
+	}
+	errno = ESRCH;
+	return nullptr;
+}
+
+bool SessionRegistry::kill(int64_t cli_id) {
+	Info info;
+	int fd;
+	uint64_t ino;
+	auto slot = find(cli_id, info, fd, ino);
+	if (!slot)
+		return false;
+	slot->kill_id.store(cli_id, std::memory_order_relaxed);
+
+	// the fd may have been closed and reused since it was read, so the
+	// socket is checked by its inode before shutting it down
+	int dup_fd;
+	if (info.pid == getpid())
+		dup_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	else {
+		int pidfd = syscall(SYS_pidfd_open, pid_t(info.pid), 0);
+		if (pidfd < 0)
+			return false;
+		dup_fd = syscall(SYS_pidfd_getfd, pidfd, fd, 0);
+		int err = errno;
+		close(pidfd);
+		errno = err;
+	}
+	if (dup_fd < 0)
+		return false;
+	struct stat st;
+	bool ok = !fstat(dup_fd, &st) && S_ISSOCK(st.st_mode) &&
+		st.st_ino == ino;
+	if (ok)
+		shutdown(dup_fd, SHUT_RDWR);
+	close(dup_fd);
+	if (!ok)
+		errno = ESRCH;
+	return ok;
+}
+
+bool SessionRegistry::throttle(int64_t cli_id, uint64_t rate) {
+	Info info;
+	int fd;
+	uint64_t ino;
+	auto slot = find(cli_id, info, fd, ino);
+	if (!slot)
+		return false;
+	uint64_t kib = 0;
+	if (rate)
+		kib = std::min<uint64_t>((rate + 1023) / 1024, UINT32_MAX);
+	slot->throttle.store((kib << 32) | uint32_t(cli_id),
+			std::memory_order_relaxed);
+	return true;
+}
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
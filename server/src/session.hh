@@ -0,0 +1,171 @@
+/*
+ * $File: session.hh
+ * $Date: Mon Oct 19 20:31:07 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+/*!
+ * \brief table of live sessions, for inspecting, killing and throttling
+ *		them
+ *
+ * the table is a fixed array of slots in shared memory, so sessions in
+ * worker processes forked after its creation are in the same table; it is
+ * lock-free: a session claims a free slot by CAS, and only its own thread
+ * writes the slot, with text fields guarded by a seqlock, so readers never
+ * block the sessions and retry on concurrent changes
+ *
+ * hot paths only do relaxed atomic operations on their own slot
+ */
+class SessionRegistry {
+	public:
+		//! text fields are truncated to these sizes
+		static constexpr size_t PEER_WORDS = 6, USER_WORDS = 4,
+				 CMD_WORDS = 16;
+
+		class Slot {
+			friend class SessionRegistry;
+
+			enum State: uint32_t {
+				FREE, CLAIMED, ACTIVE
+			};
+			std::atomic<uint32_t> state{FREE};
+			std::atomic<uint32_t> seq{0};	//!< odd while being written
+
+			// guarded by seq
+			std::atomic<uint64_t> peer[PEER_WORDS], user[USER_WORDS],
+				cmd[CMD_WORDS];
+			std::atomic<int64_t> cli_id{-1}, pid{0}, start_ms{0},
+				cmd_start_ms{0};
+			std::atomic<uint64_t> ctrl_ino{0};
+			std::atomic<int> ctrl_fd{-1};
+
+			std::atomic<uint64_t> bytes{0}, cmd_bytes{0};
+
+			// set by other threads or processes
+			std::atomic<int64_t> kill_id{-1};
+
+			//! rate limit in KiB/s in high 32 bits, and the session id it
+			//! applies to in low 32 bits
+			std::atomic<uint64_t> throttle{0};
+
+			int64_t m_cli_id;	//!< only accessed by the owner
+
+			void begin_write();
+			void end_write();
+
+			public:
+				void add_bytes(uint64_t size) {
+					bytes.fetch_add(size, std::memory_order_relaxed);
+					cmd_bytes.fetch_add(size, std::memory_order_relaxed);
+				}
+
+				bool kill_requested() const {
+					return kill_id.load(std::memory_order_relaxed) ==
+						m_cli_id;
+				}
+
+				//! \return bytes per second, or 0 if unlimited
+				uint64_t rate_limit() const {
+					auto v = throttle.load(std::memory_order_relaxed);
+					if (uint32_t(v) != uint32_t(m_cli_id))
+						return 0;
+					return (v >> 32) * 1024;
+				}
+
+				void set_user(const std::string &user);
+
+				//! start of a new command
+				void set_command(const std::string &cmd);
+		} __attribute__((aligned(64)));
+
+		//! copy of a slot
+		struct Info {
+			int64_t cli_id, pid, start_ms, cmd_start_ms;
+			std::string peer, user, cmd;
+			uint64_t bytes, cmd_bytes;
+			uint64_t rate_limit;	//!< 0 for unlimited
+		};
+
+	private:
+		Slot *m_slots;
+		size_t m_nr_slot;
+
+		/*!
+		 * \brief read *slot* consistently
+		 * \return false if it is not in use, or is still being written
+		 *		after a bounded number of tries
+		 */
+		static bool read(const Slot &slot, Info &info, int &ctrl_fd,
+				uint64_t &ctrl_ino);
+
+		/*!
+		 * \brief find the slot of session *cli_id* and read it
+		 * \return nullptr with errno set if not found
+		 */
+		Slot* find(int64_t cli_id, Info &info, int &ctrl_fd,
+				uint64_t &ctrl_ino);
+
+	public:
+		/*!
+		 * \param nr_slot max number of sessions listed; sessions beyond it
+		 *		are served but not in the table
+		 */
+		SessionRegistry(size_t nr_slot);
+		~SessionRegistry();
+
+		SessionRegistry(const SessionRegistry &) = delete;
+		SessionRegistry& operator = (const SessionRegistry &) = delete;
+
+		/*!
+		 * \brief add a session served by this process with control
+		 *		connection *ctrl_fd*
+		 * \return its slot, or nullptr if the table is full
+		 */
+		Slot* attach(int64_t cli_id, const std::string &peer, int ctrl_fd);
+
+		/*!
+		 * \brief remove the session in *slot*; called by the owner before
+		 *		its control connection is closed
+		 */
+		void detach(Slot *slot);
+
+		/*!
+		 * \brief remove sessions of process *pid*, which has died, even if
+		 *		it died in the middle of updating them
+		 */
+		void detach_process(pid_t pid);
+
+		std::vector<Info> list();
+
+		/*!
+		 * \brief end session *cli_id*: its control connection is shut
+		 *		down, and a transfer in progress is aborted at the next chunk
+		 *
+		 * sessions in other processes could only be reached from their
+		 * parent, by pidfd_getfd(2)
+		 *
+		 * \return false with errno set on failure
+		 */
+		bool kill(int64_t cli_id);
+
+		/*!
+		 * \brief limit transfers of session *cli_id* to *rate* bytes per
+		 *		second; 0 to lift the limit
+		 */
+		bool throttle(int64_t cli_id, uint64_t rate);
+
+		//! milliseconds since the epoch
+		static int64_t now_ms();
+};
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
@@ -0,0 +1,180 @@
+/*
+ * $File: tls.cc
+ * $Date: Mon Oct 19 21:05:44 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+// buffer for sending files through OpenSSL when kernel TLS is unavailable
+#define TLS_FILE_BUF_SIZE	(256 * 1024)
+
+#include "tls.hh"
+#include "common.hh"
+#include "socket.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+namespace {
+
+std::string ssl_error_string() {
+	std::string rst;
+	unsigned long err;
+	while ((err = ERR_get_error())) {
+		char buf[256];
+		ERR_error_string_n(err, buf, sizeof(buf));
+		if (!rst.empty())
+			rst.append("; ");
+		rst.append(buf);
+	}
+	return rst.empty() ? "unknown error" : rst;
+}
+
+class TLSFilter: public SocketFilter {
+	SSL *m_ssl;
+	bool m_ktls_send;
+	std::unique_ptr<char[]> m_file_buf;
+
+	void fail(const char *op, int ret) {
+		if (SSL_get_error(m_ssl, ret) == SSL_ERROR_SYSCALL && errno) {
+			ERR_clear_error();
+			throw WFTPError("TLS %s: %m", op);
+		}
+		throw WFTPError("TLS %s failed: %s", op, ssl_error_string().c_str());
+	}
+
+	public:
+		TLSFilter(SSL *ssl):
+			m_ssl(ssl), m_ktls_send(BIO_get_ktls_send(SSL_get_wbio(ssl)))
+		{ }
+
+		~TLSFilter() {
+			SSL_free(m_ssl);
+		}
+
+		bool ktls_send() const {
+			return m_ktls_send;
+		}
+
+		void send(const void *buf, size_t size) override {
+			auto ptr = static_cast<const char*>(buf);
+			while (size) {
+				size_t done;
+				int ret = SSL_write_ex(m_ssl, ptr, size, &done);
+				if (ret <= 0)
+					fail("write", ret);
+				ptr += done;
+				size -= done;
+			}
+		}
+
+		size_t recv(void *buf, size_t max_size) override {
+			size_t done;
+			int ret = SSL_read_ex(m_ssl, buf, max_size, &done);
+			if (ret > 0)
+				return done;
+			if (SSL_get_error(m_ssl, ret) == SSL_ERROR_ZERO_RETURN)
+				return 0;
+			fail("read", ret);
+			return 0;
+		}
+
+		size_t send_file(int fd, off_t offset, size_t size) override {
+			size_t tot = 0;
+			if (m_ktls_send) {
+				// encrypted by the kernel from the page cache
+				while (tot < size) {
+					auto s = SSL_sendfile(m_ssl, fd, offset + tot,
+							size - tot, 0);
+					if (s < 0)
+						fail("sendfile", s);
+					if (!s)
+						break;
+					tot += s;
+				}
+				return tot;
+			}
+			if (!m_file_buf)
+				m_file_buf.reset(new char[TLS_FILE_BUF_SIZE]);
+			while (tot < size) {
+				ssize_t s = pread(fd, m_file_buf.get(),
+						std::min<size_t>(TLS_FILE_BUF_SIZE, size - tot),
+						offset + tot);
+				if (s < 0)
+					throw WFTPError("pread: %m");
+				if (!s)
+					break;
+				send(m_file_buf.get(), s);
+				tot += s;
+			}
+			return tot;
+		}
+
+		void shutdown() override {
+			// the socket is closed right after, so the close_notify of the
+			// peer is not waited for
+			if (SSL_shutdown(m_ssl) < 0)
+				ERR_clear_error();
+		}
+};
+
+} // anonymous namespace
+
+TLSContext::TLSContext(const std::string &cert_path,
+		const std::string &key_path):
+	m_ctx(SSL_CTX_new(TLS_server_method()))
+{
+	if (!m_ctx)
+		throw WFTPError("SSL_CTX_new: %s", ssl_error_string().c_str());
+	SSL_CTX_set_min_proto_version(m_ctx, TLS1_2_VERSION);
+	// records are encrypted by the kernel if it supports the cipher
+	SSL_CTX_set_options(m_ctx, SSL_OP_ENABLE_KTLS);
+	// data connections may resume the session of the control connection
+	static const unsigned char SESSION_ID_CONTEXT[] = "wftp";
+	SSL_CTX_set_session_id_context(m_ctx, SESSION_ID_CONTEXT,
+			sizeof(SESSION_ID_CONTEXT) - 1);
+	if (SSL_CTX_use_certificate_chain_file(m_ctx, cert_path.c_str()) != 1 ||
+			SSL_CTX_use_PrivateKey_file(m_ctx, key_path.c_str(),
+				SSL_FILETYPE_PEM) != 1 ||
+			SSL_CTX_check_private_key(m_ctx) != 1) {
+		auto err = ssl_error_string();
+		SSL_CTX_free(m_ctx);
+		throw WFTPError("failed to load certificate `%s' and key `%s': %s",
+				cert_path.c_str(), key_path.c_str(), err.c_str());
+	}
+}
+
+TLSContext::~TLSContext() {
+	SSL_CTX_free(m_ctx);
+}
+
+std::string TLSContext::accept(SocketBase &socket) {
+	SSL *ssl = SSL_new(m_ctx);
+	if (!ssl)
+		throw WFTPError("SSL_new: %s", ssl_error_string().c_str());
+	int ret = SSL_set_fd(ssl, socket.get_socket_fd());
+	if (ret == 1)
+		ret = SSL_accept(ssl);
+	if (ret != 1) {
+		std::string err;
+		if (SSL_get_error(ssl, ret) == SSL_ERROR_SYSCALL && errno) {
+			err = strerror(errno);
+			ERR_clear_error();
+		} else
+			err = ssl_error_string();
+		SSL_free(ssl);
+		throw WFTPError("TLS handshake failed: %s", err.c_str());
+	}
+	auto filter = std::make_shared<TLSFilter>(ssl);
+	socket.set_filter(filter);
+	return ssprintf("%s %s, kernel TLS %s", SSL_get_version(ssl),
+			SSL_get_cipher_name(ssl), filter->ktls_send() ? "on" : "off");
+}
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
@@ -0,0 +1,49 @@
+/*
+ * $File: tls.hh
+ * $Date: Mon Oct 19 21:05:44 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+#pragma once
+
+#include <string>
+
+class SocketBase;
+typedef struct ssl_ctx_st SSL_CTX;
+
+/*!
+ * \brief server side TLS for control and data connections (RFC 4217)
+ *
+ * kernel TLS is enabled when the kernel and the negotiated cipher support
+ * it: OpenSSL only does the handshake and hands the keys to the kernel, so
+ * records are encrypted in the kernel and file data is sent by
+ * SSL_sendfile() without passing through user space; otherwise records are
+ * encrypted by OpenSSL as usual
+ */
+class TLSContext {
+	SSL_CTX *m_ctx;
+
+	public:
+		/*!
+		 * \param cert_path PEM certificate chain
+		 * \param key_path PEM private key; could be the same file
+		 */
+		TLSContext(const std::string &cert_path, const std::string &key_path);
+		~TLSContext();
+
+		TLSContext(const TLSContext &) = delete;
+		TLSContext& operator = (const TLSContext &) = delete;
+
+		/*!
+		 * \brief run the server handshake on connected *socket*, and send and
+		 *		receive through the TLS session afterwards
+		 *
+		 * throws WFTPError if the handshake fails
+		 *
+		 * \return description of the session, e.g. protocol, cipher and
+		 *		whether kernel TLS is used
+		 */
+		std::string accept(SocketBase &socket);
+};
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
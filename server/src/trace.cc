@@ -0,0 +1,105 @@
+/*
+ * $File: trace.cc
+ * $Date: Mon Oct 19 12:02:47 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+// number of records buffered by each thread before written to file
+#define TRACE_BUF_SIZE	1024
+
+#define TRACE_MAGIC		"WFTPTRC1"
+
+#include "trace.hh"
+#include "common.hh"
+
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+bool SpanTracer::sm_enabled = false;
+
+namespace {
+	int trace_fd = -1;
+	thread_local uint32_t cur_session;
+
+	/*!
+	 * per-thread record buffer, written to the trace file when full or when
+	 * the thread exits
+	 */
+	class RecordBuffer {
+		SpanRecord m_buf[TRACE_BUF_SIZE];
+		size_t m_size = 0;
+
+		public:
+			~RecordBuffer() {
+				flush();
+			}
+
+			void add(const SpanRecord &rec) {
+				m_buf[m_size ++] = rec;
+				if (m_size == TRACE_BUF_SIZE)
+					flush();
+			}
+
+			void flush() {
+				if (!m_size)
+					return;
+				// O_APPEND makes a single write() atomic with respect to
+				// other threads and worker processes, so records are never
+				// interleaved
+				ssize_t size = m_size * sizeof(SpanRecord);
+				m_size = 0;
+				if (write(trace_fd, m_buf, size) != size)
+					wftp_log("failed to write trace file: %m");
+			}
+	};
+	thread_local RecordBuffer record_buf;
+}
+
+void SpanTracer::open(const char *fpath) {
+	trace_fd = ::open(fpath, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND |
+			O_CLOEXEC, 0644);
+	if (trace_fd < 0)
+		throw WFTPError("failed to open trace file `%s': %m", fpath);
+	if (write(trace_fd, TRACE_MAGIC, 8) != 8)
+		throw WFTPError("failed to write trace file: %m");
+	sm_enabled = true;
+}
+
+void SpanTracer::set_session(uint32_t session) {
+	cur_session = session;
+}
+
+uint32_t SpanTracer::session() {
+	return cur_session;
+}
+
+uint64_t SpanTracer::now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+void SpanTracer::record(SpanEvent event, uint64_t start_ns,
+		uint64_t arg, const char *tag) {
+	SpanRecord rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.start_ns = start_ns;
+	rec.dur_ns = now_ns() - start_ns;
+	rec.arg = arg;
+	rec.session = cur_session;
+	rec.event = uint16_t(event);
+	rec.pid = getpid();
+	if (tag)
+		memcpy(rec.tag, tag, strnlen(tag, sizeof(rec.tag)));
+	record_buf.add(rec);
+}
+
+void SpanTracer::flush() {
+	if (sm_enabled)
+		record_buf.flush();
+}
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
@@ -0,0 +1,123 @@
+/*
+ * $File: trace.hh
+ * $Date: Mon Oct 19 12:02:47 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+#pragma once
+
+#include <cstdint>
+
+/*
+ * static tracepoints: USDT probes visible to perf/bpftrace/systemtap when
+ * <sys/sdt.h> is available at build time, and empty otherwise
+ *
+ * eg: bpftrace -e 'usdt:./wftp_server:wftp:span_end { @bytes[arg0] = sum(arg2); }'
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define WFTP_PROBE(name, ...)	STAP_PROBEV(wftp, name, ## __VA_ARGS__)
+#endif
+#endif
+
+#ifndef WFTP_PROBE
+#define WFTP_PROBE(name, ...)	do { } while(0)
+#endif
+
+/*!
+ * kinds of spans; values are stored in trace files, so only append
+ */
+enum class SpanEvent: uint16_t {
+	SESSION, CMD, REALPATH, DATA_CONN, FILE_OPEN,
+	CHUNK_READ, CHUNK_SEND, CHUNK_RECV, CHUNK_WRITE, DATA_CLOSE, AUTH
+};
+
+/*!
+ * a span in the binary trace file; the file starts with an 8-byte magic
+ * "WFTPTRC1" followed by records in native byte order
+ */
+struct SpanRecord {
+	uint64_t start_ns, dur_ns;		//!< CLOCK_MONOTONIC
+	uint64_t arg;					//!< number of bytes for chunk events
+	uint32_t session;
+	uint16_t event;
+	uint16_t pid;					//!< low bits of pid, for prefork mode
+	char tag[8];					//!< FTP command name for CMD events
+};
+static_assert(sizeof(SpanRecord) == 40, "bad SpanRecord size");
+
+/*!
+ * \brief in-process span recorder writing per-session timelines to a trace
+ *		file; see trace2chrome.py for conversion to Chrome trace format
+ */
+class SpanTracer {
+	public:
+		/*!
+		 * \brief start recording into *fpath*; must be called before any
+		 *		session thread starts
+		 */
+		static void open(const char *fpath);
+
+		static bool enabled() {
+			return sm_enabled;
+		}
+
+		/*!
+		 * \brief set session id of spans recorded by the calling thread
+		 */
+		static void set_session(uint32_t session);
+
+		static uint32_t session();
+
+		static uint64_t now_ns();
+
+		static void record(SpanEvent event, uint64_t start_ns,
+				uint64_t arg, const char *tag);
+
+		/*!
+		 * \brief write spans buffered by the calling thread
+		 */
+		static void flush();
+
+	private:
+		static bool sm_enabled;
+};
+
+/*!
+ * \brief RAII span: fires USDT probes at both ends, and is recorded if
+ *		SpanTracer is enabled; costs a branch otherwise
+ */
+class TraceSpan {
+	SpanEvent m_event;
+	uint64_t m_start = 0, m_arg = 0;
+	const char *m_tag;
+
+	public:
+		TraceSpan(SpanEvent event, const char *tag = nullptr):
+			m_event(event), m_tag(tag)
+		{
+			WFTP_PROBE(span_start, uint16_t(event), SpanTracer::session());
+			if (SpanTracer::enabled())
+				m_start = SpanTracer::now_ns();
+		}
+
+		TraceSpan(const TraceSpan &) = delete;
+		TraceSpan& operator = (const TraceSpan &) = delete;
+
+		~TraceSpan() {
+			WFTP_PROBE(span_end, uint16_t(m_event), SpanTracer::session(),
+					m_arg);
+			if (m_start)
+				SpanTracer::record(m_event, m_start, m_arg, m_tag);
+		}
+
+		/*!
+		 * \brief set the argument, e.g. number of bytes transferred
+		 */
+		void set_arg(uint64_t arg) {
+			m_arg = arg;
+		}
+};
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
@@ -0,0 +1,560 @@
+/*
+ * $File: usage.cc
+ * $Date: Mon Oct 19 19:05:12 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+// seconds between snapshots of a changed ledger
+#define USAGE_SNAPSHOT_INTERVAL		60
+
+// seconds between reconciliations with the disk
+#define USAGE_RECONCILE_INTERVAL	3600
+
+#include "usage.hh"
+#include "common.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static const char SNAPSHOT_MAGIC[] = "wftp-usage 1";
+
+namespace {
+
+std::string parent_of(const std::string &rel) {
+	auto sep = rel.rfind('/');
+	return sep == std::string::npos ? std::string() : rel.substr(0, sep);
+}
+
+std::string name_of(const std::string &rel) {
+	return rel.substr(rel.rfind('/') + 1);
+}
+
+std::string join(const std::string &rel, const std::string &name) {
+	return rel.empty() ? name : rel + "/" + name;
+}
+
+/*!
+ * escape tabs, newlines and backslashes for snapshot fields
+ */
+std::string escape(const std::string &str) {
+	std::string rst;
+	for (auto c: str)
+		if (c == '\\')
+			rst.append("\\\\");
+		else if (c == '\t')
+			rst.append("\\t");
+		else if (c == '\n')
+			rst.append("\\n");
+		else
+			rst.push_back(c);
+	return rst;
+}
+
+std::string unescape(const std::string &str) {
+	std::string rst;
+	for (size_t i = 0; i < str.size(); i ++) {
+		if (str[i] != '\\' || i + 1 == str.size()) {
+			rst.push_back(str[i]);
+			continue;
+		}
+		auto c = str[++ i];
+		rst.push_back(c == 't' ? '\t' : c == 'n' ? '\n' : c);
+	}
+	return rst;
+}
+
+uint64_t parse_quota_size(const std::string &str) {
+	char *end;
+	unsigned long long val = strtoull(str.c_str(), &end, 10);
+	if (end == str.c_str())
+		throw WFTPError("bad quota size: %s", str.c_str());
+	int shift = 0;
+	switch (*end) {
+		case 0:
+			break;
+		case 'k': case 'K':
+			shift = 10;
+			break;
+		case 'm': case 'M':
+			shift = 20;
+			break;
+		case 'g': case 'G':
+			shift = 30;
+			break;
+		case 't': case 'T':
+			shift = 40;
+			break;
+		default:
+			throw WFTPError("bad quota size unit: %s", str.c_str());
+	}
+	if (*end && end[1])
+		throw WFTPError("bad quota size: %s", str.c_str());
+	return uint64_t(val) << shift;
+}
+
+/*!
+ * bytes left under *quota*
+ */
+uint64_t room_in(uint64_t quota, int64_t used, uint64_t freed) {
+	uint64_t u = std::max<int64_t>(used, 0);
+	return quota + freed > u ? quota + freed - u : 0;
+}
+
+} // anonymous namespace
+
+UsageLedger::UsageLedger(const std::string &root, const std::string &skip_dir,
+		const std::string &snapshot_path, const std::string &quota_path,
+		bool allow_user_quota):
+	m_root(root), m_skip_dir(skip_dir), m_snapshot_path(snapshot_path)
+{
+	if (!quota_path.empty())
+		load_quota(quota_path, allow_user_quota);
+	m_dirs[""];
+	if (!m_snapshot_path.empty())
+		load_snapshot();
+	m_worker = std::thread(&UsageLedger::worker, this);
+}
+
+UsageLedger::~UsageLedger() {
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		m_stop = true;
+	}
+	m_stop_cv.notify_all();
+	m_worker.join();
+	save_snapshot();
+}
+
+void UsageLedger::load_quota(const std::string &path,
+		bool allow_user_quota) {
+	std::ifstream fin(path);
+	if (!fin)
+		throw WFTPError("failed to open quota file `%s'", path.c_str());
+	int lineno = 0;
+	for (std::string line; std::getline(fin, line); ) {
+		lineno ++;
+		auto comment = line.find('#');
+		if (comment != std::string::npos)
+			line.erase(comment);
+		while (!line.empty() && isspace(line.back()))
+			line.pop_back();
+		auto kind_end = line.find_first_of(" \t"),
+			 size_begin = line.find_last_of(" \t");
+		if (line.find_first_not_of(" \t") == std::string::npos)
+			continue;
+		if (kind_end == std::string::npos || size_begin == kind_end)
+			throw WFTPError("%s:%d: expect `dir|user <name> <size>'",
+					path.c_str(), lineno);
+		auto kind = line.substr(0, kind_end),
+			 name = line.substr(kind_end, size_begin - kind_end);
+		name.erase(0, name.find_first_not_of(" \t"));
+		name.erase(name.find_last_not_of(" \t") + 1);
+		auto size = parse_quota_size(line.substr(size_begin + 1));
+		if (kind == "dir") {
+			while (!name.empty() && name[0] == '/')
+				name.erase(0, 1);
+			while (!name.empty() && name.back() == '/')
+				name.pop_back();
+			m_dir_quota[name] = size;
+		} else if (kind == "user") {
+			// otherwise anyone could log in as any name to use its quota
+			if (!allow_user_quota)
+				throw WFTPError("%s:%d: user quotas require logins by -P",
+						path.c_str(), lineno);
+			m_user_quota[name] = size;
+		} else
+			throw WFTPError("%s:%d: unknown quota kind `%s'",
+					path.c_str(), lineno, kind.c_str());
+	}
+}
+
+void UsageLedger::worker() {
+	auto start = std::chrono::steady_clock::now();
+	reconcile("");
+	if (stopping())
+		return;
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		auto &total = m_dirs.at("").total;
+		wftp_log("usage ledger reconciled in %.2fs: %lld bytes in %lld files",
+				std::chrono::duration<double>(
+					std::chrono::steady_clock::now() - start).count(),
+				(long long)total.bytes, (long long)total.nr_file);
+	}
+	auto last_reconcile = std::chrono::steady_clock::now();
+
+	std::unique_lock<std::mutex> lock(m_mtx);
+	while (!m_stop) {
+		m_stop_cv.wait_for(lock, std::chrono::seconds(USAGE_SNAPSHOT_INTERVAL),
+				[this]() { return m_stop; });
+		if (m_stop)
+			break;
+		lock.unlock();
+		save_snapshot();
+		if (std::chrono::steady_clock::now() - last_reconcile >=
+				std::chrono::seconds(USAGE_RECONCILE_INTERVAL)) {
+			reconcile("");
+			last_reconcile = std::chrono::steady_clock::now();
+		}
+		lock.lock();
+	}
+}
+
+bool UsageLedger::stopping() {
+	std::lock_guard<std::mutex> lock(m_mtx);
+	return m_stop;
+}
+
+bool UsageLedger::relpath(const std::string &path, std::string &rel) const {
+	if (path + "/" == m_root) {
+		rel.clear();
+		return true;
+	}
+	if (path.compare(0, m_root.length(), m_root))
+		return false;
+	if (!m_skip_dir.empty() &&
+			!(path + "/").compare(0, m_skip_dir.length(), m_skip_dir))
+		return false;
+	rel = path.substr(m_root.length());
+	while (!rel.empty() && rel.back() == '/')
+		rel.pop_back();
+	return true;
+}
+
+UsageLedger::DirNode& UsageLedger::get_node(const std::string &rel) {
+	auto iter = m_dirs.find(rel);
+	if (iter != m_dirs.end())
+		return iter->second;
+	get_node(parent_of(rel)).subdirs.insert(name_of(rel));
+	return m_dirs[rel];
+}
+
+void UsageLedger::apply(const std::string &rel, int64_t bytes,
+		int64_t nr_file) {
+	if (!bytes && !nr_file)
+		return;
+	auto &node = get_node(rel);
+	node.own.bytes += bytes;
+	node.own.nr_file += nr_file;
+	for (auto p = rel; ; p = parent_of(p)) {
+		auto &total = m_dirs.at(p).total;
+		total.bytes += bytes;
+		total.nr_file += nr_file;
+		if (p.empty())
+			break;
+	}
+	m_dirty = true;
+}
+
+void UsageLedger::charge_user(const std::string &user, int64_t bytes,
+		int64_t nr_file) {
+	auto &usage = m_users[user];
+	usage.bytes += bytes;
+	usage.nr_file += nr_file;
+	m_dirty = true;
+}
+
+void UsageLedger::drop_tree(const std::string &rel) {
+	auto iter = m_dirs.find(rel);
+	if (rel.empty() || iter == m_dirs.end())
+		return;
+	auto total = iter->second.total;
+	for (auto p = parent_of(rel); ; p = parent_of(p)) {
+		auto &t = m_dirs.at(p).total;
+		t.bytes -= total.bytes;
+		t.nr_file -= total.nr_file;
+		if (p.empty())
+			break;
+	}
+	m_dirs.at(parent_of(rel)).subdirs.erase(name_of(rel));
+
+	std::vector<std::string> stack{rel};
+	while (!stack.empty()) {
+		auto cur = std::move(stack.back());
+		stack.pop_back();
+		auto &node = m_dirs.at(cur);
+		for (auto &i: node.owned)
+			charge_user(i.second.user, -int64_t(i.second.size), -1);
+		for (auto &i: node.subdirs)
+			stack.push_back(join(cur, i));
+		m_dirs.erase(cur);
+	}
+	m_dirty = true;
+}
+
+void UsageLedger::file_changed(const std::string &path,
+		const std::string &user, int64_t old_size) {
+	std::string rel;
+	if (!relpath(path, rel) || rel.empty())
+		return;
+	struct stat st;
+	int64_t new_size = -1;
+	if (!lstat(path.c_str(), &st) && S_ISREG(st.st_mode))
+		new_size = st.st_size;
+	auto dir = parent_of(rel), name = name_of(rel);
+
+	std::lock_guard<std::mutex> lock(m_mtx);
+	auto &node = get_node(dir);
+	node.version ++;
+	apply(dir, std::max<int64_t>(new_size, 0) - std::max<int64_t>(old_size, 0),
+			int64_t(new_size >= 0) - int64_t(old_size >= 0));
+	auto iter = node.owned.find(name);
+	if (iter != node.owned.end()) {
+		charge_user(iter->second.user, -int64_t(iter->second.size), -1);
+		node.owned.erase(iter);
+	}
+	if (new_size >= 0 && !user.empty()) {
+		node.owned[name] = {user, uint64_t(new_size)};
+		charge_user(user, new_size, 1);
+	}
+}
+
+void UsageLedger::dir_created(const std::string &path) {
+	std::string rel;
+	if (!relpath(path, rel) || rel.empty())
+		return;
+	std::lock_guard<std::mutex> lock(m_mtx);
+	// so that a concurrent scan of the parent does not miss it
+	get_node(parent_of(rel)).version ++;
+	get_node(rel);
+	m_dirty = true;
+}
+
+void UsageLedger::dir_removed(const std::string &path) {
+	std::string rel;
+	if (!relpath(path, rel))
+		return;
+	std::lock_guard<std::mutex> lock(m_mtx);
+	drop_tree(rel);
+}
+
+void UsageLedger::reconcile_dir(const std::string &rel,
+		std::vector<std::string> &subdirs) {
+	// retry if the directory is changed by clients during the scan
+	for (int attempt = 0; attempt < 3; attempt ++) {
+		uint64_t version;
+		{
+			std::lock_guard<std::mutex> lock(m_mtx);
+			auto iter = m_dirs.find(rel);
+			if (iter == m_dirs.end())
+				return;
+			version = iter->second.version;
+		}
+
+		Usage own;
+		std::map<std::string, uint64_t> sizes;
+		std::set<std::string> dirs;
+		int fd = open((m_root + rel).c_str(),
+				O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		DIR *dirp = fd < 0 ? nullptr : fdopendir(fd);
+		if (!dirp) {
+			if (fd >= 0)
+				close(fd);
+			std::lock_guard<std::mutex> lock(m_mtx);
+			auto iter = m_dirs.find(rel);
+			if (iter != m_dirs.end() && iter->second.version == version)
+				drop_tree(rel);
+			return;
+		}
+		while (auto ent = readdir(dirp)) {
+			if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+				continue;
+			struct stat st;
+			if (fstatat(dirfd(dirp), ent->d_name, &st, AT_SYMLINK_NOFOLLOW))
+				continue;
+			if (S_ISDIR(st.st_mode)) {
+				auto sub = join(rel, ent->d_name);
+				if (m_skip_dir.empty() || m_root + sub + "/" != m_skip_dir)
+					dirs.insert(ent->d_name);
+			} else if (S_ISREG(st.st_mode)) {
+				own.bytes += st.st_size;
+				own.nr_file ++;
+				sizes[ent->d_name] = st.st_size;
+			}
+		}
+		closedir(dirp);
+
+		std::lock_guard<std::mutex> lock(m_mtx);
+		auto iter = m_dirs.find(rel);
+		if (iter == m_dirs.end())
+			return;
+		if (iter->second.version != version)
+			continue;
+		auto &node = iter->second;
+		apply(rel, own.bytes - node.own.bytes, own.nr_file - node.own.nr_file);
+		for (auto i = node.owned.begin(); i != node.owned.end(); ) {
+			auto size = sizes.find(i->first);
+			if (size == sizes.end()) {
+				charge_user(i->second.user, -int64_t(i->second.size), -1);
+				i = node.owned.erase(i);
+				continue;
+			}
+			if (size->second != i->second.size) {
+				charge_user(i->second.user,
+						int64_t(size->second) - int64_t(i->second.size), 0);
+				i->second.size = size->second;
+			}
+			++ i;
+		}
+		auto gone = node.subdirs;
+		for (auto &i: dirs) {
+			gone.erase(i);
+			auto sub = join(rel, i);
+			get_node(sub);
+			subdirs.push_back(sub);
+		}
+		for (auto &i: gone)
+			drop_tree(join(rel, i));
+		return;
+	}
+	wftp_log("usage ledger: `%s' keeps changing; reconcile it later",
+			(m_root + rel).c_str());
+}
+
+void UsageLedger::reconcile(const std::string &rel) {
+	std::vector<std::string> stack{rel};
+	while (!stack.empty() && !stopping()) {
+		auto cur = std::move(stack.back());
+		stack.pop_back();
+		reconcile_dir(cur, stack);
+	}
+}
+
+uint64_t UsageLedger::headroom(const std::string &path,
+		const std::string &user, uint64_t freed) {
+	std::string rel;
+	if (!relpath(path, rel))
+		return UINT64_MAX;
+	std::lock_guard<std::mutex> lock(m_mtx);
+	uint64_t rst = UINT64_MAX;
+	auto user_quota = m_user_quota.find(user);
+	if (user_quota != m_user_quota.end())
+		rst = room_in(user_quota->second, m_users[user].bytes, freed);
+	for (auto p = rel; ; p = parent_of(p)) {
+		auto quota = m_dir_quota.find(p);
+		if (quota != m_dir_quota.end()) {
+			auto node = m_dirs.find(p);
+			rst = std::min(rst, room_in(quota->second,
+						node == m_dirs.end() ? 0 : node->second.total.bytes,
+						freed));
+		}
+		if (p.empty())
+			break;
+	}
+	return rst;
+}
+
+UsageLedger::Usage UsageLedger::dir_usage(const std::string &path,
+		uint64_t &quota) {
+	quota = UINT64_MAX;
+	std::string rel;
+	if (!relpath(path, rel))
+		return Usage();
+	std::lock_guard<std::mutex> lock(m_mtx);
+	auto iter = m_dir_quota.find(rel);
+	if (iter != m_dir_quota.end())
+		quota = iter->second;
+	auto node = m_dirs.find(rel);
+	return node == m_dirs.end() ? Usage() : node->second.total;
+}
+
+UsageLedger::Usage UsageLedger::user_usage(const std::string &user,
+		uint64_t &quota) {
+	std::lock_guard<std::mutex> lock(m_mtx);
+	auto iter = m_user_quota.find(user);
+	quota = iter == m_user_quota.end() ? UINT64_MAX : iter->second;
+	auto usage = m_users.find(user);
+	return usage == m_users.end() ? Usage() : usage->second;
+}
+
+void UsageLedger::load_snapshot() {
+	std::ifstream fin(m_snapshot_path);
+	if (!fin)
+		return;
+	std::string line;
+	if (!std::getline(fin, line) || line != SNAPSHOT_MAGIC) {
+		wftp_log("ignore bad usage snapshot `%s'", m_snapshot_path.c_str());
+		return;
+	}
+	std::lock_guard<std::mutex> lock(m_mtx);
+	while (std::getline(fin, line)) {
+		std::vector<std::string> fields;
+		for (size_t pos = 0; ; ) {
+			auto end = line.find('\t', pos);
+			fields.push_back(line.substr(pos, end - pos));
+			if (end == std::string::npos)
+				break;
+			pos = end + 1;
+		}
+		if (fields.size() != 4)
+			continue;
+		auto rel = unescape(fields[3]);
+		if (fields[0] == "d") {
+			get_node(rel);
+			apply(rel, strtoll(fields[1].c_str(), nullptr, 10),
+					strtoll(fields[2].c_str(), nullptr, 10));
+		} else if (fields[0] == "o" && !rel.empty()) {
+			auto size = strtoull(fields[1].c_str(), nullptr, 10);
+			auto user = unescape(fields[2]);
+			get_node(parent_of(rel)).owned[name_of(rel)] = {user, size};
+			charge_user(user, size, 1);
+		}
+	}
+	m_dirty = false;
+	wftp_log("usage snapshot loaded: %lld bytes in %lld files",
+			(long long)m_dirs.at("").total.bytes,
+			(long long)m_dirs.at("").total.nr_file);
+}
+
+void UsageLedger::save_snapshot() {
+	if (m_snapshot_path.empty())
+		return;
+	std::string data = std::string(SNAPSHOT_MAGIC) + "\n";
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		if (!m_dirty)
+			return;
+		m_dirty = false;
+		for (auto &i: m_dirs) {
+			auto &node = i.second;
+			data.append(ssprintf("d\t%lld\t%lld\t%s\n",
+						(long long)node.own.bytes, (long long)node.own.nr_file,
+						escape(i.first).c_str()));
+			for (auto &j: node.owned)
+				data.append(ssprintf("o\t%llu\t%s\t%s\n",
+							(unsigned long long)j.second.size,
+							escape(j.second.user).c_str(),
+							escape(join(i.first, j.first)).c_str()));
+		}
+	}
+
+	auto tmppath = m_snapshot_path + ".tmp";
+	int fd = open(tmppath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			0644);
+	bool ok = fd >= 0;
+	for (size_t done = 0; ok && done < data.size(); ) {
+		auto s = write(fd, data.data() + done, data.size() - done);
+		ok = s > 0;
+		done += std::max<ssize_t>(s, 0);
+	}
+	ok = ok && !fsync(fd);
+	if (fd >= 0 && close(fd))
+		ok = false;
+	if (ok && !rename(tmppath.c_str(), m_snapshot_path.c_str()))
+		return;
+	wftp_log("failed to save usage snapshot `%s': %m",
+			m_snapshot_path.c_str());
+	unlink(tmppath.c_str());
+	std::lock_guard<std::mutex> lock(m_mtx);
+	m_dirty = true;
+}
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
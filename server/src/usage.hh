@@ -0,0 +1,171 @@
+/*
+ * $File: usage.hh
+ * $Date: Mon Oct 19 19:05:12 2026 +0800
+ * $Author: jiakai <jia.kai66@gmail.com>
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*!
+ * \brief incremental ledger of disk usage in the served tree, by directory
+ *		and by user, for quota enforcement
+ *
+ * usage is the total size of regular files; every directory node keeps the
+ * usage of files directly in it and the aggregated usage of its subtree,
+ * so a change is applied to the node and its ancestors, and quota checks
+ * only look at the ancestors of the target
+ *
+ * a file is charged to the user who last stored it through the server;
+ * files never stored through it are only charged to directories
+ *
+ * the ledger is saved to a snapshot file periodically and loaded on start,
+ * and a background scanner reconciles it with the disk directory by
+ * directory, correcting changes made outside the server
+ */
+class UsageLedger {
+	public:
+		//! could be transiently negative if files not yet scanned are
+		//! removed
+		struct Usage {
+			int64_t bytes = 0, nr_file = 0;
+		};
+
+	private:
+		struct FileOwner {
+			std::string user;
+			uint64_t size;
+		};
+
+		struct DirNode {
+			Usage own;		//!< files directly in this directory
+			Usage total;	//!< the whole subtree
+
+			//! incremented by changes not from the scanner
+			uint64_t version = 0;
+
+			//! files charged to users, by name
+			std::map<std::string, FileOwner> owned;
+
+			std::set<std::string> subdirs;	//!< names of child nodes
+		};
+
+		std::string m_root;		//!< with trailing '/'
+		std::string m_skip_dir, m_snapshot_path;
+		std::map<std::string, uint64_t> m_dir_quota, m_user_quota;
+
+		std::mutex m_mtx;
+		std::map<std::string, DirNode> m_dirs;	//!< by path relative to root
+		std::map<std::string, Usage> m_users;
+		bool m_dirty = false;
+
+		std::condition_variable m_stop_cv;
+		bool m_stop = false;
+		std::thread m_worker;
+
+		void worker();
+
+		bool stopping();
+
+		/*!
+		 * \brief convert an absolute path to a key of m_dirs
+		 * \return false if it is not in the served tree
+		 */
+		bool relpath(const std::string &path, std::string &rel) const;
+
+		/*!
+		 * \brief get the node of a directory, creating it and its ancestors
+		 *		if needed
+		 */
+		DirNode& get_node(const std::string &rel);
+
+		/*!
+		 * \brief add usage change of files in directory *rel*
+		 */
+		void apply(const std::string &rel, int64_t bytes, int64_t nr_file);
+
+		void charge_user(const std::string &user, int64_t bytes,
+				int64_t nr_file);
+
+		/*!
+		 * \brief remove the node of directory *rel* and its subdirectories
+		 */
+		void drop_tree(const std::string &rel);
+
+		/*!
+		 * \brief rescan a directory and correct its node
+		 * \param subdirs filled with subdirectories found
+		 */
+		void reconcile_dir(const std::string &rel,
+				std::vector<std::string> &subdirs);
+
+		/*!
+		 * \brief reconcile the subtree at *rel* with the disk
+		 */
+		void reconcile(const std::string &rel);
+
+		void load_quota(const std::string &path, bool allow_user_quota);
+		void load_snapshot();
+		void save_snapshot();
+
+	public:
+		/*!
+		 * \param root root directory of the served tree, with trailing '/'
+		 * \param skip_dir directory with trailing '/' not to be accounted,
+		 *		or empty
+		 * \param snapshot_path file to save the ledger to, or empty
+		 * \param quota_path file of quotas, or empty for no limit; each line
+		 *		is `dir <path> <size>' or `user <name> <size>', where path is
+		 *		as seen by clients and size could have a K, M, G or T suffix
+		 * \param allow_user_quota whether `user' lines are accepted; user
+		 *		names only mean something if logins are verified
+		 */
+		UsageLedger(const std::string &root, const std::string &skip_dir,
+				const std::string &snapshot_path,
+				const std::string &quota_path, bool allow_user_quota);
+		~UsageLedger();
+
+		UsageLedger(const UsageLedger &) = delete;
+		UsageLedger& operator = (const UsageLedger &) = delete;
+
+		/*!
+		 * \brief account a change of file *path* made by *user*
+		 * \param old_size size of the regular file before the change, or -1
+		 *		if it did not exist
+		 */
+		void file_changed(const std::string &path, const std::string &user,
+				int64_t old_size);
+
+		void dir_created(const std::string &path);
+		void dir_removed(const std::string &path);
+
+		/*!
+		 * \brief number of bytes *user* could add in directory *path*
+		 *		before reaching any quota
+		 * \param freed size of data that would be replaced
+		 * \return UINT64_MAX if there is no quota
+		 */
+		uint64_t headroom(const std::string &path, const std::string &user,
+				uint64_t freed = 0);
+
+		/*!
+		 * \brief usage of the subtree at directory *path*, and its quota
+		 *		(UINT64_MAX if none)
+		 */
+		Usage dir_usage(const std::string &path, uint64_t &quota);
+
+		/*!
+		 * \brief usage charged to *user*, and the quota
+		 */
+		Usage user_usage(const std::string &user, uint64_t &quota);
+};
+
+// vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
@@ -4,14 +4,29 @@
  * $Author: jiakai <jia.kai66@gmail.com>
  */
 
+// max number of temp names tried by replace_by_link()
+#define REPLACE_MAX_RETRY	16
 
 #include "util.hh"
 #include "common.hh"
 
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <random>
+
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/openat2.h>
 
 void capture_subproc_output(
 		std::function<void(const void*, size_t)> on_recv_data,
@@ -36,7 +51,7 @@ void capture_subproc_output(
 	}
 
 	close(pipefd[1]);
-	char buf[1024];
+	static thread_local char buf[64 * 1024];
 	for (; ;) {
 		auto size = read(pipefd[0], buf, sizeof(buf));
 		if (size <= 0) {
@@ -52,20 +67,6 @@ void capture_subproc_output(
 	close(pipefd[0]);
 }
 
-std::string get_filesize(const char *fpath, bool *successful) {
-	struct stat stat;
-	if (::stat(fpath, &stat)) {
-		if (successful)
-			*successful = false;
-		return ssprintf("failed to get file size: %m");
-	}
-	std::ostringstream oss;
-	oss << stat.st_size;
-	if (successful)
-		*successful = true;
-	return oss.str();
-}
-
 bool isdir(const char *fpath) {
 	struct stat stat;
 	if (::stat(fpath, &stat)) 
@@ -83,4 +84,119 @@ bool isregular(const char *fpath, bool allow_nonexist) {
 	return S_ISREG(stat.st_mode);
 }
 
+int open_in_root(int dirfd, const char *path, int flags, mode_t mode) {
+	struct open_how how;
+	memset(&how, 0, sizeof(how));
+	how.flags = flags | O_CLOEXEC;
+	if (flags & O_CREAT)
+		how.mode = mode;
+	// magic links in /proc could point anywhere
+	how.resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS;
+	for (; ; ) {
+		int fd = syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+		// EAGAIN is returned if a rename raced with `..' resolution
+		if (fd >= 0 || errno != EAGAIN)
+			return fd;
+	}
+}
+
+int replace_by_link(int dirfd, const std::string &name,
+		const std::function<int(const char *tmpname)> &make_link) {
+	static thread_local std::mt19937 rng{std::random_device{}()};
+	std::string tmpname;
+	for (int i = 0; ; i ++) {
+		tmpname = ssprintf(".%s.wftp-%08x", name.c_str(), unsigned(rng()));
+		if (!make_link(tmpname.c_str()))
+			break;
+		if (errno != EEXIST || i == REPLACE_MAX_RETRY)
+			return -1;
+	}
+	if (renameat(dirfd, tmpname.c_str(), dirfd, name.c_str())) {
+		int err = errno;
+		unlinkat(dirfd, tmpname.c_str(), 0);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+int link_fd_at(int fd, int dirfd, const std::string &name) {
+	// linkat(AT_EMPTY_PATH) would need CAP_DAC_READ_SEARCH
+	char link[32];
+	sprintf(link, "/proc/self/fd/%d", fd);
+	return replace_by_link(dirfd, name, [&](const char *tmpname) {
+		return linkat(AT_FDCWD, link, dirfd, tmpname, AT_SYMLINK_FOLLOW);
+	});
+}
+
+std::string fd_path(int fd) {
+	char link[32], buf[PATH_MAX];
+	sprintf(link, "/proc/self/fd/%d", fd);
+	auto len = readlink(link, buf, sizeof(buf));
+	if (len <= 0 || size_t(len) >= sizeof(buf) || buf[0] != '/')
+		return {};
+	return std::string(buf, len);
+}
+
+bool is_compressed_file(const std::string &fpath) {
+	static const char* EXTS[] = {
+		".gz", ".tgz", ".bz2", ".xz", ".txz", ".lz", ".lzma", ".zst", ".z",
+		".zip", ".7z", ".rar", ".jar", ".apk", ".deb", ".rpm",
+		".jpg", ".jpeg", ".png", ".gif", ".webp",
+		".mp3", ".ogg", ".flac", ".mp4", ".mkv", ".avi", ".webm"
+	};
+	auto dot = fpath.rfind('.');
+	if (dot == std::string::npos || fpath.find('/', dot) != std::string::npos)
+		return false;
+	std::string ext = fpath.substr(dot);
+	for (auto &i: ext)
+		i = std::tolower(i);
+	for (auto i: EXTS)
+		if (ext == i)
+			return true;
+	return false;
+}
+
+const char* copy_file_content(int src_fd, int dst_fd, off_t size,
+		off_t progress_step, std::function<void(off_t)> on_progress) {
+	if (!ioctl(dst_fd, FICLONE, src_fd))
+		return "reflink";
+
+	bool use_cfr = true;
+	static thread_local char buf[64 * 1024];
+	off_t done = 0, next_report = progress_step;
+	while (done < size) {
+		off_t chunk = std::min(size - done, next_report - done);
+		ssize_t s;
+		if (use_cfr) {
+			s = copy_file_range(src_fd, nullptr, dst_fd, nullptr, chunk, 0);
+			if (s < 0 && !done && (errno == EXDEV || errno == EINVAL ||
+						errno == ENOSYS || errno == EOPNOTSUPP)) {
+				use_cfr = false;
+				continue;
+			}
+			if (s < 0)
+				throw WFTPError("copy_file_range: %m");
+		} else {
+			s = read(src_fd, buf, std::min<off_t>(chunk, sizeof(buf)));
+			if (s < 0)
+				throw WFTPError("read: %m");
+			for (ssize_t w = 0; w < s; ) {
+				auto r = write(dst_fd, buf + w, s - w);
+				if (r < 0)
+					throw WFTPError("write: %m");
+				w += r;
+			}
+		}
+		if (!s)
+			break;	// source file truncated while copying
+		done += s;
+		if (done == next_report && done < size) {
+			on_progress(done);
+			next_report += progress_step;
+		}
+	}
+	return use_cfr ? "copy_file_range" : "read/write";
+}
+
 // vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
@@ -7,6 +7,11 @@
 #pragma once
 
 #include <functional>
+#include <string>
+
+#include <cstddef>
+
+#include <sys/types.h>
 
 /*!
  * execute a function in child process, capture stdout and stderr and call
@@ -16,13 +21,60 @@ void capture_subproc_output(
 		std::function<void(const void*, size_t)> on_recv_data,
 		std::function<void()> setup_child);
 
+bool isdir(const char *fpath);
+bool isregular(const char *fpath, bool allow_nonexist = false);
+
 /*!
- * get file size as decimal string
+ * open *path* relative to directory *dirfd* by openat2(2) with
+ * RESOLVE_IN_ROOT, so that `..', absolute paths and symlinks are resolved as
+ * if *dirfd* were the root directory and could never lead out of it, even
+ * when the tree is changed concurrently
+ *
+ * \return the fd, or -1 with errno set
  */
-std::string get_filesize(const char *fpath, bool *successful = nullptr);
+int open_in_root(int dirfd, const char *path, int flags, mode_t mode = 0);
 
-bool isdir(const char *fpath);
-bool isregular(const char *fpath, bool allow_nonexist = false);
+/*!
+ * atomically replace *name* in directory *dirfd* by a link made by
+ * *make_link*, which is called with a free temp name in the same directory
+ * and returns 0 or -1 with errno set like linkat(2); since links never
+ * replace existing names, the temp name is then renamed to *name*
+ *
+ * \return 0, or -1 with errno set
+ */
+int replace_by_link(int dirfd, const std::string &name,
+		const std::function<int(const char *tmpname)> &make_link);
+
+/*!
+ * link the file opened as *fd*, e.g. an O_TMPFILE file, to *name* in
+ * *dirfd*, replacing an existing one
+ * \return 0, or -1 with errno set
+ */
+int link_fd_at(int fd, int dirfd, const std::string &name);
+
+/*!
+ * get the current path of the file opened as *fd*
+ * \return empty on failure
+ */
+std::string fd_path(int fd);
+
+/*!
+ * guess whether a file is already compressed from its extension, so that
+ * deflating it again would be a waste of CPU
+ */
+bool is_compressed_file(const std::string &fpath);
+
+/*!
+ * copy *size* bytes from regular file *src_fd* to *dst_fd* without passing
+ * data through user space: FICLONE reflink is tried first, and then
+ * copy_file_range(); read()/write() is only used as a last resort
+ *
+ * \param on_progress called with the number of bytes copied so far after
+ *		every *progress_step* bytes; never called for reflinks
+ * \return name of the method actually used
+ */
+const char* copy_file_content(int src_fd, int dst_fd, off_t size,
+		off_t progress_step, std::function<void(off_t)> on_progress);
 
 // vim: syntax=cpp11.doxygen foldmethod=marker foldmarker=f{{{,f}}}
 
@@ -7,37 +7,271 @@
 #include "wftp_server.hh"
 #include "common.hh"
 #include "socket.hh"
+#include "chunk.hh"
 #include "cmdparser.hh"
+#include "zstream.hh"
 #include "util.hh"
+#include "trace.hh"
+#include "capture.hh"
+#include "tar.hh"
+#include "extract.hh"
+#include "group_commit.hh"
+#include "sparse.hh"
+#include "sha256.hh"
+#include "dedup.hh"
+#include "meta_index.hh"
+#include "listing.hh"
+#include "usage.hh"
+#include "auth.hh"
+#include "session.hh"
+#include "tls.hh"
 
+#define COPY_PROGRESS_STEP	(64ll * 1024 * 1024)
+
+// seconds SITE TAIL waits for appended data before ending the transfer
+#define TAIL_IDLE_TIMEOUT	60
+
+// milliseconds between checks of worker status in prefork mode
+#define WORKER_CHECK_INTERVAL	200
+
+// max number of sessions in the table shown by SITE WHO
+#define SESSION_TABLE_SIZE	4096
+
+// seconds to wait for a command on the admin socket
+#define ADMIN_TIMEOUT		1
+
+// longest sleep between checks for kill when a session is throttled, in
+// milliseconds
+#define THROTTLE_MAX_SLEEP	100
+
+// max bytes sent by one sendfile() between accounting of a transfer
+#define SENDFILE_SLICE		(256 * 1024)
+
+// seconds before answering a failed login, to slow down password guessing
+#define LOGIN_FAIL_DELAY	1
+
+// failed logins after which the control connection is closed
+#define LOGIN_MAX_FAIL		3
+
+#include <algorithm>
 #include <cctype>
 #include <climits>
 #include <cstdlib>
+#include <chrono>
 #include <thread>
 #include <mutex>
 #include <map>
+#include <set>
+#include <sstream>
 
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
 #include <unistd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/inotify.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+/*!
+ * \brief one line describing a session, for SITE WHO and the admin socket
+ */
+static std::string format_session(const SessionRegistry::Info &info,
+		int64_t now_ms) {
+	auto cmd_ms = std::max<int64_t>(now_ms - info.cmd_start_ms, 1);
+	auto rst = ssprintf("%lld pid=%lld peer=%s user=%s up=%llds "
+			"bytes=%llu cmd=\"%s\" for %.1fs",
+			(long long)info.cli_id, (long long)info.pid, info.peer.c_str(),
+			info.user.c_str(), (long long)(now_ms - info.start_ms) / 1000,
+			(unsigned long long)info.bytes, info.cmd.c_str(),
+			cmd_ms / 1000.0);
+	if (info.cmd_bytes)
+		rst.append(ssprintf(", %llu bytes at %.1f KB/s",
+					(unsigned long long)info.cmd_bytes,
+					info.cmd_bytes / 1.024 / cmd_ms));
+	if (info.rate_limit)
+		rst.append(ssprintf(", limited to %llu KB/s",
+					(unsigned long long)info.rate_limit / 1024));
+	return rst;
+}
 
 class WFTPServer::ClientHandler {
-	bool m_pasv_mode = false;
+	bool m_pasv_mode = false, m_port_mode = false;
+	std::string m_port_host, m_port_service;
+	bool m_mode_z = false, m_sparse = false;
+	int m_z_level = Z_DEFAULT_COMPRESSION;
 	WFTPServer &m_server;
 	CMDParser m_parser;
 	std::shared_ptr<SocketBase> m_ctrl;
 	std::shared_ptr<ServerSocket> m_data_srv;
 	std::string m_working_dir = "/";
+
+	//! real path of the directory the session is confined to, with trailing
+	//! '/'; paths from the client are resolved beneath m_root_fd
+	std::string m_root;
+	int m_root_fd = -1;
+
+	std::string m_user = "anonymous";
+	bool m_logged_in = false;	//!< only checked if login is required
+	int m_nr_login_fail = 0;	//!< failed PASS on this connection
+	bool m_tls = false;			//!< whether AUTH TLS has been done
+	bool m_pbsz = false;		//!< whether PBSZ has been received
+	bool m_prot_private = false;	//!< PROT P: encrypt data connections
+	uint64_t m_allo_size = 0;	//!< announced by ALLO for the next STOR
 	CMDPair m_cur_cmd;
+
+	// command as received, since handlers like SITE may modify m_cur_cmd
+	CMDPair m_capture_cmd;
+	uint64_t m_cur_cmd_start = 0, m_xfer_size = 0;
 	int m_cli_id;
-	char m_buf[1024 * 1024];
+
+	//! entry in the session table, or nullptr if it is full
+	SessionRegistry::Slot *m_session = nullptr;
+
+	// transfer since the rate limit of the session last changed
+	uint64_t m_throttle_rate = 0, m_throttle_bytes = 0;
+	std::chrono::steady_clock::time_point m_throttle_start;
 
 	class ClientExit { };
 	class AbortCurrentFTPCommand { };
 
+	/*!
+	 * \brief account *size* bytes moved by the current command; aborts it if
+	 *		the session has been killed, and sleeps if it is throttled
+	 */
+	void on_xfer(uint64_t size) {
+		m_xfer_size += size;
+		if (!m_session)
+			return;
+		m_session->add_bytes(size);
+		if (m_session->kill_requested())
+			throw WFTPError("session killed");
+		auto rate = m_session->rate_limit();
+		if (rate != m_throttle_rate) {
+			m_throttle_rate = rate;
+			m_throttle_bytes = 0;
+			m_throttle_start = std::chrono::steady_clock::now();
+		}
+		if (!rate)
+			return;
+		m_throttle_bytes += size;
+		auto due = m_throttle_start + std::chrono::milliseconds(
+				m_throttle_bytes * 1000 / rate);
+		for (; ; ) {
+			auto now = std::chrono::steady_clock::now();
+			if (now >= due)
+				break;
+			std::this_thread::sleep_for(std::min<
+					std::chrono::steady_clock::duration>(due - now,
+						std::chrono::milliseconds(THROTTLE_MAX_SLEEP)));
+			if (m_session->kill_requested())
+				throw WFTPError("session killed");
+		}
+	}
+
+	/*!
+	 * send *length* bytes of file *fd* from *offset* by sendfile() in slices
+	 * of at most SENDFILE_SLICE bytes with on_xfer() after each, so that
+	 * throttling and kills take effect within large files
+	 * \return number of bytes sent, less than *length* if the file is shorter
+	 */
+	uint64_t send_file_sliced(SocketBase &conn, int fd, off_t offset,
+			uint64_t length) {
+		uint64_t done = 0;
+		while (done < length) {
+			auto s = conn.send_file(fd, offset + done,
+					std::min<uint64_t>(length - done, SENDFILE_SLICE));
+			if (!s)
+				break;
+			done += s;
+			on_xfer(s);
+		}
+		return done;
+	}
+
 	// FEAT
 	void do_feat() {
-		m_parser.send("211", "NoFeature");
+		std::vector<std::string> features{"MODE Z", "SIZE", "SPARSE"};
+		if (m_server.m_tls) {
+			features.push_back("AUTH TLS");
+			features.push_back("PBSZ");
+			features.push_back("PROT");
+		}
+		m_parser.send_multiline("211", "Features:", features, "End");
+	}
+
+	// AUTH TLS
+	void do_auth() {
+		if (!m_server.m_tls) {
+			m_parser.send("502", "TLS not configured");
+			return;
+		}
+		auto mech = m_cur_cmd.arg;
+		for (auto &i: mech)
+			i = std::toupper(i);
+		if (mech != "TLS" && mech != "TLS-C" && mech != "SSL") {
+			m_parser.send("504", "only AUTH TLS is supported");
+			return;
+		}
+		if (m_tls) {
+			m_parser.send("503", "TLS already established");
+			return;
+		}
+		if (m_parser.has_buffered_input()) {
+			// commands sent in cleartext after AUTH must not be run as if
+			// they came through TLS
+			wftp_log("client %s: cleartext pipelined after AUTH TLS",
+					get_peerinfo());
+			m_parser.send("421", "cleartext data after AUTH TLS, closing");
+			m_parser.flush();
+			throw ClientExit();
+		}
+		m_parser.send("234", "proceed with TLS negotiation");
+		m_parser.flush();
+		try {
+			auto desc = m_server.m_tls->accept(*m_ctrl);
+			wftp_log("client %s: control connection encrypted, %s",
+					get_peerinfo(), desc.c_str());
+		} catch (WFTPError &exc) {
+			// state of the connection is unknown after a failed handshake
+			wftp_log("client %s: %s", get_peerinfo(), exc.what());
+			throw ClientExit();
+		}
+		m_tls = true;
+	}
+
+	// PBSZ; only 0 is meaningful for TLS
+	void do_pbsz() {
+		if (!m_tls) {
+			m_parser.send("503", "AUTH TLS first");
+			return;
+		}
+		m_pbsz = true;
+		m_parser.send("200", "PBSZ=0");
+	}
+
+	// PROT C|P
+	void do_prot() {
+		if (!m_pbsz) {
+			m_parser.send("503", "PBSZ first");
+			return;
+		}
+		auto level = m_cur_cmd.arg;
+		for (auto &i: level)
+			i = std::toupper(i);
+		if (level == "C" && m_server.m_tls_required)
+			m_parser.send("534", "data connections must be encrypted");
+		else if (level == "C" || level == "P") {
+			m_prot_private = level == "P";
+			m_parser.send("200", ssprintf("protection level %s",
+						level.c_str()));
+		} else if (level == "S" || level == "E")
+			m_parser.send("536", "only C and P are supported");
+		else
+			m_parser.send("504", "unknown protection level");
 	}
 
 	// PWD
@@ -48,8 +282,10 @@ class WFTPServer::ClientHandler {
 	// PASV
 	void do_pasv() {
 		m_pasv_mode = true;
+		m_port_mode = false;
 		auto addr = m_ctrl->local_addr();
-		m_data_srv = std::make_shared<ServerSocket>(0);
+		m_data_srv = std::make_shared<ServerSocket>(0, 5,
+				m_server.m_profile[int(SocketRole::PASV_DATA)]);
 		m_data_srv->enable_timeout();
 		auto port = m_data_srv->local_port();
 		m_parser.send("227", ssprintf(
@@ -58,20 +294,97 @@ class WFTPServer::ClientHandler {
 					port >> 8, port & 0xFF));
 	}
 
+	// PORT
+	void do_port() {
+		int h[4], p[2];
+		if (sscanf(m_cur_cmd.arg.c_str(), "%d,%d,%d,%d,%d,%d",
+					&h[0], &h[1], &h[2], &h[3], &p[0], &p[1]) != 6) {
+			m_parser.send("501", "bad PORT argument");
+			return;
+		}
+		SocketBase::addr_t addr = 0;
+		for (int i = 0; i < 4; i ++)
+			addr = (addr << 8) | (h[i] & 0xFF);
+		// only connect back to the client itself, to avoid FTP bounce attack
+		if (addr != m_ctrl->peer_addr()) {
+			m_parser.send("501", "PORT address must be the client address");
+			return;
+		}
+		m_port_mode = true;
+		m_pasv_mode = false;
+		m_data_srv.reset();
+		m_port_host = SocketBase::format_addr(addr);
+		m_port_service = ssprintf("%d", ((p[0] & 0xFF) << 8) | (p[1] & 0xFF));
+		m_parser.send("200", "PORT command successful");
+	}
+
 	// QUIT
 	void do_quit() {
 		m_parser.send("221", "Goodbye:)");
+		m_parser.flush();
 		throw ClientExit();
 	}
 
 	// USER
 	void do_user() {
-		m_parser.send("230", "any user is welcome");
+		if (!m_server.m_auth) {
+			if (!m_cur_cmd.arg.empty())
+				m_user = m_cur_cmd.arg;
+			if (m_session)
+				m_session->set_user(m_user);
+			m_parser.send("230", "any user is welcome");
+			return;
+		}
+		m_user = m_cur_cmd.arg;
+		m_logged_in = false;
+		m_parser.send("331", ssprintf("password required for %s",
+					m_user.c_str()));
 	}
 
 	// PASS
 	void do_pass() {
-		m_parser.send("230", "any password is usable");
+		if (!m_server.m_auth) {
+			m_parser.send("230", "any password is usable");
+			return;
+		}
+		if (m_user.empty() || m_logged_in) {
+			m_parser.send("503", "login with USER first");
+			return;
+		}
+		bool ok;
+		try {
+			TraceSpan span(SpanEvent::AUTH);
+			ok = m_server.m_auth->verify(m_user, m_cur_cmd.arg);
+		} catch (WFTPError &exc) {
+			// not 421, which means the connection is being closed
+			m_parser.send("530", ssprintf("%s, try again later", exc.what()));
+			return;
+		}
+		if (!ok) {
+			wftp_log("client %s: login failed for `%s'", get_peerinfo(),
+					m_user.c_str());
+			std::this_thread::sleep_for(std::chrono::seconds(
+						LOGIN_FAIL_DELAY));
+			if (++ m_nr_login_fail >= LOGIN_MAX_FAIL) {
+				m_parser.send("421", "too many failed logins, closing");
+				m_parser.flush();
+				throw ClientExit();
+			}
+			m_parser.send("530", "login incorrect");
+			return;
+		}
+		if (!set_session_root(m_server.m_auth->home_dir(m_user))) {
+			wftp_log("client %s: failed to open home of `%s': %m",
+					get_peerinfo(), m_user.c_str());
+			m_parser.send("530", "home directory unavailable");
+			return;
+		}
+		m_logged_in = true;
+		if (m_session)
+			m_session->set_user(m_user);
+		wftp_log("client %s: logged in as `%s'", get_peerinfo(),
+				m_user.c_str());
+		m_parser.send("230", ssprintf("user %s logged in", m_user.c_str()));
 	}
 
 	// SYST
@@ -84,68 +397,277 @@ class WFTPServer::ClientHandler {
 		m_parser.send("200", "well, I always run in binary mode");
 	}
 
+	// MODE
+	void do_mode() {
+		auto mode = m_cur_cmd.arg;
+		for (auto &i: mode)
+			i = std::toupper(i);
+		if (mode == "S")
+			m_mode_z = false;
+		else if (mode == "Z")
+			m_mode_z = true;
+		else {
+			m_parser.send("504", "only MODE S and MODE Z are supported");
+			return;
+		}
+		m_parser.send("200", "transfer mode set to " + mode);
+	}
+
+	// OPTS
+	void do_opts() {
+		int level;
+		auto arg = m_cur_cmd.arg;
+		for (auto &i: arg)
+			i = std::toupper(i);
+		if (sscanf(arg.c_str(), "MODE Z LEVEL %d", &level) == 1 &&
+				level >= Z_NO_COMPRESSION && level <= Z_BEST_COMPRESSION) {
+			m_z_level = level;
+			m_parser.send("200", ssprintf("MODE Z LEVEL set to %d", level));
+			return;
+		}
+		if (arg == "SPARSE ON" || arg == "SPARSE OFF") {
+			m_sparse = arg == "SPARSE ON";
+			m_parser.send("200", ssprintf("sparse transfer %s",
+						m_sparse ? "enabled" : "disabled"));
+			return;
+		}
+		m_parser.send("501", "unsupported option");
+	}
+
 	// LIST and NLST
 	void do_list() {
-		const char* opt = m_cur_cmd.cmd == "LIST" ?
-			"-al --group-directories-first" : "-a --group-directories-first";
 		std::string path = m_cur_cmd.arg;
+		bool recursive = false;
 
-		while (path[0] == '-') { // ignore all options (sent by chrome)
-			for (size_t i = 0; i < path.size(); i ++)
-				if (std::isspace(path[i])) {
-					path.erase(0, i + 1);
-					break;
-				}
-			if (path[0] == '-') // no space, totally opt
-				path = ".";
+		// options other than -R are ignored (e.g. -la sent by chrome)
+		while (path[0] == '-') {
+			auto end = path.find_first_of(" \t");
+			recursive |= path.substr(0, end).find('R') != std::string::npos;
+			path.erase(0, end == std::string::npos ? end : end + 1);
 		}
 		if (path.empty())
 			path = ".";
-		path = safe_realpath(path);
-		std::string ls_cmd = ssprintf("ls %s %s | tail -n +2", opt, path.c_str());
+		if (recursive || has_wildcard(path)) {
+			do_search_list(path, recursive);
+			return;
+		}
+		auto realpath = safe_realpath(path);
+
+		// formatted here rather than by ls(1), so that no path from the
+		// client ever reaches a shell; like `ls | tail -n +2`, a listing of
+		// anything but a directory is empty
+		std::vector<MetaIndex::Entry> entries;
+		bool indexed = m_server.m_meta_index && isdir(realpath) &&
+			m_server.m_meta_index->list(realpath, entries);
+		bool is_dir = indexed;
+		if (!indexed) {
+			int fd = open_beneath(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			is_dir = fd >= 0 && load_dir_entries(fd, entries);
+		}
+		std::string msg;
+		if (is_dir)
+			msg = format_dir_listing(realpath, entries,
+					m_cur_cmd.cmd == "LIST");
 
 		auto data_conn = get_data_conn("start directory listing");
-		capture_subproc_output(
-			[data_conn](const void *buf, size_t size) {
-				data_conn->send_crlf(static_cast<const char*>(buf), size);
-			},
-			[this, &ls_cmd]() {
-				setenv("LC_ALL", "C", 1);
-				execl("/bin/sh", "sh", "-c", ls_cmd.c_str(), nullptr);
-				printf("failed to exec ls: %m\n");
-				exit(-1);
-			});
+		data_conn->set_cork(true);
+		on_xfer(msg.size());
+		if (m_mode_z) {
+			ZSender zsender(data_conn, m_z_level);
+			zsender.send_crlf(msg.data(), msg.size());
+			zsender.finish();
+		} else
+			data_conn->send_crlf(msg.data(), msg.size());
+		data_conn->set_cork(false);
 
 		close_data_conn(data_conn, "finished listing");
 	}
 
+	/*!
+	 * LIST or NLST with wildcards or -R: the path before the first
+	 * component with wildcards is resolved as usual, the directory
+	 * components after it are expanded, and entries matching the last
+	 * component (or all entries if there are no wildcards) are streamed as
+	 * they are found, searching subdirectories in parallel if *recursive*;
+	 * entries are shown as relative paths, by LIST like `ls -ld`
+	 */
+	void do_search_list(const std::string &path, bool recursive) {
+		std::string prefix = path, rest, pattern;
+		auto wildcard = path.find_first_of("*?[");
+		if (wildcard != std::string::npos) {
+			auto sep = path.rfind('/', wildcard);
+			auto split = sep == std::string::npos ? 0 : sep + 1;
+			prefix = path.substr(0, split);
+			rest = path.substr(split);
+			sep = rest.rfind('/');
+			pattern = rest.substr(sep == std::string::npos ? 0 : sep + 1);
+			rest.erase(sep == std::string::npos ? 0 : sep);
+		}
+
+		SearchDir base{safe_realpath(prefix.empty() ? "." : prefix),
+			prefix == "." || prefix == "./" ? "" : prefix};
+		if (!base.display.empty() && base.display.back() != '/')
+			base.display.append("/");
+		if (!isdir(base.real)) {
+			m_parser.send("550", "not a directory");
+			return;
+		}
+		std::string skip_dir = m_server.m_dedup ?
+			m_server.m_dedup->dir() : std::string();
+		std::vector<SearchDir> dirs;
+		try {
+			for (auto &i: expand_glob_dirs(base, rest))
+				if (skip_dir.empty() ||
+						(i.real + "/").compare(0, skip_dir.length(), skip_dir))
+					dirs.push_back(i);
+		} catch (WFTPError &exc) {
+			m_parser.send("550", exc.what());
+			return;
+		}
+
+		auto data_conn = get_data_conn("start directory listing");
+		data_conn->set_cork(true);
+		std::unique_ptr<ZSender> zsender;
+		if (m_mode_z)
+			zsender.reset(new ZSender(data_conn, m_z_level));
+		bool long_format = m_cur_cmd.cmd == "LIST";
+		size_t nr_match = 0;
+		search_tree(dirs, pattern, recursive, skip_dir,
+				[&](std::vector<ListEntry> &batch) {
+					nr_match += batch.size();
+					std::string msg;
+					if (long_format) {
+						std::vector<const ListEntry*> entries;
+						for (auto &i: batch)
+							entries.push_back(&i);
+						msg = format_long_entries(entries);
+					} else
+						for (auto &i: batch) {
+							msg.append(i.name);
+							msg.append("\n");
+						}
+					on_xfer(msg.size());
+					if (zsender)
+						zsender->send_crlf(msg.data(), msg.size());
+					else
+						data_conn->send_crlf(msg.data(), msg.size());
+				});
+		if (zsender)
+			zsender->finish();
+		data_conn->set_cork(false);
+		wftp_log("client %s: search `%s'%s, %zu matches", get_peerinfo(),
+				path.c_str(), recursive ? " recursively" : "", nr_match);
+		close_data_conn(data_conn, ssprintf("%zu entries found",
+					nr_match).c_str());
+	}
+
 	// CWD
 	void do_cwd() {
 		auto new_dir = safe_realpath(m_cur_cmd.arg);
-		if (!isdir(new_dir.c_str())) {
+		if (!isdir(new_dir)) {
 			m_parser.send("550", "failed to chdir");
 			return;
 		}
 		m_working_dir = new_dir;
-		m_working_dir.erase(0, m_server.m_rootdir.length() - 1);
+		m_working_dir.erase(0, m_root.length() - 1);
+		if (m_working_dir.empty())
+			m_working_dir = "/";
 		m_parser.send("250", ssprintf("working dir changed to %s",
 					m_working_dir.c_str()).c_str());
 	}
 
 	// SIZE
 	void do_size() {
-		std::string size,
-			realpath = safe_realpath(m_cur_cmd.arg);
-		bool suc;
-		size = get_filesize(realpath.c_str(), &suc);
-		m_parser.send(suc ? "213" : "550", size);
+		auto realpath = safe_realpath(m_cur_cmd.arg);
+		struct stat st;
+		if (meta_stat(realpath, &st))
+			m_parser.send("550", ssprintf("failed to get file size: %m"));
+		else
+			m_parser.send("213", ssprintf("%lld", (long long)st.st_size));
+	}
+
+	/*!
+	 * stat() by the metadata index if enabled
+	 */
+	int meta_stat(const std::string &path, struct stat *st) {
+		if (m_server.m_meta_index)
+			return m_server.m_meta_index->stat(path, st);
+		return stat(path.c_str(), st);
+	}
+
+	bool isdir(const std::string &path) {
+		struct stat st;
+		return !meta_stat(path, &st) && S_ISDIR(st.st_mode);
+	}
+
+	/*!
+	 * update the metadata index after *path* is changed by this session
+	 */
+	void note_changed(const std::string &path) {
+		if (m_server.m_meta_index)
+			m_server.m_meta_index->refresh(path);
+	}
+
+	/*!
+	 * size of *path* if it is a regular file, or -1; taken before changing
+	 * the file, for note_usage()
+	 */
+	int64_t usage_size(const std::string &path) {
+		struct stat st;
+		if (!m_server.m_usage || lstat(path.c_str(), &st) ||
+				!S_ISREG(st.st_mode))
+			return -1;
+		return st.st_size;
+	}
+
+	/*!
+	 * charge the change of file *path* to the user of this session
+	 */
+	void note_usage(const std::string &path, int64_t old_size) {
+		if (m_server.m_usage)
+			m_server.m_usage->file_changed(path, m_user, old_size);
+	}
+
+	/*!
+	 * hash of the dedup blob that *name* in *dir_fd* links to, to be passed
+	 * to release_blob() after the file is removed or replaced
+	 */
+	std::string linked_blob(int dir_fd, const std::string &name) {
+		if (!m_server.m_dedup)
+			return {};
+		return m_server.m_dedup->blob_of(dir_fd, name);
+	}
+
+	/*!
+	 * remove a blob found by linked_blob() if no file links to it any more,
+	 * so that space of deleted files is given back
+	 */
+	void release_blob(const std::string &hash) {
+		if (!hash.empty())
+			m_server.m_dedup->release(hash);
+	}
+
+	/*!
+	 * bytes this session could write to file *path* within quotas, where
+	 * *old_size* bytes of it would be replaced
+	 */
+	uint64_t quota_headroom(const std::string &path, int64_t old_size) {
+		if (!m_server.m_usage)
+			return UINT64_MAX;
+		return m_server.m_usage->headroom(path.substr(0, path.rfind('/')),
+				m_user, std::max<int64_t>(old_size, 0));
 	}
 
 	// RETR
 	void do_retr() {
-		auto realpath = safe_realpath(m_cur_cmd.arg);
-		FILE *fin = isregular(realpath.c_str()) ?
-			fopen(realpath.c_str(), "rb") : nullptr;
+		std::string realpath;
+		FILE *fin = nullptr;
+		{
+			TraceSpan span(SpanEvent::FILE_OPEN);
+			int fd = open_client_file(m_cur_cmd.arg, O_RDONLY, realpath);
+			if (fd >= 0 && !(fin = fdopen(fd, "rb")))
+				close(fd);
+		}
 		if (!fin) {
 			m_parser.send("550", "failed to open file");
 			return;
@@ -154,58 +676,366 @@ class WFTPServer::ClientHandler {
 		auto data_conn = get_data_conn(
 				ssprintf("going to transfer %s", m_cur_cmd.arg.c_str()));
 
+		std::unique_ptr<ZSender> zsender;
+		if (m_mode_z)
+			zsender.reset(new ZSender(data_conn,
+						is_compressed_file(realpath) ?
+						Z_NO_COMPRESSION : m_z_level));
+		if (m_sparse || is_sparse_file(fileno(fin))) {
+			send_file_segments(fileno(fin), *data_conn, zsender.get());
+			if (zsender)
+				zsender->finish();
+			close_data_conn(data_conn, "transfer completed");
+			return;
+		}
+		if (!zsender) {
+			// until the end of file, as the file may still grow
+			TraceSpan span(SpanEvent::CHUNK_SEND);
+			span.set_arg(send_file_sliced(*data_conn, fileno(fin), 0,
+						UINT64_MAX));
+			close_data_conn(data_conn, "transfer completed");
+			return;
+		}
+		// data must pass through user space to be compressed
+		AdaptiveChunk chunk(*data_conn, true);
 		for (; ;) {
-			auto size = fread(m_buf, 1, sizeof(m_buf), fin);
+			size_t size;
+			{
+				TraceSpan span(SpanEvent::CHUNK_READ);
+				size = fread(chunk.data(), 1, chunk.size(), fin);
+				span.set_arg(size);
+			}
 			if (size <= 0)
 				break;
-			data_conn->send(m_buf, size);
+			on_xfer(size);
+			TraceSpan span(SpanEvent::CHUNK_SEND);
+			span.set_arg(size);
+			zsender->send(chunk.data(), size);
+			chunk.update(size);
 		}
+		zsender->finish();
 		close_data_conn(data_conn, "transfer completed");
 	}
 
+	/*!
+	 * send a file by its data segments and holes: data by sendfile() (or
+	 * through *zsender*), and holes as hole frames with the sparse extension
+	 * or as zeros that are never read from disk
+	 */
+	void send_file_segments(int fd, SocketBase &data_conn, ZSender *zsender) {
+		static const char zeros[64 * 1024] = {0};
+		struct stat st;
+		if (fstat(fd, &st))
+			throw WFTPError("fstat: %m");
+		auto send = [&](const void *buf, size_t size) {
+			if (zsender)
+				zsender->send(buf, size);
+			else
+				data_conn.send(buf, size);
+		};
+		auto send_zeros = [&](uint64_t size) {
+			while (size) {
+				auto s = std::min<uint64_t>(size, sizeof(zeros));
+				send(zeros, s);
+				on_xfer(s);
+				size -= s;
+			}
+		};
+		// only needed to read data for compression
+		std::unique_ptr<AdaptiveChunk> chunk;
+		for_each_file_segment(fd, st.st_size,
+				[&](off_t offset, off_t length, bool hole) {
+			TraceSpan span(SpanEvent::CHUNK_SEND);
+			span.set_arg(length);
+			if (m_sparse) {
+				auto hdr = sparse_frame_header(hole ?
+						SPARSE_FRAME_HOLE : SPARSE_FRAME_DATA, length);
+				send(hdr.data(), hdr.size());
+				if (hole) {
+					on_xfer(length);
+					return;
+				}
+			}
+			if (hole) {
+				send_zeros(length);
+				return;
+			}
+			uint64_t done = 0;
+			if (!zsender)
+				done = send_file_sliced(data_conn, fd, offset, length);
+			else {
+				if (!chunk)
+					chunk.reset(new AdaptiveChunk(data_conn, true));
+				ssize_t s;
+				while (done < uint64_t(length) && (s = pread(fd,
+								chunk->data(), std::min<uint64_t>(
+									chunk->size(), length - done),
+								offset + done)) > 0) {
+					zsender->send(chunk->data(), s);
+					chunk->update(s);
+					on_xfer(s);
+					done += s;
+				}
+			}
+			// the segment length has been committed if the file shrinks
+			send_zeros(length - done);
+		});
+	}
+
 	// ALLO
 	void do_allo() {
-		m_parser.send("202", "ALLO is superfluous");
+		if (!m_server.m_usage) {
+			m_parser.send("202", "ALLO is superfluous");
+			return;
+		}
+		unsigned long long size;
+		if (sscanf(m_cur_cmd.arg.c_str(), "%llu", &size) != 1) {
+			m_parser.send("501", "usage: ALLO <size>");
+			return;
+		}
+		auto headroom = quota_headroom(safe_realpath(".") + "/", -1);
+		if (size > headroom) {
+			m_parser.send("552", ssprintf("quota exceeded: %llu bytes "
+						"available", (unsigned long long)headroom));
+			return;
+		}
+		m_allo_size = size;
+		m_parser.send("200", "ALLO OK");
 	}
 
 	// STOR
 	void do_stor() {
-		auto realpath = safe_realpath(m_cur_cmd.arg, true);
-		FILE *fout = isregular(realpath.c_str(), true) ?
-			fopen(realpath.c_str(), "wb") : nullptr;
+		std::string realpath, name;
+		int dir_fd = open_parent(m_cur_cmd.arg, realpath, name);
+		AutoFDCloser dir_closer(dir_fd);
+		bool atomic = m_server.m_atomic_stor;
+		auto dedup = m_server.m_dedup.get();
+		// whether the target is written directly rather than replaced by a
+		// complete temp file
+		bool in_place = !dedup && !atomic;
+		auto old_size = usage_size(realpath);
+		auto headroom = quota_headroom(realpath, old_size);
+		auto allo_size = m_allo_size;
+		m_allo_size = 0;
+		if (allo_size > headroom) {
+			m_parser.send("552", ssprintf("quota exceeded: %llu bytes "
+						"available", (unsigned long long)headroom));
+			return;
+		}
+		std::string tmppath;
+		FILE *fout = nullptr;
+		if (isregular(realpath.c_str(), true)) {
+			TraceSpan span(SpanEvent::FILE_OPEN);
+			if (dedup)
+				fout = dedup->open_tmpfile(tmppath);
+			else
+				fout = atomic ? open_upload_tmpfile(dir_fd) :
+					open_client_file_write(m_cur_cmd.arg);
+		}
 		if (!fout) {
 			m_parser.send("553", ssprintf("failed to open `%s' for write",
 						m_cur_cmd.arg.c_str()));
 			return;
 		}
-		AutoCloser _ac(fout);
-		auto data_conn = get_data_conn("OK to transfer");
+
+		std::shared_ptr<SocketBase> data_conn;
 		off_t tot_size = 0;
-		for (; ;) {
-			auto size = data_conn->recv(m_buf, sizeof(m_buf));
-			if (size <= 0)
-				break;
-			tot_size += size;
-			fwrite(m_buf, 1, size, fout);
+		std::string err, hash;
+		bool over_quota = false;
+		try {
+			data_conn = get_data_conn("OK to transfer");
+			std::unique_ptr<ZReceiver> zreceiver;
+			if (m_mode_z)
+				zreceiver.reset(new ZReceiver(data_conn));
+			SparseWriter writer(fileno(fout));
+			std::unique_ptr<Sha256> hasher;
+			if (dedup)
+				hasher.reset(new Sha256());
+			auto write = [&](const char *buf, size_t size) {
+				if (hasher)
+					hasher->update(buf, size);
+				writer.write(buf, size);
+			};
+			SparseDecoder decoder(write,
+					[&](uint64_t length) {
+						if (hasher)
+							hasher->update_zeros(length);
+						writer.write_hole(length);
+					});
+			AdaptiveChunk chunk(*data_conn, false);
+			for (; ;) {
+				size_t size;
+				{
+					TraceSpan span(SpanEvent::CHUNK_RECV);
+					size = zreceiver ?
+						zreceiver->recv(chunk.data(), chunk.size()) :
+						data_conn->recv(chunk.data(), chunk.size());
+					span.set_arg(size);
+				}
+				if (size <= 0)
+					break;
+				on_xfer(size);
+				TraceSpan span(SpanEvent::CHUNK_WRITE);
+				span.set_arg(size);
+				if (m_sparse)
+					decoder.feed(chunk.data(), size);
+				else
+					write(chunk.data(), size);
+				chunk.update(size);
+				if (uint64_t(writer.offset()) > headroom) {
+					over_quota = true;
+					throw WFTPError("quota exceeded");
+				}
+			}
+			if (m_sparse && !decoder.at_boundary())
+				throw WFTPError("truncated sparse frame");
+			writer.finish();
+			tot_size = writer.offset();
+			if (atomic)
+				GroupCommitter::instance().sync(fileno(fout));
+			if (hasher)
+				hash = hasher->hexdigest();
+		} catch (WFTPError &exc) {
+			err = exc.what();
+		} catch (...) {
+			fclose(fout);
+			if (!tmppath.empty())
+				unlink(tmppath.c_str());
+			throw;
+		}
+		// an unnamed temp file must be linked while still open
+		if (atomic && !dedup && err.empty())
+			err = commit_upload(fileno(fout), dir_fd, name);
+		if (fclose(fout) && err.empty())
+			err = ssprintf("close: %m");
+		if (dedup && err.empty())
+			err = commit_dedup_upload(tmppath, hash, dir_fd, name,
+					realpath);
+		// without a temp file, the target has been written even on failure;
+		// it is removed if over quota, since its old content is lost anyway
+		if (over_quota && in_place)
+			unlinkat(dir_fd, name.c_str(), 0);
+		if (err.empty() || in_place)
+			note_usage(realpath, old_size);
+		if (!err.empty()) {
+			if (!tmppath.empty())
+				unlink(tmppath.c_str());
+			if (data_conn)
+				data_conn->close();
+			m_parser.send(over_quota ? "552" : "451",
+					ssprintf("upload failed: %s", err.c_str()));
+			return;
 		}
+		note_changed(realpath);
 		wftp_log("client %s: upload file `%s', size=%llu",
 				get_peerinfo(), realpath.c_str(),
 				(unsigned long long)tot_size);
 		close_data_conn(data_conn, "transfer complete");
 	}
 
+	/*!
+	 * open an unnamed temp file in directory *dir_fd* for atomic upload, so
+	 * that nothing is left behind if the upload fails
+	 */
+	FILE* open_upload_tmpfile(int dir_fd) {
+		int fd = openat(dir_fd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+		if (fd < 0)
+			return nullptr;
+		FILE *rst = fdopen(fd, "wb");
+		if (!rst)
+			close(fd);
+		return rst;
+	}
+
+	/*!
+	 * link a synced temp file opened as *fd* to *name* in *dir_fd* and make
+	 * the link durable
+	 * \return error message, or empty string on success
+	 */
+	std::string commit_upload(int fd, int dir_fd, const std::string &name) {
+		if (link_fd_at(fd, dir_fd, name))
+			return ssprintf("link: %m");
+		return sync_dir(dir_fd);
+	}
+
+	/*!
+	 * move an uploaded temp file into the dedup store and link its blob to
+	 * *name* in *dir_fd*, whose real path is *fpath*; with atomic STOR, both
+	 * links are made durable
+	 * \return error message, or empty string on success
+	 */
+	std::string commit_dedup_upload(const std::string &tmppath,
+			const std::string &hash, int dir_fd, const std::string &name,
+			const std::string &fpath) {
+		auto dedup = m_server.m_dedup.get();
+		bool is_new;
+		try {
+			is_new = dedup->add(tmppath, hash);
+			if (is_new && m_server.m_atomic_stor) {
+				auto err = sync_parent_dir(dedup->blob_path(hash));
+				if (!err.empty())
+					return err;
+			}
+			auto old_blob = linked_blob(dir_fd, name);
+			if (!dedup->link_to(hash, dir_fd, name))
+				return "blob vanished";
+			release_blob(old_blob);
+		} catch (WFTPError &exc) {
+			return exc.what();
+		}
+		if (!is_new)
+			wftp_log("client %s: upload of `%s' deduplicated to %s",
+					get_peerinfo(), fpath.c_str(), hash.c_str());
+		return m_server.m_atomic_stor ? sync_dir(dir_fd) : std::string();
+	}
+
+	/*!
+	 * make the entry of *fpath* in its directory durable
+	 * \return error message, or empty string on success
+	 */
+	std::string sync_parent_dir(const std::string &fpath) {
+		auto dir = fpath.substr(0, fpath.rfind('/') + 1);
+		int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0)
+			return ssprintf("open directory: %m");
+		auto err = sync_dir(fd);
+		close(fd);
+		return err;
+	}
+
+	/*!
+	 * make entries of the directory opened as *fd* durable
+	 * \return error message, or empty string on success
+	 */
+	std::string sync_dir(int fd) {
+		try {
+			GroupCommitter::instance().sync(fd);
+		} catch (WFTPError &exc) {
+			return exc.what();
+		}
+		return {};
+	}
+
 	// DELE and RMD
 	void do_remove() {
-		auto realpath = safe_realpath(m_cur_cmd.arg);
-		int rst;
-		if (m_cur_cmd.cmd == "DELE")
-			rst = unlink(realpath.c_str());
-		else
-			rst = rmdir(realpath.c_str());
+		std::string realpath, name;
+		int dir_fd = open_parent(m_cur_cmd.arg, realpath, name);
+		bool is_file = m_cur_cmd.cmd == "DELE";
+		auto old_size = is_file ? usage_size(realpath) : -1;
+		auto blob = is_file ? linked_blob(dir_fd, name) : std::string();
+		int rst = unlinkat(dir_fd, name.c_str(), is_file ? 0 : AT_REMOVEDIR);
+		close(dir_fd);
+		if (!rst)
+			release_blob(blob);
 		if (rst)
 			m_parser.send("550", ssprintf("failed to delete `%s': %m",
 						m_cur_cmd.arg.c_str()));
 		else {
+			note_changed(realpath);
+			if (is_file)
+				note_usage(realpath, old_size);
+			else if (m_server.m_usage)
+				m_server.m_usage->dir_removed(realpath);
 			wftp_log("client %s: delete `%s'",
 					get_peerinfo(), realpath.c_str());
 			m_parser.send("250", ssprintf("delete `%s' ok",
@@ -215,70 +1045,777 @@ class WFTPServer::ClientHandler {
 
 	// MKD
 	void do_mkd() {
-		auto realpath = safe_realpath(m_cur_cmd.arg, true);
-		if (mkdir(realpath.c_str(), 0755))
+		std::string realpath, name;
+		int dir_fd = open_parent(m_cur_cmd.arg, realpath, name);
+		int rst = mkdirat(dir_fd, name.c_str(), 0755);
+		close(dir_fd);
+		if (rst)
 			m_parser.send("550", ssprintf("failed to mkdir `%s': %m",
 					realpath.c_str()));
-		else
+		else {
+			note_changed(realpath);
+			if (m_server.m_usage)
+				m_server.m_usage->dir_created(realpath);
 			m_parser.send("257", "mkdir OK");
+		}
+	}
+
+	// SITE
+	void do_site() {
+		typedef void (ClientHandler::*handler_ptr_t)();
+		static const std::map<std::string, handler_ptr_t> HANDLER_MAP = {
+			{"COPY", &ClientHandler::do_site_copy},
+			{"ZEROCOPY", &ClientHandler::do_site_zerocopy},
+			{"TAR", &ClientHandler::do_site_tar},
+			{"UNTAR", &ClientHandler::do_site_untar},
+			{"HASH", &ClientHandler::do_site_hash},
+			{"TAIL", &ClientHandler::do_site_tail},
+			{"USAGE", &ClientHandler::do_site_usage},
+			{"WHO", &ClientHandler::do_site_who},
+		};
+		std::string sub = m_cur_cmd.arg, arg;
+		for (size_t i = 0; i < sub.size(); i ++)
+			if (std::isspace(sub[i])) {
+				arg = sub.substr(i + 1);
+				sub.erase(i);
+				break;
+			}
+		for (auto &i: sub)
+			i = std::toupper(i);
+		auto hdl = HANDLER_MAP.find(sub);
+		if (hdl == HANDLER_MAP.end()) {
+			m_parser.send("504",
+					ssprintf("SITE %s unimplemented", sub.c_str()));
+			return;
+		}
+		m_cur_cmd.arg = arg;
+		(this->*(hdl->second))();
+	}
+
+	// SITE COPY <src> <dst>; a preliminary 150 reply is sent for every
+	// COPY_PROGRESS_STEP bytes copied; split at the last space, so only the
+	// source name may contain spaces
+	void do_site_copy() {
+		auto &arg = m_cur_cmd.arg;
+		auto sep = arg.rfind(' ');
+		if (sep == std::string::npos || !sep || sep + 1 == arg.size()) {
+			m_parser.send("501", "usage: SITE COPY <src> <dst>, where dst "
+					"must not contain spaces");
+			return;
+		}
+		std::string src, dst, dst_name;
+		int src_fd = open_client_file(arg.substr(0, sep), O_RDONLY, src);
+		if (src_fd < 0) {
+			m_parser.send("550", "source is not a regular file");
+			return;
+		}
+		AutoFDCloser src_closer(src_fd);
+		int dst_dir = open_parent(arg.substr(sep + 1), dst, dst_name);
+		AutoFDCloser dst_dir_closer(dst_dir);
+
+		// the destination is not followed if it is a symlink, which may
+		// point anywhere
+		struct stat src_stat, dst_stat;
+		bool dst_exists = !fstatat(dst_dir, dst_name.c_str(), &dst_stat,
+				AT_SYMLINK_NOFOLLOW);
+		if (fstat(src_fd, &src_stat) || (dst_exists &&
+					(!S_ISREG(dst_stat.st_mode) ||
+					 (dst_stat.st_dev == src_stat.st_dev &&
+					  dst_stat.st_ino == src_stat.st_ino)))) {
+			m_parser.send("553", "bad copy destination");
+			return;
+		}
+
+		auto old_size = usage_size(dst);
+		auto headroom = quota_headroom(dst, old_size);
+		if (uint64_t(src_stat.st_size) > headroom) {
+			m_parser.send("552", ssprintf("quota exceeded: %llu bytes "
+						"available", (unsigned long long)headroom));
+			return;
+		}
+
+		// do not write through a hard link to a blob in the dedup store
+		if (m_server.m_dedup && dst_exists && dst_stat.st_nlink > 1) {
+			auto blob = linked_blob(dst_dir, dst_name);
+			if (!unlinkat(dst_dir, dst_name.c_str(), 0))
+				release_blob(blob);
+		}
+		int dst_fd = openat(dst_dir, dst_name.c_str(),
+				O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644);
+		if (dst_fd < 0) {
+			m_parser.send("553", ssprintf("failed to open destination: %m"));
+			return;
+		}
+
+		off_t size = src_stat.st_size;
+		const char *method = nullptr;
+		std::string err;
+		try {
+			method = copy_file_content(src_fd, dst_fd, size,
+					COPY_PROGRESS_STEP, [this, size](off_t done) {
+						m_parser.send("150", ssprintf(
+								"copied %lld of %lld bytes",
+								(long long)done, (long long)size));
+						m_parser.flush();
+					});
+		} catch (WFTPError &exc) {
+			err = exc.what();
+		}
+		if (close(dst_fd) && err.empty())
+			err = ssprintf("close: %m");
+
+		note_changed(dst);
+		note_usage(dst, old_size);
+		if (!err.empty()) {
+			m_parser.send("550", "copy failed: " + err);
+			return;
+		}
+		wftp_log("client %s: copy `%s' to `%s' via %s, size=%lld",
+				get_peerinfo(), src.c_str(), dst.c_str(), method,
+				(long long)size);
+		m_parser.send("250", ssprintf("copied %lld bytes via %s",
+					(long long)size, method));
+	}
+
+	// SITE ZEROCOPY: report process-wide zerocopy send counters
+	void do_site_zerocopy() {
+		auto stats = SocketBase::get_zerocopy_stats();
+		m_parser.send_multiline("211", ssprintf("zerocopy is %s",
+					m_server.m_zerocopy ? "enabled" : "disabled"), {
+				ssprintf("zerocopy sends: %llu",
+						(unsigned long long)stats.nr_send),
+				ssprintf("bytes sent zerocopy: %llu",
+						(unsigned long long)stats.bytes_zerocopy),
+				ssprintf("bytes copied by kernel: %llu",
+						(unsigned long long)stats.bytes_copied),
+				ssprintf("bytes sent regularly: %llu",
+						(unsigned long long)stats.bytes_regular)},
+				"End");
+	}
+
+	// SITE TAR: send a directory tree as a ustar stream on one data
+	// connection; file bodies are sent by sendfile() unless in MODE Z; the
+	// dedup store is left out, like in listings
+	void do_site_tar() {
+		auto realpath = safe_realpath(m_cur_cmd.arg.empty() ?
+				"." : m_cur_cmd.arg);
+		if (!isdir(realpath)) {
+			m_parser.send("550", "not a directory");
+			return;
+		}
+		auto data_conn = get_data_conn(ssprintf("sending tar stream of %s",
+					m_cur_cmd.arg.c_str()));
+		data_conn->set_cork(true);
+		std::unique_ptr<ZSender> zsender;
+		if (m_mode_z)
+			zsender.reset(new ZSender(data_conn, m_z_level));
+		auto send = [&](const void *buf, size_t size) {
+			if (zsender)
+				zsender->send(buf, size);
+			else
+				data_conn->send(buf, size);
+			on_xfer(size);
+		};
+
+		// only needed to read file bodies for compression
+		std::unique_ptr<AdaptiveChunk> chunk;
+		int nr_file;
+		try {
+			nr_file = tar_write_tree(realpath, send,
+					[&](int fd, uint64_t size) -> uint64_t {
+						if (!zsender)
+							return send_file_sliced(*data_conn, fd, 0, size);
+						if (!chunk)
+							chunk.reset(new AdaptiveChunk(*data_conn, true));
+						uint64_t done = 0;
+						ssize_t s;
+						while (done < size && (s = pread(fd, chunk->data(),
+										std::min<uint64_t>(chunk->size(),
+											size - done), done)) > 0) {
+							send(chunk->data(), s);
+							chunk->update(s);
+							done += s;
+						}
+						return done;
+					}, m_server.m_dedup ?
+					m_server.m_dedup->dir() : std::string());
+			if (zsender)
+				zsender->finish();
+		} catch (WFTPError &exc) {
+			data_conn->close();
+			m_parser.send("451", ssprintf("tar stream aborted: %s",
+						exc.what()));
+			return;
+		}
+		data_conn->set_cork(false);
+		wftp_log("client %s: tar `%s', %d files, size=%llu",
+				get_peerinfo(), realpath.c_str(), nr_file,
+				(unsigned long long)m_xfer_size);
+		close_data_conn(data_conn, ssprintf("sent %d files",
+					nr_file).c_str());
+	}
+
+	// SITE UNTAR: receive a ustar stream and unpack it into a directory,
+	// replacing many STOR commands for small files
+	void do_site_untar() {
+		std::string dir = m_cur_cmd.arg.empty() ? "." : m_cur_cmd.arg;
+		auto realpath = safe_realpath(dir);
+		if (!isdir(realpath)) {
+			m_parser.send("550", "not a directory");
+			return;
+		}
+		std::unique_ptr<TarExtractor> extractor;
+		try {
+			int fd = open_beneath(dir, O_RDONLY | O_DIRECTORY);
+			if (fd < 0)
+				throw WFTPError("failed to open directory: %m");
+			extractor.reset(new TarExtractor(fd, m_server.m_dedup ?
+						m_server.m_dedup->dir() : std::string()));
+		} catch (WFTPError &exc) {
+			m_parser.send("550", exc.what());
+			return;
+		}
+		auto data_conn = get_data_conn("OK to receive tar stream");
+		std::unique_ptr<ZReceiver> zreceiver;
+		if (m_mode_z)
+			zreceiver.reset(new ZReceiver(data_conn));
+		TarExtractor &ext = *extractor;
+		std::string cur_path;
+		int64_t cur_old_size = -1;
+		bool over_quota = false;
+		TarParser parser(
+				[&](const TarEntry &entry) {
+					cur_path.clear();
+					if (m_server.m_usage && entry.type == TarEntry::REGULAR &&
+							tar_safe_path(entry.name)) {
+						cur_path = realpath + "/" + entry.name;
+						cur_old_size = usage_size(cur_path);
+						if (entry.size > quota_headroom(cur_path,
+									cur_old_size)) {
+							over_quota = true;
+							throw WFTPError("quota exceeded at `%s'",
+									entry.name.c_str());
+						}
+					}
+					ext.begin(entry);
+				},
+				[&ext](const char *buf, size_t size) { ext.write(buf, size); },
+				[&]() {
+					ext.end();
+					if (!cur_path.empty())
+						note_usage(cur_path, cur_old_size);
+				});
+		try {
+			AdaptiveChunk chunk(*data_conn, false);
+			for (; ; ) {
+				auto size = zreceiver ?
+					zreceiver->recv(chunk.data(), chunk.size()) :
+					data_conn->recv(chunk.data(), chunk.size());
+				if (size <= 0)
+					break;
+				on_xfer(size);
+				parser.feed(chunk.data(), size);
+				chunk.update(size);
+			}
+			if (!parser.finished())
+				throw WFTPError("tar stream truncated");
+			ext.finish();
+		} catch (WFTPError &exc) {
+			data_conn->close();
+			m_parser.send(over_quota ? "552" : "451",
+					ssprintf("failed to unpack: %s", exc.what()));
+			return;
+		}
+		note_changed(realpath);
+		wftp_log("client %s: untar into `%s', %d files, size=%llu",
+				get_peerinfo(), realpath.c_str(), ext.nr_file(),
+				(unsigned long long)m_xfer_size);
+		close_data_conn(data_conn, ssprintf("received %d files",
+					ext.nr_file()).c_str());
+	}
+
+	// SITE HASH <sha256> <path>: probe the dedup store before STOR; if the
+	// content is known, it is linked to the path and STOR could be skipped;
+	// refused when users log in, since the store is shared by all of them: a
+	// probe would reveal what others uploaded, and copy it without the data
+	void do_site_hash() {
+		auto dedup = m_server.m_dedup.get();
+		if (!dedup) {
+			m_parser.send("502", "deduplication disabled");
+			return;
+		}
+		if (m_server.m_auth) {
+			m_parser.send("502", "SITE HASH disabled with user logins");
+			return;
+		}
+		auto &arg = m_cur_cmd.arg;
+		auto sep = arg.find(' ');
+		std::string hash = arg.substr(0, sep);
+		for (auto &i: hash)
+			i = std::tolower(i);
+		if (sep == std::string::npos || !is_sha256_hex(hash)) {
+			m_parser.send("501", "usage: SITE HASH <sha256> <path>");
+			return;
+		}
+		std::string realpath, name;
+		int dir_fd = open_parent(arg.substr(sep + 1), realpath, name);
+		AutoFDCloser dir_closer(dir_fd);
+		struct stat st;
+		if (!fstatat(dir_fd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) &&
+				!S_ISREG(st.st_mode)) {
+			m_parser.send("553", "bad file path");
+			return;
+		}
+		auto old_size = usage_size(realpath);
+		struct stat blob_stat;
+		if (m_server.m_usage &&
+				!stat(dedup->blob_path(hash).c_str(), &blob_stat)) {
+			auto headroom = quota_headroom(realpath, old_size);
+			if (uint64_t(blob_stat.st_size) > headroom) {
+				m_parser.send("552", ssprintf("quota exceeded: %llu bytes "
+							"available", (unsigned long long)headroom));
+				return;
+			}
+		}
+		try {
+			auto old_blob = linked_blob(dir_fd, name);
+			if (!dedup->link_to(hash, dir_fd, name)) {
+				m_parser.send("550", "content unknown, STOR required");
+				return;
+			}
+			release_blob(old_blob);
+			if (m_server.m_atomic_stor) {
+				auto err = sync_dir(dir_fd);
+				if (!err.empty())
+					throw WFTPError("%s", err.c_str());
+			}
+		} catch (WFTPError &exc) {
+			m_parser.send("451", ssprintf("failed to link: %s", exc.what()));
+			return;
+		}
+		note_changed(realpath);
+		note_usage(realpath, old_size);
+		wftp_log("client %s: `%s' linked to %s", get_peerinfo(),
+				realpath.c_str(), hash.c_str());
+		m_parser.send("250", "content linked");
+	}
+
+	// SITE TAIL <path>: send a file by sendfile(), then keep the data
+	// connection open and send data appended to it as inotify reports them;
+	// ends when the file is truncated, removed or renamed, the client closes
+	// the data connection or sends another command, or nothing is appended
+	// for TAIL_IDLE_TIMEOUT seconds
+	void do_site_tail() {
+		if (m_mode_z) {
+			m_parser.send("504", "SITE TAIL is only supported in MODE S");
+			return;
+		}
+		std::string realpath;
+		int fd = open_client_file(m_cur_cmd.arg, O_RDONLY, realpath);
+		if (fd < 0) {
+			m_parser.send("550", "failed to open file");
+			return;
+		}
+		// watch the opened file rather than whatever is at its path now
+		int ifd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+		if (ifd < 0 || inotify_add_watch(ifd,
+					ssprintf("/proc/self/fd/%d", fd).c_str(),
+					IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF) < 0) {
+			m_parser.send("451", ssprintf("failed to watch file: %m"));
+			if (ifd >= 0)
+				close(ifd);
+			close(fd);
+			return;
+		}
+		auto cleanup = [&]() {
+			close(ifd);
+			close(fd);
+		};
+
+		std::shared_ptr<SocketBase> data_conn;
+		try {
+			data_conn = get_data_conn(ssprintf("following %s",
+						m_cur_cmd.arg.c_str()));
+		} catch (...) {
+			cleanup();
+			throw;
+		}
+
+		off_t offset = 0;
+		bool moved = false;
+		const char *reason = nullptr;
+		auto idle_since = std::chrono::steady_clock::now();
+		try {
+			for (; ; ) {
+				struct stat st;
+				if (fstat(fd, &st))
+					throw WFTPError("fstat: %m");
+				if (st.st_size < offset) {
+					reason = "file truncated";
+					break;
+				}
+				if (st.st_size > offset) {
+					TraceSpan span(SpanEvent::CHUNK_SEND);
+					auto done = send_file_sliced(*data_conn, fd, offset,
+							st.st_size - offset);
+					span.set_arg(done);
+					offset += done;
+					idle_since = std::chrono::steady_clock::now();
+					continue;
+				}
+				// everything written before removal or rename has been sent
+				if (!st.st_nlink || moved) {
+					reason = moved ? "file renamed" : "file removed";
+					break;
+				}
+
+				auto idle = std::chrono::duration_cast<
+					std::chrono::milliseconds>(
+							std::chrono::steady_clock::now() - idle_since);
+				int timeout = TAIL_IDLE_TIMEOUT * 1000 - idle.count();
+				if (timeout <= 0) {
+					reason = "idle timeout";
+					break;
+				}
+				if (m_parser.has_pending_line()) {
+					reason = "stopped by client";
+					break;
+				}
+				struct pollfd fds[3] = {
+					{ifd, POLLIN, 0},
+					{data_conn->get_socket_fd(), POLLIN | POLLRDHUP, 0},
+					{m_ctrl->get_socket_fd(), POLLIN, 0}
+				};
+				if (poll(fds, 3, timeout) < 0 && errno != EINTR)
+					throw WFTPError("poll: %m");
+				if (fds[1].revents) {
+					reason = "data connection closed by client";
+					break;
+				}
+				if (fds[2].revents) {
+					reason = "stopped by client";
+					break;
+				}
+				if (fds[0].revents) {
+					alignas(struct inotify_event) char buf[4096];
+					ssize_t size;
+					while ((size = read(ifd, buf, sizeof(buf))) > 0)
+						for (char *ptr = buf; ptr < buf + size; ) {
+							auto ev = reinterpret_cast<
+								struct inotify_event*>(ptr);
+							if (ev->mask & IN_MOVE_SELF)
+								moved = true;
+							ptr += sizeof(*ev) + ev->len;
+						}
+				}
+			}
+		} catch (WFTPError &exc) {
+			cleanup();
+			data_conn->close();
+			m_parser.send("451", ssprintf("tail aborted: %s", exc.what()));
+			return;
+		}
+		cleanup();
+		wftp_log("client %s: tail `%s' ended (%s), size=%lld",
+				get_peerinfo(), realpath.c_str(), reason,
+				(long long)offset);
+		close_data_conn(data_conn, ssprintf("sent %lld bytes, %s",
+					(long long)offset, reason).c_str());
+	}
+
+	// SITE WHO; with login required, only sessions of the same user are
+	// shown
+	void do_site_who() {
+		std::vector<std::string> lines;
+		auto now = SessionRegistry::now_ms();
+		for (auto &i: m_server.m_sessions->list())
+			if (!m_server.m_auth || i.user == m_user)
+				lines.push_back(format_session(i, now));
+		m_parser.send_multiline("211", ssprintf("%zu sessions",
+					lines.size()), lines, "End");
+	}
+
+	// SITE USAGE [path]: report usage of a directory subtree and of the
+	// user of this session, with their quotas and the room left
+	void do_site_usage() {
+		auto usage = m_server.m_usage.get();
+		if (!usage) {
+			m_parser.send("502", "usage accounting disabled");
+			return;
+		}
+		auto realpath = safe_realpath(m_cur_cmd.arg.empty() ?
+				"." : m_cur_cmd.arg);
+		if (!isdir(realpath)) {
+			m_parser.send("550", "not a directory");
+			return;
+		}
+		auto format = [](const UsageLedger::Usage &u, uint64_t quota) {
+			auto rst = ssprintf("%lld bytes in %lld files",
+					std::max<long long>(u.bytes, 0),
+					std::max<long long>(u.nr_file, 0));
+			if (quota != UINT64_MAX)
+				rst.append(ssprintf(", quota %llu bytes",
+							(unsigned long long)quota));
+			return rst;
+		};
+		uint64_t dir_quota, user_quota;
+		auto dir_usage = usage->dir_usage(realpath, dir_quota);
+		auto user_usage = usage->user_usage(m_user, user_quota);
+		auto headroom = usage->headroom(realpath, m_user);
+		m_parser.send_multiline("211", "usage of " + (m_cur_cmd.arg.empty() ?
+					m_working_dir : m_cur_cmd.arg), {
+				"directory: " + format(dir_usage, dir_quota),
+				"user " + m_user + ": " + format(user_usage, user_quota),
+				headroom == UINT64_MAX ? std::string("available: unlimited") :
+					ssprintf("available: %llu bytes",
+							(unsigned long long)headroom)},
+				"End");
 	}
 
 	void close_data_conn(std::shared_ptr<SocketBase> socket, const char *msg) {
-		socket->close();
+		{
+			TraceSpan span(SpanEvent::DATA_CLOSE);
+			socket->close();
+		}
 		m_parser.send("226", msg);
 	}
 
+	/*!
+	 * \brief confine the session to directory *home* relative to the server
+	 *		root, or to the server root if *home* is empty, and move to it
+	 * \return false with errno set on failure
+	 */
+	bool set_session_root(const std::string &home) {
+		int fd = open(m_server.m_rootdir.c_str(),
+				O_PATH | O_DIRECTORY | O_CLOEXEC);
+		if (fd >= 0 && !home.empty()) {
+			int home_fd = open_in_root(fd, home.c_str(),
+					O_PATH | O_DIRECTORY);
+			close(fd);
+			fd = home_fd;
+		}
+		if (fd < 0)
+			return false;
+		auto path = fd_path(fd);
+		if (path.empty()) {
+			close(fd);
+			errno = ENOENT;
+			return false;
+		}
+		if (m_root_fd >= 0)
+			close(m_root_fd);
+		m_root_fd = fd;
+		m_root = path;
+		if (m_root.back() != '/')
+			m_root.append("/");
+		m_working_dir = "/";
+		return true;
+	}
+
+	/*!
+	 * \brief open *fpath* from the client beneath the session root
+	 * \return the fd, or -1 with errno set
+	 */
+	int open_beneath(const std::string &fpath, int flags, mode_t mode = 0) {
+		if (fpath[0] == '/')
+			return open_in_root(m_root_fd, fpath.c_str(), flags, mode);
+		return open_in_root(m_root_fd,
+				(m_working_dir + "/" + fpath).c_str(), flags, mode);
+	}
+
+	/*!
+	 * \brief abort the command if *path* must be hidden from clients
+	 */
+	void check_visible(const std::string &path) {
+		// sanity check in case the root has been moved
+		if (path.compare(0, m_root.length() - 1, m_root, 0,
+					m_root.length() - 1) ||
+				(path.length() >= m_root.length() &&
+				 path[m_root.length() - 1] != '/')) {
+			m_parser.send("550", "bad file path");
+			throw AbortCurrentFTPCommand();
+		}
+		if (m_server.m_dedup) {
+			// blobs must not be modified through other paths
+			auto &dedup_dir = m_server.m_dedup->dir();
+			if ((path + "/").compare(0, dedup_dir.length(), dedup_dir) == 0) {
+				m_parser.send("550", "bad file path");
+				throw AbortCurrentFTPCommand();
+			}
+		}
+	}
+
+	/*!
+	 * \brief open an existing regular file for a command; the fd is used
+	 *		directly, so the file could not be swapped between resolution and
+	 *		use
+	 * \param realpath set to the real path of the file
+	 * \return the fd, or -1 if it could not be opened
+	 */
+	int open_client_file(const std::string &fpath, int flags,
+			std::string &realpath) {
+		TraceSpan span(SpanEvent::REALPATH);
+		int fd = open_beneath(fpath, flags);
+		if (fd < 0)
+			return -1;
+		struct stat st;
+		if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+				(realpath = fd_path(fd)).empty()) {
+			close(fd);
+			return -1;
+		}
+		try {
+			check_visible(realpath);
+		} catch (...) {
+			close(fd);
+			throw;
+		}
+		return fd;
+	}
+
+	/*!
+	 * \brief create or truncate *fpath* for writing, which has been checked
+	 *		by safe_realpath()
+	 */
+	FILE* open_client_file_write(const std::string &fpath) {
+		int fd = open_beneath(fpath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			return nullptr;
+		struct stat st;
+		FILE *fout = nullptr;
+		if (!fstat(fd, &st) && S_ISREG(st.st_mode))
+			fout = fdopen(fd, "wb");
+		if (!fout)
+			close(fd);
+		return fout;
+	}
+
+	/*!
+	 * \brief resolve a path from the client to the real path, confined to
+	 *		the session root by the kernel
+	 *
+	 * \param allow_nonexist_file only the parent directory needs to exist,
+	 *		and the last component is appended to its real path
+	 */
 	std::string safe_realpath(const std::string &fpath,
 			bool allow_nonexist_file = false) {
-		auto &rootdir = m_server.m_rootdir;
-		std::string dirname, basename, realpath_query;
+		std::string ret;
 		if (allow_nonexist_file) {
-			basename = fpath;
-			for (int i = fpath.length() - 1; i >= 0; i --)
-				if (fpath[i] == '/') {
-					dirname.assign(fpath.c_str(), i);
-					basename.assign(fpath.c_str() + i);
-					break;
-				}
-			realpath_query = dirname;
-		} else
-			realpath_query = fpath;
+			std::string name;
+			close(open_parent(fpath, ret, name));
+			return ret;
+		}
+		TraceSpan span(SpanEvent::REALPATH);
+		int fd = open_beneath(fpath.empty() ? "." : fpath, O_PATH);
+		if (fd >= 0) {
+			ret = fd_path(fd);
+			close(fd);
+		}
+		if (ret.empty()) {
+			m_parser.send("550", "bad file path");
+			throw AbortCurrentFTPCommand();
+		}
+		check_visible(ret);
+		return ret;
+	}
 
-		char *rst;
-		if (realpath_query[0] == '/')
-			rst = realpath((rootdir + realpath_query).c_str(), nullptr);
-		else
-			rst = realpath((rootdir + m_working_dir + "/" + realpath_query)
-					.c_str(), nullptr);
-		if (!rst) {
+	/*!
+	 * \brief open the parent directory of a path from the client, so that
+	 *		its last component is created, replaced or removed by the *at()
+	 *		syscalls and could not be redirected after being checked
+	 *
+	 * \param realpath set to the real path of *fpath*, which only serves as
+	 *		the key of the metadata index and the usage ledger
+	 * \param name set to the last component of *fpath*
+	 * \return fd of the directory, to be closed by the caller
+	 */
+	int open_parent(const std::string &fpath, std::string &realpath,
+			std::string &name) {
+		TraceSpan span(SpanEvent::REALPATH);
+		std::string query;
+		auto end = fpath.find_last_not_of('/');
+		auto sep = end == std::string::npos ? end : fpath.rfind('/', end);
+		if (end != std::string::npos) {
+			name.assign(fpath, sep + 1, end - sep);
+			query.assign(fpath, 0, sep == std::string::npos ? 0 :
+					std::max<size_t>(sep, 1));
+		}
+		if (name.empty() || name == "." || name == "..") {
 			m_parser.send("550", "bad file path");
 			throw AbortCurrentFTPCommand();
 		}
-		std::string ret(rst);
-		free(rst);
-		if (ret.substr(0, rootdir.length()) != rootdir &&
-				ret != rootdir.substr(0, rootdir.length() - 1)) {
+		if (query.empty())
+			query = ".";
+
+		int fd = open_beneath(query, O_RDONLY | O_DIRECTORY);
+		if (fd >= 0)
+			realpath = fd_path(fd);
+		if (realpath.empty()) {
+			if (fd >= 0)
+				close(fd);
 			m_parser.send("550", "bad file path");
 			throw AbortCurrentFTPCommand();
 		}
-		if (allow_nonexist_file) {
-			if (ret.back() != '/')
-				ret.append("/");
-			ret.append(basename);
+		try {
+			check_visible(realpath);
+			if (realpath.back() != '/')
+				realpath.append("/");
+			realpath.append(name);
+			// the target itself, e.g. of MKD or STOR, may be hidden
+			check_visible(realpath);
+		} catch (...) {
+			close(fd);
+			throw;
 		}
-		return ret;
+		return fd;
 	}
 
 	std::shared_ptr<SocketBase> get_data_conn(const std::string &msg) {
-		if (!m_pasv_mode) {
-			m_parser.send("425", "use PASV first");
+		if (!m_pasv_mode && !m_port_mode) {
+			m_parser.send("425", "use PASV or PORT first");
 			throw AbortCurrentFTPCommand();
 		}
-		auto rst = m_data_srv->accept();
-		m_data_srv.reset();
-		m_pasv_mode = false;
+		if (m_server.m_tls_required && !m_prot_private) {
+			m_parser.send("521", "data connections must be encrypted, "
+					"use PROT P");
+			throw AbortCurrentFTPCommand();
+		}
+		m_parser.flush();
+		TraceSpan span(SpanEvent::DATA_CONN);
+		std::shared_ptr<SocketBase> rst;
+		if (m_pasv_mode) {
+			rst = m_data_srv->accept();
+			m_data_srv.reset();
+			m_pasv_mode = false;
+			if (!rst) {
+				m_parser.send("425", "timeout waiting for data connection");
+				throw AbortCurrentFTPCommand();
+			}
+		} else {
+			m_port_mode = false;
+			try {
+				rst = SocketBase::connect(m_port_host.c_str(),
+						m_port_service.c_str(),
+						m_server.m_profile[int(SocketRole::ACTIVE_DATA)]);
+			} catch (WFTPError &exc) {
+				m_parser.send("425", exc.what());
+				throw AbortCurrentFTPCommand();
+			}
+		}
+		if (m_server.m_zerocopy && !rst->enable_zerocopy())
+			wftp_log("failed to enable zerocopy: %m");
 		m_parser.send("125", msg);
+		m_parser.flush();
 		rst->enable_timeout();
+		if (m_prot_private) {
+			// the server side of TLS on data connections too (RFC 4217)
+			try {
+				m_server.m_tls->accept(*rst);
+			} catch (WFTPError &exc) {
+				m_parser.send("425", exc.what());
+				throw AbortCurrentFTPCommand();
+			}
+		}
 		return rst;
 	}
 
@@ -286,8 +1823,12 @@ class WFTPServer::ClientHandler {
 		typedef void (ClientHandler::*handler_ptr_t)();
 		static const std::map<std::string, handler_ptr_t> HANDLER_MAP = {
 			{"FEAT", &ClientHandler::do_feat},
+			{"AUTH", &ClientHandler::do_auth},
+			{"PBSZ", &ClientHandler::do_pbsz},
+			{"PROT", &ClientHandler::do_prot},
 			{"PWD", &ClientHandler::do_pwd},
 			{"PASV", &ClientHandler::do_pasv},
+			{"PORT", &ClientHandler::do_port},
 			{"QUIT", &ClientHandler::do_quit},
 			{"USER", &ClientHandler::do_user},
 			{"PASS", &ClientHandler::do_pass},
@@ -295,6 +1836,8 @@ class WFTPServer::ClientHandler {
 			{"LIST", &ClientHandler::do_list},
 			{"NLST", &ClientHandler::do_list},
 			{"TYPE", &ClientHandler::do_type},
+			{"MODE", &ClientHandler::do_mode},
+			{"OPTS", &ClientHandler::do_opts},
 			{"CWD", &ClientHandler::do_cwd},
 			{"SIZE", &ClientHandler::do_size},
 			{"RETR", &ClientHandler::do_retr},
@@ -303,12 +1846,41 @@ class WFTPServer::ClientHandler {
 			{"DELE", &ClientHandler::do_remove},
 			{"RMD", &ClientHandler::do_remove},
 			{"MKD", &ClientHandler::do_mkd},
+			{"SITE", &ClientHandler::do_site},
+		};
+		// commands allowed before login if it is required
+		static const std::set<std::string> PRE_LOGIN_CMDS = {
+			"FEAT", "QUIT", "USER", "PASS", "SYST", "AUTH", "PBSZ", "PROT"
+		};
+		// commands allowed before AUTH TLS if it is required
+		static const std::set<std::string> PRE_TLS_CMDS = {
+			"FEAT", "QUIT", "SYST", "AUTH"
 		};
 		m_cur_cmd = m_parser.recv();
+		m_xfer_size = 0;
+		// passwords are not recorded if they are real
+		bool secret = m_server.m_auth && m_cur_cmd.cmd == "PASS";
+		if (TrafficCapture::enabled()) {
+			m_capture_cmd = m_cur_cmd;
+			if (secret)
+				m_capture_cmd.arg = "****";
+			m_cur_cmd_start = TrafficCapture::now_us();
+		}
 		wftp_log("client %s: %s %s", get_peerinfo(),
-				m_cur_cmd.cmd.c_str(), m_cur_cmd.arg.c_str());
+				m_cur_cmd.cmd.c_str(), secret ? "****" : m_cur_cmd.arg.c_str());
+		if (m_session)
+			m_session->set_command(m_cur_cmd.cmd + " " +
+					(secret ? "****" : m_cur_cmd.arg));
+		TraceSpan span(SpanEvent::CMD, m_cur_cmd.cmd.c_str());
 		auto hdl = HANDLER_MAP.find(m_cur_cmd.cmd);
-		if (hdl != HANDLER_MAP.end())
+		if (m_server.m_tls_required && !m_tls &&
+				hdl != HANDLER_MAP.end() && !PRE_TLS_CMDS.count(m_cur_cmd.cmd))
+			m_parser.send("534", "TLS required, use AUTH TLS");
+		else if (m_server.m_auth && !m_logged_in &&
+				hdl != HANDLER_MAP.end() &&
+				!PRE_LOGIN_CMDS.count(m_cur_cmd.cmd))
+			m_parser.send("530", "please login with USER and PASS");
+		else if (hdl != HANDLER_MAP.end())
 			(this->*(hdl->second))();
 		else {
 			wftp_log("unknown command: %s", m_cur_cmd.cmd.c_str());
@@ -325,23 +1897,51 @@ class WFTPServer::ClientHandler {
 			m_cli_id(cli_id)
 		{
 			m_ctrl->enable_timeout();
+			m_parser.set_coalesce(true);
 			wftp_log("new client: %s [as %s]", m_ctrl->get_peerinfo(),
 					get_peerinfo());
 		}
 
 		void run() {
+			SpanTracer::set_session(m_cli_id);
+			TraceSpan span(SpanEvent::SESSION);
 			try {
+				if (!set_session_root({})) {
+					wftp_log("client %s: failed to open root: %m",
+							get_peerinfo());
+					m_parser.send("421", "service not available");
+					m_parser.flush();
+					return;
+				}
+				if (m_server.m_sessions) {
+					m_session = m_server.m_sessions->attach(m_cli_id,
+							m_ctrl->get_peerinfo(),
+							m_ctrl->get_socket_fd());
+					if (m_session)
+						m_session->set_user(m_user);
+				}
 				m_parser.send("220", WFTP_NAME);
 				for (; ;) {
 					try {
 						handle_cmd();
 					} catch (AbortCurrentFTPCommand&) {
 					}
+					if (TrafficCapture::enabled())
+						TrafficCapture::record(m_cur_cmd_start, m_cli_id,
+								m_parser.last_code(), m_xfer_size,
+								m_working_dir, m_capture_cmd);
 				}
 			} catch (ClientExit&) {
 			}
 		}
 
+		~ClientHandler() {
+			if (m_session)
+				m_server.m_sessions->detach(m_session);
+			if (m_root_fd >= 0)
+				close(m_root_fd);
+		}
+
 		const char *get_peerinfo() const {
 			if (m_cli_id >= 0) {
 				static thread_local char buf[20];
@@ -354,6 +1954,8 @@ class WFTPServer::ClientHandler {
 
 WFTPServer::WFTPServer() {
 	set_rootdir(".");
+	if (pipe2(m_stop_pipe, O_CLOEXEC))
+		throw WFTPError("pipe: %m");
 }
 
 void WFTPServer::set_rootdir(const char *dir) {
@@ -367,6 +1969,205 @@ void WFTPServer::set_rootdir(const char *dir) {
 		m_rootdir.append("/");
 }
 
+void WFTPServer::set_passwd_path(const std::string &path) {
+	m_auth = std::make_shared<PasswdFileAuth>(path);
+}
+
+void WFTPServer::set_tls_cert(const std::string &cert_path,
+		const std::string &key_path) {
+	m_tls = std::make_shared<TLSContext>(cert_path, key_path);
+}
+
+void WFTPServer::set_dedup_dir(const std::string &dir) {
+	m_dedup = std::make_shared<DedupStore>(dir);
+}
+
+void WFTPServer::request_stop() {
+	char c = 0;
+	if (write(m_stop_pipe[1], &c, 1)) {
+		// nothing to do; write failure means a stop is already pending
+	}
+}
+
+static int open_unix_socket(const std::string &path, bool listen_mode) {
+	struct sockaddr_un addr;
+	if (path.length() >= sizeof(addr.sun_path))
+		throw WFTPError("unix socket path too long: %s", path.c_str());
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path.c_str());
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		throw WFTPError("failed to create unix socket: %m");
+	auto addr_ptr = reinterpret_cast<struct sockaddr*>(&addr);
+	if (listen_mode) {
+		unlink(path.c_str());
+		if (bind(fd, addr_ptr, sizeof(addr)) || listen(fd, 1)) {
+			close(fd);
+			throw WFTPError("failed to listen on %s: %m", path.c_str());
+		}
+	} else if (connect(fd, addr_ptr, sizeof(addr))) {
+		close(fd);
+		throw WFTPError("failed to connect to %s: %m", path.c_str());
+	}
+	return fd;
+}
+
+std::shared_ptr<ServerSocket> WFTPServer::takeover_listen_socket() {
+	int fd = open_unix_socket(m_takeover_path, false);
+	try {
+		auto rst = ServerSocket::takeover(fd,
+				m_profile[int(SocketRole::CONTROL)]);
+		close(fd);
+		return rst;
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+}
+
+bool WFTPServer::handoff_once(std::shared_ptr<ServerSocket> socket,
+		int unix_fd) {
+	int fd = accept4(unix_fd, nullptr, nullptr, SOCK_CLOEXEC);
+	if (fd < 0) {
+		if (errno != EINTR && errno != EAGAIN)
+			throw WFTPError("handoff socket: accept: %m");
+		return false;
+	}
+	try {
+		socket->handoff(fd);
+		close(fd);
+		wftp_log("listening socket handed off to new process");
+		request_stop();
+		return true;
+	} catch (std::exception &exc) {
+		wftp_log("handoff failed: %s", exc.what());
+		close(fd);
+		return false;
+	}
+}
+
+void WFTPServer::handoff_thread(std::shared_ptr<ServerSocket> socket,
+		int unix_fd) {
+	try {
+		while (!handoff_once(socket, unix_fd));
+	} catch (std::exception &exc) {
+		wftp_log("%s", exc.what());
+	}
+	close(unix_fd);
+}
+
+static int open_admin_socket(const std::string &path) {
+	// only the owner of the server may control sessions; the mode is set at
+	// bind() by the umask, since a chmod() afterwards would leave a window
+	// for others to connect
+	auto old_mask = umask(077);
+	int fd;
+	try {
+		fd = open_unix_socket(path, true);
+	} catch (...) {
+		umask(old_mask);
+		throw;
+	}
+	umask(old_mask);
+	return fd;
+}
+
+/*!
+ * \brief parse a transfer rate like `100K' or `2M' in bytes per second
+ */
+static bool parse_rate(const std::string &str, uint64_t &rate) {
+	char *end;
+	unsigned long long val = strtoull(str.c_str(), &end, 10);
+	if (end == str.c_str())
+		return false;
+	int shift = 0;
+	switch (*end) {
+		case 0:
+			break;
+		case 'k': case 'K':
+			shift = 10;
+			break;
+		case 'm': case 'M':
+			shift = 20;
+			break;
+		case 'g': case 'G':
+			shift = 30;
+			break;
+		default:
+			return false;
+	}
+	if (*end && end[1])
+		return false;
+	rate = uint64_t(val) << shift;
+	return true;
+}
+
+std::string WFTPServer::admin_command(const std::string &line) {
+	std::istringstream sin(line);
+	std::string cmd;
+	long long id;
+	sin >> cmd;
+	if (cmd == "who") {
+		std::string rst;
+		auto now = SessionRegistry::now_ms();
+		for (auto &i: m_sessions->list())
+			rst.append(format_session(i, now) + "\n");
+		return rst;
+	}
+	if (cmd == "kill" && (sin >> id)) {
+		if (!m_sessions->kill(id))
+			return ssprintf("failed to kill session %lld: %m\n", id);
+		wftp_log("admin: killed session %lld", id);
+		return "ok\n";
+	}
+	std::string rate_str;
+	uint64_t rate;
+	if (cmd == "throttle" && (sin >> id >> rate_str) &&
+			parse_rate(rate_str, rate)) {
+		if (!m_sessions->throttle(id, rate))
+			return ssprintf("failed to throttle session %lld: %m\n", id);
+		wftp_log("admin: session %lld limited to %llu bytes/s", id,
+				(unsigned long long)rate);
+		return "ok\n";
+	}
+	return "commands: who, kill <id>, throttle <id> <bytes/s, 0 for "
+		"unlimited>\n";
+}
+
+void WFTPServer::admin_once(int unix_fd) {
+	int fd = accept4(unix_fd, nullptr, nullptr, SOCK_CLOEXEC);
+	if (fd < 0) {
+		if (errno != EINTR && errno != EAGAIN)
+			wftp_log("admin socket: accept: %m");
+		return;
+	}
+	// a stuck admin client must not block the supervisor
+	struct timeval timeout = {ADMIN_TIMEOUT, 0};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	std::string line;
+	char buf[256];
+	ssize_t size;
+	while (line.find('\n') == std::string::npos && line.size() < 1024 &&
+			(size = read(fd, buf, sizeof(buf))) > 0)
+		line.append(buf, size);
+	line.erase(std::min(line.find('\n'), line.size()));
+	auto reply = admin_command(line);
+	for (size_t done = 0; done < reply.size(); ) {
+		size = write(fd, reply.data() + done, reply.size() - done);
+		if (size <= 0)
+			break;
+		done += size;
+	}
+	close(fd);
+}
+
+void WFTPServer::admin_thread(int unix_fd) {
+	for (; ; )
+		admin_once(unix_fd);
+}
+
 void WFTPServer::worker_thread(ClientHandler *client) {
 	try {
 		try {
@@ -377,24 +2178,211 @@ void WFTPServer::worker_thread(ClientHandler *client) {
 					client->get_peerinfo(), exc.what());
 		}
 		delete client;
+		SpanTracer::flush();
 	}
 	catch (std::exception &exc) {
 		wftp_log("unexpected exception: %s", exc.what());
 	} catch (...) {
 		wftp_log("totally unexpected exception ...");
 	}
+	m_nr_session --;
+}
+
+void WFTPServer::accept_loop(std::shared_ptr<ServerSocket> socket,
+		int cli_id, int cli_id_step) {
+	// created here to run its thread in the process serving clients
+	if (m_meta_budget)
+		m_meta_index = std::make_shared<MetaIndex>(m_rootdir, m_meta_budget);
+	if (!m_usage_snapshot_path.empty() || !m_quota_path.empty())
+		m_usage = std::make_shared<UsageLedger>(m_rootdir,
+				m_dedup ? m_dedup->dir() : std::string(),
+				m_usage_snapshot_path, m_quota_path, m_auth != nullptr);
+	while (socket->wait_accept(m_stop_pipe[0])) {
+		auto conn = socket->accept();
+		if (!conn)
+			continue;
+		ClientHandler *client = new ClientHandler(*this, conn, cli_id);
+		cli_id += cli_id_step;
+		m_nr_session ++;
+		std::thread sub(&WFTPServer::worker_thread, this, client);
+		sub.detach();
+	}
+
+	socket->close();
+	wftp_log("stopped accepting; waiting for %d sessions to finish",
+			m_nr_session.load());
+	while (m_nr_session)
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	m_meta_index.reset();
+	m_usage.reset();
+	wftp_log("all sessions finished");
+}
+
+void WFTPServer::supervise(std::shared_ptr<ServerSocket> socket) {
+	cpu_set_t allowed;
+	std::vector<int> cpus;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed))
+		throw WFTPError("sched_getaffinity: %m");
+	for (int i = 0; i < CPU_SETSIZE; i ++)
+		if (CPU_ISSET(i, &allowed))
+			cpus.push_back(i);
+
+	int handoff_fd = -1;
+	if (!m_handoff_path.empty()) {
+		handoff_fd = open_unix_socket(m_handoff_path, true);
+		fcntl(handoff_fd, F_SETFL, O_NONBLOCK);
+	}
+	// served here rather than by a thread, which could hold locks at fork
+	int admin_fd = -1;
+	if (!m_admin_path.empty()) {
+		admin_fd = open_admin_socket(m_admin_path);
+		fcntl(admin_fd, F_SETFL, O_NONBLOCK);
+	}
+
+	std::vector<pid_t> workers(m_nr_worker, -1);
+	auto spawn = [&](int idx) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			wftp_log("failed to fork worker %d: %m", idx);
+			return;
+		}
+		if (pid) {
+			workers[idx] = pid;
+			return;
+		}
+
+		// in worker process
+		int status = 0;
+		try {
+			if (handoff_fd >= 0)
+				close(handoff_fd);
+			if (admin_fd >= 0)
+				close(admin_fd);
+			close(m_stop_pipe[0]);
+			close(m_stop_pipe[1]);
+			if (pipe2(m_stop_pipe, O_CLOEXEC))
+				throw WFTPError("pipe: %m");
+
+			cpu_set_t cpu;
+			CPU_ZERO(&cpu);
+			CPU_SET(cpus[idx % cpus.size()], &cpu);
+			if (sched_setaffinity(0, sizeof(cpu), &cpu))
+				wftp_log("worker %d: sched_setaffinity: %m", idx);
+			wftp_log("worker %d started, pid=%d, cpu=%d", idx, getpid(),
+					cpus[idx % cpus.size()]);
+			accept_loop(socket, idx, m_nr_worker);
+		} catch (std::exception &exc) {
+			wftp_log("worker %d: %s", idx, exc.what());
+			status = 1;
+		}
+		exit(status);
+	};
+
+	for (int i = 0; i < m_nr_worker; i ++)
+		spawn(i);
+
+	for (bool stop = false; !stop; ) {
+		// a negative fd is ignored by poll()
+		struct pollfd pfd[3];
+		pfd[0].fd = m_stop_pipe[0];
+		pfd[1].fd = handoff_fd;
+		pfd[2].fd = admin_fd;
+		for (auto &i: pfd) {
+			i.events = POLLIN;
+			i.revents = 0;
+		}
+		if (poll(pfd, 3, WORKER_CHECK_INTERVAL) < 0 && errno != EINTR)
+			throw WFTPError("poll: %m");
+		if (handoff_fd >= 0 && pfd[1].revents &&
+				handoff_once(socket, handoff_fd)) {
+			close(handoff_fd);
+			handoff_fd = -1;
+		}
+		if (pfd[2].revents)
+			admin_once(admin_fd);
+		stop = pfd[0].revents;
+
+		int status;
+		pid_t pid;
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			int idx = std::find(workers.begin(), workers.end(), pid) -
+				workers.begin();
+			if (idx == m_nr_worker)
+				continue;
+			workers[idx] = -1;
+			m_sessions->detach_process(pid);
+			if (WIFEXITED(status) && !WEXITSTATUS(status)) {
+				wftp_log("worker %d exited", idx);
+				continue;
+			}
+			wftp_log("worker %d (pid %d) died with status 0x%x",
+					idx, pid, status);
+			if (!stop)
+				spawn(idx);
+		}
+	}
+
+	if (handoff_fd >= 0)
+		close(handoff_fd);
+	if (admin_fd >= 0)
+		close(admin_fd);
+	socket->close();
+	for (auto i: workers)
+		if (i > 0)
+			kill(i, SIGUSR1);
+	wftp_log("waiting for workers to finish their sessions");
+	for (auto i: workers)
+		if (i > 0)
+			waitpid(i, nullptr, 0);
+	wftp_log("all workers exited");
 }
 
 void WFTPServer::serve_forever() {
-	ServerSocket socket(m_port);
+	// the ledger lives in the process serving clients, and workers would
+	// each have their own
+	if (m_nr_worker && (!m_usage_snapshot_path.empty() ||
+				!m_quota_path.empty()))
+		throw WFTPError("usage accounting is not supported with worker "
+				"processes");
+	if (m_tls_required && !m_tls)
+		throw WFTPError("TLS is required but no certificate is given");
+	{
+		// paths from clients are resolved by openat2(), since Linux 5.6
+		int fd = open_in_root(AT_FDCWD, ".", O_PATH);
+		if (fd < 0)
+			throw WFTPError("openat2: %m");
+		close(fd);
+	}
+	std::shared_ptr<ServerSocket> socket;
+	if (m_takeover_path.empty())
+		// a short backlog drops connections of login storms, whose
+		// clients then wait for a banner that never comes
+		socket = std::make_shared<ServerSocket>(m_port, SOMAXCONN,
+				m_profile[int(SocketRole::CONTROL)]);
+	else
+		socket = takeover_listen_socket();
+	// the socket may be shared with a process handing it off or taking it
+	// over, so accept() must not block after wait_accept()
+	socket->set_nonblocking();
 	wftp_log("listening on %s:%d, rootdir=%s ...",
-			SocketBase::format_addr(socket.local_addr()).c_str(),
-			socket.local_port(), m_rootdir.c_str());
-	for (int cli_id = 0; ; cli_id ++) {
-		ClientHandler *client = new ClientHandler(*this, socket.accept(), cli_id);
-		std::thread sub(worker_thread, client);
-		sub.detach();
+			SocketBase::format_addr(socket->local_addr()).c_str(),
+			socket->local_port(), m_rootdir.c_str());
+	m_sessions = std::make_shared<SessionRegistry>(SESSION_TABLE_SIZE);
+
+	if (m_nr_worker) {
+		supervise(socket);
+		return;
+	}
+
+	if (!m_handoff_path.empty()) {
+		int fd = open_unix_socket(m_handoff_path, true);
+		std::thread(&WFTPServer::handoff_thread, this, socket, fd).detach();
+	}
+	if (!m_admin_path.empty()) {
+		int fd = open_admin_socket(m_admin_path);
+		std::thread(&WFTPServer::admin_thread, this, fd).detach();
 	}
+	accept_loop(socket, 0, 1);
 }
 
 
@@ -4,16 +4,93 @@
  * $Author: jiakai <jia.kai66@gmail.com>
  */
 
+#include "socket.hh"
+
+#include <atomic>
+#include <memory>
 #include <string>
 
+class Authenticator;
+class DedupStore;
+class MetaIndex;
+class SessionRegistry;
+class TLSContext;
+class UsageLedger;
+
+/*!
+ * role of a socket, used to choose its SocketProfile
+ */
+enum class SocketRole {
+	CONTROL, PASV_DATA, ACTIVE_DATA, NR_ROLE
+};
+
 class WFTPServer {
 	int m_port = 21;
 	std::string m_rootdir;
+	SocketProfile m_profile[int(SocketRole::NR_ROLE)];
+	bool m_zerocopy = false;
+	bool m_atomic_stor = false;
+	std::shared_ptr<DedupStore> m_dedup;
+	size_t m_meta_budget = 0;
+	std::shared_ptr<MetaIndex> m_meta_index;
+	std::string m_usage_snapshot_path, m_quota_path;
+	std::shared_ptr<UsageLedger> m_usage;
+	std::shared_ptr<Authenticator> m_auth;
+	std::shared_ptr<TLSContext> m_tls;
+	bool m_tls_required = false;
+
+	std::shared_ptr<SessionRegistry> m_sessions;
+	std::string m_admin_path;
+
+	int m_nr_worker = 0;
+	std::string m_handoff_path, m_takeover_path;
+	int m_stop_pipe[2];
+	std::atomic<int> m_nr_session{0};
 
 	class ClientHandler;
 	friend class ClientHandler;
 
-	static void worker_thread(ClientHandler *client);
+	void worker_thread(ClientHandler *client);
+
+	/*!
+	 * \brief wait for a new process to connect to m_handoff_path and pass
+	 *		*socket* to it, then stop accepting
+	 */
+	void handoff_thread(std::shared_ptr<ServerSocket> socket, int unix_fd);
+
+	/*!
+	 * \brief accept a pending handoff request on *unix_fd*
+	 * \return whether the socket has been handed off
+	 */
+	bool handoff_once(std::shared_ptr<ServerSocket> socket, int unix_fd);
+
+	/*!
+	 * \brief serve clients until request_stop() and wait for sessions to
+	 *		finish
+	 */
+	void accept_loop(std::shared_ptr<ServerSocket> socket,
+			int cli_id, int cli_id_step);
+
+	/*!
+	 * \brief prefork mode: run m_nr_worker worker processes sharing
+	 *		*socket*, each pinned to a CPU, and restart them if they crash
+	 */
+	void supervise(std::shared_ptr<ServerSocket> socket);
+
+	std::shared_ptr<ServerSocket> takeover_listen_socket();
+
+	/*!
+	 * \brief serve one connection on the admin socket *unix_fd*
+	 */
+	void admin_once(int unix_fd);
+
+	void admin_thread(int unix_fd);
+
+	/*!
+	 * \brief run a command from the admin socket
+	 * \return the reply
+	 */
+	std::string admin_command(const std::string &line);
 
 	public:
 		WFTPServer();
@@ -24,6 +101,126 @@ class WFTPServer {
 			m_port = port;
 		}
 
+		/*!
+		 * \brief update socket options used for given role
+		 * \param spec see SocketProfile::update
+		 */
+		void set_socket_profile(SocketRole role, const std::string &spec) {
+			auto &profile = m_profile[int(role)];
+			profile.update(spec);
+			profile.check();
+		}
+
+		/*!
+		 * \brief use MSG_ZEROCOPY for buffered sends on data connections
+		 */
+		void set_zerocopy(bool enable) {
+			m_zerocopy = enable;
+		}
+
+		/*!
+		 * \brief make STOR write to a hidden temp file, which is synced
+		 *		and renamed to the target when the upload completes, so
+		 *		readers never see partial files and uploads survive crashes
+		 */
+		void set_atomic_stor(bool enable) {
+			m_atomic_stor = enable;
+		}
+
+		/*!
+		 * \brief deduplicate uploaded files by their content in the store
+		 *		at *dir*, which must be on the same filesystem as the root;
+		 *		it is hidden from clients if under the root
+		 */
+		void set_dedup_dir(const std::string &dir);
+
+		/*!
+		 * \brief answer SIZE, CWD and directory listings from an
+		 *		inotify-driven metadata index using at most about *budget*
+		 *		bytes; 0 to disable
+		 */
+		void set_meta_index_budget(size_t budget) {
+			m_meta_budget = budget;
+		}
+
+		/*!
+		 * \brief require login with credentials in password file *path*
+		 *		(see PasswdFileAuth), instead of accepting anyone
+		 */
+		void set_passwd_path(const std::string &path);
+
+		/*!
+		 * \brief support AUTH TLS with the certificate and private key in
+		 *		PEM files
+		 */
+		void set_tls_cert(const std::string &cert_path,
+				const std::string &key_path);
+
+		/*!
+		 * \brief refuse commands before AUTH TLS, and data connections
+		 *		before PROT P
+		 */
+		void set_tls_required(bool required) {
+			m_tls_required = required;
+		}
+
+		/*!
+		 * \brief account disk usage by directory and user, saving the
+		 *		ledger to *path* periodically and loading it on start
+		 */
+		void set_usage_snapshot_path(const std::string &path) {
+			m_usage_snapshot_path = path;
+		}
+
+		/*!
+		 * \brief enforce quotas in file *path* (see UsageLedger); enables
+		 *		usage accounting
+		 */
+		void set_quota_path(const std::string &path) {
+			m_quota_path = path;
+		}
+
+		/*!
+		 * \brief serve in *nr* forked worker processes, each pinned to a
+		 *		CPU; 0 to serve in this process
+		 */
+		void set_nr_worker(int nr) {
+			m_nr_worker = nr;
+		}
+
+		/*!
+		 * \brief listen on a unix socket at *path*; a process started with
+		 *		set_takeover_path(path) would take over the listening socket
+		 */
+		void set_handoff_path(const std::string &path) {
+			m_handoff_path = path;
+		}
+
+		/*!
+		 * \brief inherit the listening socket from the process listening on
+		 *		unix socket *path* (see set_handoff_path()), instead of
+		 *		creating a new one
+		 */
+		void set_takeover_path(const std::string &path) {
+			m_takeover_path = path;
+		}
+
+		/*!
+		 * \brief accept commands to list, kill and throttle sessions on a
+		 *		unix socket at *path*
+		 */
+		void set_admin_path(const std::string &path) {
+			m_admin_path = path;
+		}
+
+		/*!
+		 * \brief stop accepting new connections; serve_forever() returns
+		 *		after existing sessions finish
+		 *
+		 * this function is async-signal-safe
+		 */
+		void request_stop();
+
 		void serve_forever();
 };
 
@@ -0,0 +1,51 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+# $File: trace2chrome.py
+# $Date: Mon Oct 19 12:02:47 2026 +0800
+# $Author: jiakai <jia.kai66@gmail.com>
+#
+# convert a span trace file written by "wftp_server -t" to Chrome trace event
+# format, which could be loaded in chrome://tracing or ui.perfetto.dev;
+# each session is shown as a thread of the server (worker) process
+#
+# usage: ./trace2chrome.py trace_file > trace.json
+
+import json
+import struct
+import sys
+
+MAGIC = b'WFTPTRC1'
+RECORD = struct.Struct('=QQQIHH8s')
+
+# must match SpanEvent in src/trace.hh
+EVENT_NAMES = ['session', 'cmd', 'realpath', 'data_conn', 'file_open',
+               'chunk_read', 'chunk_send', 'chunk_recv', 'chunk_write',
+               'data_close', 'auth']
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit('usage: {} trace_file'.format(sys.argv[0]))
+    with open(sys.argv[1], 'rb') as fin:
+        data = fin.read()
+    if data[:len(MAGIC)] != MAGIC:
+        sys.exit('bad trace file')
+    data = data[len(MAGIC):]
+    events = []
+    for off in range(0, len(data) - RECORD.size + 1, RECORD.size):
+        start, dur, arg, session, event, pid, tag = RECORD.unpack_from(
+            data, off)
+        name = EVENT_NAMES[event] if event < len(EVENT_NAMES) else str(event)
+        tag = tag.rstrip(b'\0').decode('ascii', 'replace')
+        ev = {'name': tag or name, 'cat': name, 'ph': 'X',
+              'ts': start / 1e3, 'dur': dur / 1e3,
+              'pid': pid, 'tid': session}
+        if arg:
+            ev['args'] = {'bytes': arg}
+        events.append(ev)
+    events.sort(key=lambda e: e['ts'])
+    json.dump({'traceEvents': events, 'displayTimeUnit': 'ms'}, sys.stdout)
+
+
+if __name__ == '__main__':
+    main()